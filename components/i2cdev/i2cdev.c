@@ -34,24 +34,55 @@
 #include <inttypes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <driver/gpio.h>
 #include <esp_log.h>
+#include <ets_sys.h>
 #include "i2cdev.h"
 
 static const char *TAG = "i2cdev";
 
+_Static_assert(CONFIG_I2CDEV_NOTIFY_INDEX < configTASK_NOTIFICATION_ARRAY_ENTRIES,
+        "CONFIG_I2CDEV_NOTIFY_INDEX must be below CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES");
+
+// The driver writes from a single buffer, so a register address and the
+// data written after it are joined in the device slot
+#define WRITE_BUF_SIZE 32
+
+/*
+ * A device added to the bus of a port. The driver runs the transactions of
+ * a device in order and calls back with the device, so each device has at
+ * most one pending transaction and the callback finds it here.
+ */
+typedef struct {
+    bool used;
+    uint8_t addr;
+    uint32_t clk_speed;
+    i2c_master_dev_handle_t handle;
+    i2c_dev_transaction_t *pending;  // guarded by pending_lock
+    // Descriptor and write buffer of the blocking functions, only touched
+    // by the caller that has claimed the slot with it
+    i2c_dev_transaction_t trans;
+    uint8_t write_buf[WRITE_BUF_SIZE];
+} i2c_dev_slot_t;
+
 typedef struct {
     SemaphoreHandle_t lock;
-    i2c_config_t config;
-    bool installed;
+    i2c_dev_config_t config;
+    i2c_master_bus_handle_t bus;
+    i2c_dev_slot_t slots[CONFIG_I2CDEV_MAX_DEVICES];
 } i2c_port_state_t;
 
 static i2c_port_state_t states[I2C_NUM_MAX];
 
+// Claiming a slot is atomic even with CONFIG_I2CDEV_NOLOCK, so two callers
+// can never fill the same descriptor
+static portMUX_TYPE pending_lock = portMUX_INITIALIZER_UNLOCKED;
+
 #if CONFIG_I2CDEV_NOLOCK
-#define SEMAPHORE_TAKE(port)
+#define SEMAPHORE_TAKE_TIMEOUT(port, timeout)
 #else
-#define SEMAPHORE_TAKE(port) do { \
-        if (!xSemaphoreTake(states[port].lock, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT))) \
+#define SEMAPHORE_TAKE_TIMEOUT(port, timeout) do { \
+        if (!xSemaphoreTake(states[port].lock, timeout)) \
         { \
             ESP_LOGE(TAG, "Could not take port mutex %d", port); \
             return ESP_ERR_TIMEOUT; \
@@ -71,6 +102,139 @@ static i2c_port_state_t states[I2C_NUM_MAX];
         } while (0)
 #endif
 
+static TickType_t ticks_left(TickType_t start, TickType_t timeout)
+{
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    return elapsed < timeout ? timeout - elapsed : 0;
+}
+
+static int ticks_to_ms(TickType_t ticks)
+{
+    // The driver takes 0 as do not wait at all
+    return ticks ? (int)pdTICKS_TO_MS(ticks) + 1 : 0;
+}
+
+static bool complete(i2c_dev_transaction_t *trans, esp_err_t result, bool from_isr)
+{
+    // The caller may reuse the descriptor as soon as result is set
+    i2c_dev_callback_t callback = trans->callback;
+    TaskHandle_t notify = trans->notify;
+    BaseType_t woken = pdFALSE;
+
+    trans->result = result;
+
+    if (callback && callback(trans))
+        woken = pdTRUE;
+    if (notify)
+    {
+        if (from_isr)
+            vTaskNotifyGiveIndexedFromISR(notify, CONFIG_I2CDEV_NOTIFY_INDEX, &woken);
+        else
+            xTaskNotifyGiveIndexed(notify, CONFIG_I2CDEV_NOTIFY_INDEX);
+    }
+    return woken == pdTRUE;
+}
+
+static bool trans_done(i2c_master_dev_handle_t handle, const i2c_master_event_data_t *event, void *arg)
+{
+    i2c_dev_slot_t *slot = arg;
+
+    if (event->event == I2C_EVENT_ALIVE)
+        return false;
+
+    portENTER_CRITICAL_ISR(&pending_lock);
+    i2c_dev_transaction_t *trans = slot->pending;
+    slot->pending = NULL;
+    portEXIT_CRITICAL_ISR(&pending_lock);
+
+    if (!trans)
+        return false;
+
+    esp_err_t result = event->event == I2C_EVENT_DONE ? ESP_OK
+        : event->event == I2C_EVENT_NACK ? ESP_FAIL
+        : ESP_ERR_TIMEOUT;
+    return complete(trans, result, true);
+}
+
+static esp_err_t claim(i2c_dev_slot_t *slot, i2c_dev_transaction_t *trans)
+{
+    portENTER_CRITICAL(&pending_lock);
+    bool busy = slot->pending != NULL;
+    if (!busy)
+        slot->pending = trans;
+    portEXIT_CRITICAL(&pending_lock);
+
+    return busy ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
+
+static void unclaim(i2c_dev_slot_t *slot, i2c_dev_transaction_t *trans)
+{
+    portENTER_CRITICAL(&pending_lock);
+    if (slot->pending == trans)
+        slot->pending = NULL;
+    portEXIT_CRITICAL(&pending_lock);
+}
+
+/*
+ * Hand a claimed transaction to the driver, which runs it in the background
+ * and calls trans_done() at the end
+ */
+static esp_err_t issue(i2c_dev_slot_t *slot, i2c_dev_transaction_t *trans, TickType_t timeout)
+{
+    int timeout_ms = ticks_to_ms(timeout);
+    esp_err_t res;
+
+    trans->result = ESP_ERR_NOT_FINISHED;
+
+    if (!trans->in_size)
+        res = i2c_master_transmit(slot->handle, trans->out_data, trans->out_size, timeout_ms);
+    else if (!trans->out_size)
+        res = i2c_master_receive(slot->handle, trans->in_data, trans->in_size, timeout_ms);
+    else
+        res = i2c_master_transmit_receive(slot->handle, trans->out_data, trans->out_size,
+                trans->in_data, trans->in_size, timeout_ms);
+
+    if (res != ESP_OK)
+    {
+        unclaim(slot, trans);
+        trans->result = res;
+    }
+    return res;
+}
+
+/*
+ * Remove every device and the bus of a port, called with the port lock held.
+ * Transactions still pending will never be called back, so they are
+ * completed here.
+ */
+static void release_bus(i2c_port_t port)
+{
+    i2c_port_state_t *state = &states[port];
+
+    for (int i = 0; i < CONFIG_I2CDEV_MAX_DEVICES; i++)
+    {
+        i2c_dev_slot_t *slot = &state->slots[i];
+        if (!slot->handle) continue;
+
+        portENTER_CRITICAL(&pending_lock);
+        i2c_dev_transaction_t *trans = slot->pending;
+        slot->pending = NULL;
+        portEXIT_CRITICAL(&pending_lock);
+
+        i2c_master_bus_rm_device(slot->handle);
+        slot->handle = NULL;
+
+        if (trans)
+            complete(trans, ESP_ERR_TIMEOUT, false);
+    }
+
+    if (state->bus)
+    {
+        i2c_del_master_bus(state->bus);
+        state->bus = NULL;
+    }
+}
+
 esp_err_t i2cdev_init()
 {
     memset(states, 0, sizeof(states));
@@ -96,11 +260,10 @@ esp_err_t i2cdev_done()
     {
         if (!states[i].lock) continue;
 
-        if (states[i].installed)
+        if (states[i].bus)
         {
-            SEMAPHORE_TAKE(i);
-            i2c_driver_delete(i);
-            states[i].installed = false;
+            SEMAPHORE_TAKE_TIMEOUT(i, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
+            release_bus(i);
             SEMAPHORE_GIVE(i);
         }
 #if !CONFIG_I2CDEV_NOLOCK
@@ -142,13 +305,18 @@ esp_err_t i2c_dev_delete_mutex(i2c_dev_t *dev)
 }
 
 esp_err_t i2c_dev_take_mutex(i2c_dev_t *dev)
+{
+    return i2c_dev_take_mutex_timeout(dev, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
+}
+
+esp_err_t i2c_dev_take_mutex_timeout(i2c_dev_t *dev, TickType_t timeout)
 {
 #if !CONFIG_I2CDEV_NOLOCK
     if (!dev) return ESP_ERR_INVALID_ARG;
 
     ESP_LOGV(TAG, "[0x%02x at %d] taking mutex", dev->addr, dev->port);
 
-    if (!xSemaphoreTake(dev->mutex, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT)))
+    if (!xSemaphoreTake(dev->mutex, timeout))
     {
         ESP_LOGE(TAG, "[0x%02x at %d] Could not take device mutex", dev->addr, dev->port);
         return ESP_ERR_TIMEOUT;
@@ -173,17 +341,10 @@ esp_err_t i2c_dev_give_mutex(i2c_dev_t *dev)
     return ESP_OK;
 }
 
-inline static bool cfg_equal(const i2c_config_t *a, const i2c_config_t *b)
+inline static bool cfg_equal(const i2c_dev_config_t *a, const i2c_dev_config_t *b)
 {
     return a->scl_io_num == b->scl_io_num
         && a->sda_io_num == b->sda_io_num
-#if HELPER_TARGET_IS_ESP32
-        && a->master.clk_speed == b->master.clk_speed
-#elif HELPER_TARGET_IS_ESP8266
-        && ((a->clk_stretch_tick && a->clk_stretch_tick == b->clk_stretch_tick) 
-            || (!a->clk_stretch_tick && b->clk_stretch_tick == I2CDEV_MAX_STRETCH_TIME)
-        ) // see line 232
-#endif
         && a->scl_pullup_en == b->scl_pullup_en
         && a->sda_pullup_en == b->sda_pullup_en;
 }
@@ -192,78 +353,125 @@ static esp_err_t i2c_setup_port(const i2c_dev_t *dev)
 {
     if (dev->port >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
 
-    esp_err_t res;
-    if (!cfg_equal(&dev->cfg, &states[dev->port].config) || !states[dev->port].installed)
+    i2c_port_state_t *state = &states[dev->port];
+
+    if (state->bus && !cfg_equal(&dev->cfg, &state->config))
+    {
+        ESP_LOGD(TAG, "Reconfiguring I2C bus on port %d", dev->port);
+        release_bus(dev->port);
+    }
+    if (state->bus)
+        return ESP_OK;
+
+    i2c_master_bus_config_t bus_cfg = {
+        .i2c_port = dev->port,
+        .sda_io_num = dev->cfg.sda_io_num,
+        .scl_io_num = dev->cfg.scl_io_num,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = 7,
+        // Every device can have one transaction queued
+        .trans_queue_depth = CONFIG_I2CDEV_MAX_DEVICES,
+        .flags.enable_internal_pullup = dev->cfg.sda_pullup_en || dev->cfg.scl_pullup_en,
+    };
+    esp_err_t res = i2c_new_master_bus(&bus_cfg, &state->bus);
+    if (res != ESP_OK)
+    {
+        state->bus = NULL;
+        return res;
+    }
+
+    memcpy(&state->config, &dev->cfg, sizeof(i2c_dev_config_t));
+    ESP_LOGD(TAG, "I2C bus successfully set up on port %d", dev->port);
+
+    return ESP_OK;
+}
+
+/*
+ * Find the slot of a device, adding the device to the bus of its port on
+ * first use. Called with the port lock held.
+ */
+static esp_err_t i2c_setup_device(const i2c_dev_t *dev, i2c_dev_slot_t **ret)
+{
+    esp_err_t res = i2c_setup_port(dev);
+    if (res != ESP_OK) return res;
+
+    i2c_port_state_t *state = &states[dev->port];
+    i2c_dev_slot_t *slot = NULL;
+
+    for (int i = 0; i < CONFIG_I2CDEV_MAX_DEVICES && !slot; i++)
+        if (state->slots[i].used && state->slots[i].addr == dev->addr)
+            slot = &state->slots[i];
+    for (int i = 0; i < CONFIG_I2CDEV_MAX_DEVICES && !slot; i++)
+        if (!state->slots[i].used)
+            slot = &state->slots[i];
+    if (!slot)
+    {
+        ESP_LOGE(TAG, "[0x%02x at %d] More than %d devices on the port", dev->addr, dev->port,
+                CONFIG_I2CDEV_MAX_DEVICES);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (slot->handle && slot->clk_speed != dev->cfg.master.clk_speed)
     {
-        ESP_LOGD(TAG, "Reconfiguring I2C driver on port %d", dev->port);
-        i2c_config_t temp;
-        memcpy(&temp, &dev->cfg, sizeof(i2c_config_t));
-        temp.mode = I2C_MODE_MASTER;
+        if (slot->pending) return ESP_ERR_INVALID_STATE;
+        i2c_master_bus_rm_device(slot->handle);
+        slot->handle = NULL;
+    }
 
-        // Driver reinstallation
-        if (states[dev->port].installed)
+    if (!slot->handle)
+    {
+        i2c_device_config_t dev_cfg = {
+            .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+            .device_address = dev->addr,
+            .scl_speed_hz = dev->cfg.master.clk_speed,
+        };
+        if ((res = i2c_master_bus_add_device(state->bus, &dev_cfg, &slot->handle)) != ESP_OK)
         {
-            i2c_driver_delete(dev->port);
-            states[dev->port].installed = false;
-        }
-#if HELPER_TARGET_IS_ESP32
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
-        // See https://github.com/espressif/esp-idf/issues/10163
-        if ((res = i2c_driver_install(dev->port, temp.mode, 0, 0, 0)) != ESP_OK)
-            return res;
-        if ((res = i2c_param_config(dev->port, &temp)) != ESP_OK)
-            return res;
-#else
-        if ((res = i2c_param_config(dev->port, &temp)) != ESP_OK)
-            return res;
-        if ((res = i2c_driver_install(dev->port, temp.mode, 0, 0, 0)) != ESP_OK)
-            return res;
-#endif
-#endif
-#if HELPER_TARGET_IS_ESP8266
-        // Clock Stretch time, depending on CPU frequency
-        temp.clk_stretch_tick = dev->timeout_ticks ? dev->timeout_ticks : I2CDEV_MAX_STRETCH_TIME;
-        if ((res = i2c_driver_install(dev->port, temp.mode)) != ESP_OK)
+            slot->handle = NULL;
             return res;
-        if ((res = i2c_param_config(dev->port, &temp)) != ESP_OK)
+        }
+
+        // With a callback every transfer of the device is asynchronous
+        i2c_master_event_callbacks_t cbs = {
+            .on_trans_done = trans_done,
+        };
+        if ((res = i2c_master_register_event_callbacks(slot->handle, &cbs, slot)) != ESP_OK)
+        {
+            i2c_master_bus_rm_device(slot->handle);
+            slot->handle = NULL;
             return res;
-#endif
-        states[dev->port].installed = true;
+        }
 
-        memcpy(&states[dev->port].config, &temp, sizeof(i2c_config_t));
-        ESP_LOGD(TAG, "I2C driver successfully reconfigured on port %d", dev->port);
+        slot->used = true;
+        slot->addr = dev->addr;
+        slot->clk_speed = dev->cfg.master.clk_speed;
     }
-#if HELPER_TARGET_IS_ESP32
-    int t;
-    if ((res = i2c_get_timeout(dev->port, &t)) != ESP_OK)
-        return res;
-    // Timeout cannot be 0
-    uint32_t ticks = dev->timeout_ticks ? dev->timeout_ticks : I2CDEV_MAX_STRETCH_TIME;
-    if ((ticks != t) && (res = i2c_set_timeout(dev->port, ticks)) != ESP_OK)
-        return res;
-    ESP_LOGD(TAG, "Timeout: ticks = %" PRIu32 " (%" PRIu32 " usec) on port %d", dev->timeout_ticks, dev->timeout_ticks / 80, dev->port);
-#endif
 
+    *ret = slot;
     return ESP_OK;
 }
 
 esp_err_t i2c_dev_probe(const i2c_dev_t *dev, i2c_dev_type_t operation_type)
+{
+    return i2c_dev_probe_timeout(dev, operation_type, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
+}
+
+esp_err_t i2c_dev_probe_timeout(const i2c_dev_t *dev, i2c_dev_type_t operation_type, TickType_t timeout)
 {
     if (!dev) return ESP_ERR_INVALID_ARG;
 
-    SEMAPHORE_TAKE(dev->port);
+    (void)operation_type;
+
+    TickType_t start = xTaskGetTickCount();
+
+    SEMAPHORE_TAKE_TIMEOUT(dev->port, timeout);
 
     esp_err_t res = i2c_setup_port(dev);
     if (res == ESP_OK)
     {
-        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-        i2c_master_start(cmd);
-        i2c_master_write_byte(cmd, dev->addr << 1 | (operation_type == I2C_DEV_READ ? 1 : 0), true);
-        i2c_master_stop(cmd);
-
-        res = i2c_master_cmd_begin(dev->port, cmd, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
-
-        i2c_cmd_link_delete(cmd);
+        // Do not start a probe that has no time left to finish
+        int left = ticks_to_ms(ticks_left(start, timeout));
+        res = left ? i2c_master_probe(states[dev->port].bus, dev->addr, left) : ESP_ERR_TIMEOUT;
     }
 
     SEMAPHORE_GIVE(dev->port);
@@ -271,61 +479,191 @@ esp_err_t i2c_dev_probe(const i2c_dev_t *dev, i2c_dev_type_t operation_type)
     return res;
 }
 
-esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size)
+esp_err_t i2c_dev_submit(const i2c_dev_t *dev, i2c_dev_transaction_t *trans, TickType_t timeout)
 {
-    if (!dev || !in_data || !in_size) return ESP_ERR_INVALID_ARG;
+    if (!dev || !trans || (!trans->out_size && !trans->in_size)
+            || (trans->out_size && !trans->out_data) || (trans->in_size && !trans->in_data))
+        return ESP_ERR_INVALID_ARG;
 
-    SEMAPHORE_TAKE(dev->port);
+    TickType_t start = xTaskGetTickCount();
 
-    esp_err_t res = i2c_setup_port(dev);
+    SEMAPHORE_TAKE_TIMEOUT(dev->port, timeout);
+
+    i2c_dev_slot_t *slot;
+    esp_err_t res = i2c_setup_device(dev, &slot);
+    if (res == ESP_OK)
+        res = claim(slot, trans);
     if (res == ESP_OK)
+        res = issue(slot, trans, ticks_left(start, timeout));
+
+    SEMAPHORE_GIVE(dev->port);
+
+    return res;
+}
+
+esp_err_t i2c_dev_wait(i2c_dev_transaction_t *trans, TickType_t timeout)
+{
+    if (!trans) return ESP_ERR_INVALID_ARG;
+
+    TickType_t start = xTaskGetTickCount();
+
+    // A notification may be left over from a transaction that completed
+    // after its waiter gave up, so only the result counts
+    while (trans->result == ESP_ERR_NOT_FINISHED)
+    {
+        TickType_t left = ticks_left(start, timeout);
+        if (!left)
+            return ESP_ERR_TIMEOUT;
+        ulTaskNotifyTakeIndexed(CONFIG_I2CDEV_NOTIFY_INDEX, pdTRUE, left);
+    }
+
+    return trans->result;
+}
+
+/*
+ * Write out_reg and out_data, then read in_size bytes after a repeated start
+ * if in_size is not 0. Runs on the descriptor of the device slot, the port
+ * lock is only held until it is queued.
+ */
+static esp_err_t transfer(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size,
+        const void *out_data, size_t out_size, void *in_data, size_t in_size, TickType_t timeout)
+{
+    if (!out_reg) out_reg_size = 0;
+    if (!out_data) out_size = 0;
+    if (!in_data) in_size = 0;
+    if (out_reg_size && out_size && out_reg_size + out_size > WRITE_BUF_SIZE)
+        return ESP_ERR_INVALID_SIZE;
+
+    TickType_t start = xTaskGetTickCount();
+
+    SEMAPHORE_TAKE_TIMEOUT(dev->port, timeout);
+
+    i2c_dev_slot_t *slot;
+    i2c_dev_transaction_t *trans = NULL;
+    esp_err_t res = i2c_setup_device(dev, &slot);
+    if (res == ESP_OK && (res = claim(slot, &slot->trans)) == ESP_OK)
     {
-        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-        if (out_data && out_size)
+        trans = &slot->trans;
+        if (out_reg_size && out_size)
         {
-            i2c_master_start(cmd);
-            i2c_master_write_byte(cmd, dev->addr << 1, true);
-            i2c_master_write(cmd, (void *)out_data, out_size, true);
+            memcpy(slot->write_buf, out_reg, out_reg_size);
+            memcpy(slot->write_buf + out_reg_size, out_data, out_size);
+            trans->out_data = slot->write_buf;
+            trans->out_size = out_reg_size + out_size;
         }
-        i2c_master_start(cmd);
-        i2c_master_write_byte(cmd, (dev->addr << 1) | 1, true);
-        i2c_master_read(cmd, in_data, in_size, I2C_MASTER_LAST_NACK);
-        i2c_master_stop(cmd);
-
-        res = i2c_master_cmd_begin(dev->port, cmd, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
-        if (res != ESP_OK)
-            ESP_LOGE(TAG, "Could not read from device [0x%02x at %d]: %d (%s)", dev->addr, dev->port, res, esp_err_to_name(res));
+        else
+        {
+            trans->out_data = out_reg_size ? out_reg : out_data;
+            trans->out_size = out_reg_size ? out_reg_size : out_size;
+        }
+        trans->in_data = in_data;
+        trans->in_size = in_size;
+        trans->callback = NULL;
+        trans->arg = NULL;
+        trans->notify = xTaskGetCurrentTaskHandle();
 
-        i2c_cmd_link_delete(cmd);
+        res = issue(slot, trans, ticks_left(start, timeout));
     }
 
     SEMAPHORE_GIVE(dev->port);
+
+    // The wait for the port counts against the same deadline
+    if (res == ESP_OK)
+        res = i2c_dev_wait(trans, ticks_left(start, timeout));
+    if (res != ESP_OK)
+        ESP_LOGE(TAG, "Could not %s device [0x%02x at %d]: %d (%s)", in_size ? "read from" : "write to",
+                dev->addr, dev->port, res, esp_err_to_name(res));
+
     return res;
 }
 
-esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size)
+esp_err_t i2c_dev_read_timeout(const i2c_dev_t *dev, const void *out_data, size_t out_size,
+        void *in_data, size_t in_size, TickType_t timeout)
+{
+    if (!dev || !in_data || !in_size) return ESP_ERR_INVALID_ARG;
+
+    return transfer(dev, NULL, 0, out_data, out_size, in_data, in_size, timeout);
+}
+
+esp_err_t i2c_dev_write_timeout(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size,
+        const void *out_data, size_t out_size, TickType_t timeout)
 {
     if (!dev || !out_data || !out_size) return ESP_ERR_INVALID_ARG;
 
-    SEMAPHORE_TAKE(dev->port);
+    return transfer(dev, out_reg, out_reg_size, out_data, out_size, NULL, 0, timeout);
+}
 
-    esp_err_t res = i2c_setup_port(dev);
+esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data, size_t out_size, void *in_data, size_t in_size)
+{
+    return i2c_dev_read_timeout(dev, out_data, out_size, in_data, in_size, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
+}
+
+esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg, size_t out_reg_size, const void *out_data, size_t out_size)
+{
+    return i2c_dev_write_timeout(dev, out_reg, out_reg_size, out_data, out_size, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
+}
+
+// Half of a 100 kHz SCL period
+#define RECOVER_HALF_PERIOD_US 5
+#define RECOVER_CLOCKS 9
+
+esp_err_t i2c_dev_bus_recover(const i2c_dev_t *dev, TickType_t timeout)
+{
+    if (!dev || dev->port >= I2C_NUM_MAX) return ESP_ERR_INVALID_ARG;
+
+    SEMAPHORE_TAKE_TIMEOUT(dev->port, timeout);
+
+    ESP_LOGW(TAG, "Recovering bus on port %d", dev->port);
+
+    // Take the pins away from the I2C controller, the bus is set up again
+    // on the next transfer
+    release_bus(dev->port);
+
+    gpio_num_t sda = dev->cfg.sda_io_num;
+    gpio_num_t scl = dev->cfg.scl_io_num;
+    gpio_config_t io = {
+        .pin_bit_mask = (1ULL << sda) | (1ULL << scl),
+        .mode = GPIO_MODE_INPUT_OUTPUT_OD,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    esp_err_t res = gpio_config(&io);
     if (res == ESP_OK)
     {
-        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-        i2c_master_start(cmd);
-        i2c_master_write_byte(cmd, dev->addr << 1, true);
-        if (out_reg && out_reg_size)
-            i2c_master_write(cmd, (void *)out_reg, out_reg_size, true);
-        i2c_master_write(cmd, (void *)out_data, out_size, true);
-        i2c_master_stop(cmd);
-        res = i2c_master_cmd_begin(dev->port, cmd, pdMS_TO_TICKS(CONFIG_I2CDEV_TIMEOUT));
-        if (res != ESP_OK)
-            ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->addr, dev->port, res, esp_err_to_name(res));
-        i2c_cmd_link_delete(cmd);
+        gpio_set_level(sda, 1);
+        gpio_set_level(scl, 1);
+        ets_delay_us(RECOVER_HALF_PERIOD_US);
+
+        // A slave stuck in the middle of a read holds SDA low until it has
+        // shifted out the rest of its byte, clock until it lets go
+        for (int i = 0; i < RECOVER_CLOCKS && !gpio_get_level(sda); i++)
+        {
+            gpio_set_level(scl, 0);
+            ets_delay_us(RECOVER_HALF_PERIOD_US);
+            gpio_set_level(scl, 1);
+            ets_delay_us(RECOVER_HALF_PERIOD_US);
+        }
+
+        // STOP condition
+        gpio_set_level(scl, 0);
+        ets_delay_us(RECOVER_HALF_PERIOD_US);
+        gpio_set_level(sda, 0);
+        ets_delay_us(RECOVER_HALF_PERIOD_US);
+        gpio_set_level(scl, 1);
+        ets_delay_us(RECOVER_HALF_PERIOD_US);
+        gpio_set_level(sda, 1);
+        ets_delay_us(RECOVER_HALF_PERIOD_US);
+
+        if (!gpio_get_level(sda))
+        {
+            ESP_LOGE(TAG, "SDA still held low on port %d", dev->port);
+            res = ESP_FAIL;
+        }
     }
 
     SEMAPHORE_GIVE(dev->port);
+
     return res;
 }
 
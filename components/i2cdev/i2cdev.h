@@ -35,32 +35,38 @@
 #ifndef __I2CDEV_H__
 #define __I2CDEV_H__
 
-#include <driver/i2c.h>
+#include <driver/i2c_master.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <esp_err.h>
 #include <esp_idf_lib_helpers.h>
 
-#ifdef __cplusplus
-extern "C" {
+#if !HELPER_TARGET_IS_ESP32 || ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 2, 0)
+#error "i2cdev is built on the i2c_master driver of ESP-IDF 5.2 or later"
 #endif
 
-#if HELPER_TARGET_IS_ESP8266
-
-#define I2CDEV_MAX_STRETCH_TIME 0xffffffff
-
-#else
-
-#include <soc/i2c_reg.h>
-#if defined(I2C_TIME_OUT_VALUE_V)
-#define I2CDEV_MAX_STRETCH_TIME I2C_TIME_OUT_VALUE_V
-#elif defined(I2C_TIME_OUT_REG_V)
-#define I2CDEV_MAX_STRETCH_TIME I2C_TIME_OUT_REG_V
-#else
-#define I2CDEV_MAX_STRETCH_TIME 0x00ffffff
+#ifdef __cplusplus
+extern "C" {
 #endif
 
-#endif /* HELPER_TARGET_IS_ESP8266 */
+/**
+ * I2C bus and device configuration
+ *
+ * Same field names as the legacy `i2c_config_t`, so descriptors are filled
+ * in the same way.
+ */
+typedef struct
+{
+    gpio_num_t sda_io_num;   //!< SDA GPIO
+    gpio_num_t scl_io_num;   //!< SCL GPIO
+    bool sda_pullup_en;      //!< Enable the internal pull-ups of the bus
+    bool scl_pullup_en;      //!< Enable the internal pull-ups of the bus
+    struct
+    {
+        uint32_t clk_speed;  //!< SCL frequency for this device, Hz
+    } master;
+} i2c_dev_config_t;
 
 /**
  * I2C device descriptor
@@ -68,14 +74,45 @@ extern "C" {
 typedef struct
 {
     i2c_port_t port;         //!< I2C port number
-    i2c_config_t cfg;        //!< I2C driver configuration
+    i2c_dev_config_t cfg;    //!< I2C bus and device configuration
     uint8_t addr;            //!< Unshifted address
     SemaphoreHandle_t mutex; //!< Device mutex
-    uint32_t timeout_ticks;  /*!< HW I2C bus timeout (stretch time), in ticks. 80MHz APB clock
-                                  ticks for ESP-IDF, CPU ticks for ESP8266.
-                                  When this value is 0, I2CDEV_MAX_STRETCH_TIME will be used */
 } i2c_dev_t;
 
+typedef struct i2c_dev_transaction_s i2c_dev_transaction_t;
+
+/**
+ * Transaction completion callback
+ *
+ * Called from the I2C interrupt, or from the task that recovers the bus if
+ * the transaction is dropped, so it has to be short and ISR safe.
+ *
+ * @return Whether a higher priority task was woken
+ */
+typedef bool (*i2c_dev_callback_t)(i2c_dev_transaction_t *trans);
+
+/**
+ * Asynchronous transaction descriptor
+ *
+ * Owned by the caller, usually allocated statically next to the device
+ * descriptor. The descriptor and its buffers must stay untouched from
+ * ::i2c_dev_submit() until \p result is no longer `ESP_ERR_NOT_FINISHED`.
+ *
+ * The transaction writes \p out_size bytes, then reads \p in_size bytes
+ * after a repeated start if both are set.
+ */
+struct i2c_dev_transaction_s
+{
+    const void *out_data;        //!< Data to send, may be NULL if \p out_size is 0
+    size_t out_size;             //!< Number of bytes to send
+    void *in_data;               //!< Input data buffer, may be NULL if \p in_size is 0
+    size_t in_size;              //!< Number of bytes to read
+    i2c_dev_callback_t callback; //!< Called on completion if not NULL
+    void *arg;                   //!< For the callback
+    TaskHandle_t notify;         //!< Task notified on completion if not NULL
+    volatile esp_err_t result;   //!< `ESP_ERR_NOT_FINISHED` while queued or running
+};
+
 /**
  * I2C transaction type
  */
@@ -133,6 +170,17 @@ esp_err_t i2c_dev_delete_mutex(i2c_dev_t *dev);
  */
 esp_err_t i2c_dev_take_mutex(i2c_dev_t *dev);
 
+/**
+ * @brief Take device mutex, waiting no longer than \p timeout
+ *
+ * This function does nothing if option CONFIG_I2CDEV_NOLOCK is enabled.
+ *
+ * @param dev Device descriptor
+ * @param timeout Maximum time to wait, in ticks
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the mutex was not free in time
+ */
+esp_err_t i2c_dev_take_mutex_timeout(i2c_dev_t *dev, TickType_t timeout);
+
 /**
  * @brief Give device mutex
  *
@@ -146,20 +194,36 @@ esp_err_t i2c_dev_give_mutex(i2c_dev_t *dev);
 /**
  * @brief Check the availability of the device
  *
- * Issue an operation of \p operation_type to the I2C device then stops.
+ * Issue an address byte to the I2C device then stops. The i2c_master driver
+ * always probes with a write, \p operation_type is kept for compatibility.
  *
  * @param dev Device descriptor
- * @param operation_type Operation type
+ * @param operation_type Operation type, ignored
  * @return ESP_OK if device is available
  */
 esp_err_t i2c_dev_probe(const i2c_dev_t *dev, i2c_dev_type_t operation_type);
 
+/**
+ * @brief Check the availability of the device with a custom timeout
+ *
+ * Same as ::i2c_dev_probe(), but the port lock and the probe together take
+ * no longer than \p timeout instead of `CONFIG_I2CDEV_TIMEOUT`.
+ *
+ * @param dev Device descriptor
+ * @param operation_type Operation type, ignored
+ * @param timeout Maximum time for the whole call, in ticks
+ * @return ESP_OK if device is available
+ */
+esp_err_t i2c_dev_probe_timeout(const i2c_dev_t *dev, i2c_dev_type_t operation_type, TickType_t timeout);
+
 /**
  * @brief Read from slave device
  *
  * Issue a send operation of \p out_data register address, followed by reading \p in_size bytes
  * from slave into \p in_data .
- * Function is thread-safe.
+ * Function is thread-safe. The transaction runs like one submitted with
+ * ::i2c_dev_submit(), the caller sleeps on its task notification
+ * `CONFIG_I2CDEV_NOTIFY_INDEX` until it completes.
  *
  * @param dev Device descriptor
  * @param out_data Pointer to data to send if non-null
@@ -175,7 +239,8 @@ esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data,
  * @brief Write to slave device
  *
  * Write \p out_size bytes from \p out_data to slave into \p out_reg register address.
- * Function is thread-safe.
+ * Function is thread-safe and waits like ::i2c_dev_read(). Register address
+ * and data together can be up to 32 bytes.
  *
  * @param dev Device descriptor
  * @param out_reg Pointer to register address to send if non-null
@@ -187,6 +252,56 @@ esp_err_t i2c_dev_read(const i2c_dev_t *dev, const void *out_data,
 esp_err_t i2c_dev_write(const i2c_dev_t *dev, const void *out_reg,
         size_t out_reg_size, const void *out_data, size_t out_size);
 
+/**
+ * @brief Read from slave device with a deadline
+ *
+ * Same as ::i2c_dev_read(), but waits at most \p timeout for the port and
+ * the transfer together instead of `CONFIG_I2CDEV_TIMEOUT`. Use the execution
+ * time from the datasheet plus a margin, so a hung device costs no more than
+ * that.
+ *
+ * @param dev Device descriptor
+ * @param out_data Pointer to data to send if non-null
+ * @param out_size Size of data to send
+ * @param[out] in_data Pointer to input data buffer
+ * @param in_size Number of byte to read
+ * @param timeout Deadline, in ticks
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the deadline passed
+ */
+esp_err_t i2c_dev_read_timeout(const i2c_dev_t *dev, const void *out_data,
+        size_t out_size, void *in_data, size_t in_size, TickType_t timeout);
+
+/**
+ * @brief Write to slave device with a deadline
+ *
+ * Same as ::i2c_dev_write(), but waits at most \p timeout for the port and
+ * the transfer together instead of `CONFIG_I2CDEV_TIMEOUT`.
+ *
+ * @param dev Device descriptor
+ * @param out_reg Pointer to register address to send if non-null
+ * @param out_reg_size Size of register address
+ * @param out_data Pointer to data to send
+ * @param out_size Size of data to send
+ * @param timeout Deadline, in ticks
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if the deadline passed
+ */
+esp_err_t i2c_dev_write_timeout(const i2c_dev_t *dev, const void *out_reg,
+        size_t out_reg_size, const void *out_data, size_t out_size, TickType_t timeout);
+
+/**
+ * @brief Free a stuck bus
+ *
+ * Releases the port from the I2C controller, clocks SCL until a slave that
+ * holds SDA low lets go, then sends a STOP condition. Transactions still
+ * queued on the port complete with `ESP_ERR_TIMEOUT`, the bus is set up
+ * again on the next transfer.
+ *
+ * @param dev Device descriptor, any device on the bus
+ * @param timeout Maximum time to wait for the port, in ticks
+ * @return ESP_OK if SDA is released, ESP_ERR_TIMEOUT if the port stayed busy
+ */
+esp_err_t i2c_dev_bus_recover(const i2c_dev_t *dev, TickType_t timeout);
+
 /**
  * @brief Read from register with an 8-bit address
  *
@@ -215,11 +330,48 @@ esp_err_t i2c_dev_read_reg(const i2c_dev_t *dev, uint8_t reg,
 esp_err_t i2c_dev_write_reg(const i2c_dev_t *dev, uint8_t reg,
         const void *out_data, size_t out_size);
 
+/**
+ * @brief Queue a transaction without waiting for it
+ *
+ * Returns as soon as the transaction is queued on the bus, the caller is
+ * free to do other work until the callback runs or \p notify is notified on
+ * its task notification `CONFIG_I2CDEV_NOTIFY_INDEX`. A device runs one
+ * transaction at a time, while one is pending every other transfer to the
+ * same device fails with `ESP_ERR_INVALID_STATE`. Devices on the same port
+ * are queued behind each other.
+ *
+ * @param dev Device descriptor
+ * @param trans Transaction descriptor
+ * @param timeout Maximum time to wait for the port and the queue, in ticks
+ * @return ESP_OK if queued, ESP_ERR_INVALID_STATE if the device already has
+ *         a transaction pending, ESP_ERR_TIMEOUT if the port stayed busy
+ */
+esp_err_t i2c_dev_submit(const i2c_dev_t *dev, i2c_dev_transaction_t *trans, TickType_t timeout);
+
+/**
+ * @brief Wait for a submitted transaction to complete
+ *
+ * Sleeps on task notification `CONFIG_I2CDEV_NOTIFY_INDEX`, so \p notify of
+ * the descriptor must be the calling task. If this times out the
+ * transaction is still pending and the descriptor must not be reused yet.
+ *
+ * @param trans Transaction descriptor
+ * @param timeout Maximum time to wait, in ticks
+ * @return Result of the transaction, ESP_ERR_TIMEOUT if it did not complete
+ *         in time
+ */
+esp_err_t i2c_dev_wait(i2c_dev_transaction_t *trans, TickType_t timeout);
+
 #define I2C_DEV_TAKE_MUTEX(dev) do { \
         esp_err_t __ = i2c_dev_take_mutex(dev); \
         if (__ != ESP_OK) return __;\
     } while (0)
 
+#define I2C_DEV_TAKE_MUTEX_TIMEOUT(dev, timeout) do { \
+        esp_err_t __ = i2c_dev_take_mutex_timeout(dev, timeout); \
+        if (__ != ESP_OK) return __;\
+    } while (0)
+
 #define I2C_DEV_GIVE_MUTEX(dev) do { \
         esp_err_t __ = i2c_dev_give_mutex(dev); \
         if (__ != ESP_OK) return __;\
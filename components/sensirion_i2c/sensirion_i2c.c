@@ -0,0 +1,429 @@
+/**
+ * @file sensirion_i2c.c
+ *
+ * Word protocol shared by the Sensirion drivers
+ */
+#include <string.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <ets_sys.h>
+#include "sensirion_i2c.h"
+
+static const char *TAG = "sensirion_i2c";
+
+#define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
+#define CHECK_ARG(ARG) do { if (!(ARG)) return ESP_ERR_INVALID_ARG; } while (0)
+
+// CRC-8, polynomial 0x31, init 0xff, as used by all Sensirion devices
+static const uint8_t crc8_table[256] = {
+    0x00, 0x31, 0x62, 0x53, 0xc4, 0xf5, 0xa6, 0x97, 0xb9, 0x88, 0xdb, 0xea, 0x7d, 0x4c, 0x1f, 0x2e,
+    0x43, 0x72, 0x21, 0x10, 0x87, 0xb6, 0xe5, 0xd4, 0xfa, 0xcb, 0x98, 0xa9, 0x3e, 0x0f, 0x5c, 0x6d,
+    0x86, 0xb7, 0xe4, 0xd5, 0x42, 0x73, 0x20, 0x11, 0x3f, 0x0e, 0x5d, 0x6c, 0xfb, 0xca, 0x99, 0xa8,
+    0xc5, 0xf4, 0xa7, 0x96, 0x01, 0x30, 0x63, 0x52, 0x7c, 0x4d, 0x1e, 0x2f, 0xb8, 0x89, 0xda, 0xeb,
+    0x3d, 0x0c, 0x5f, 0x6e, 0xf9, 0xc8, 0x9b, 0xaa, 0x84, 0xb5, 0xe6, 0xd7, 0x40, 0x71, 0x22, 0x13,
+    0x7e, 0x4f, 0x1c, 0x2d, 0xba, 0x8b, 0xd8, 0xe9, 0xc7, 0xf6, 0xa5, 0x94, 0x03, 0x32, 0x61, 0x50,
+    0xbb, 0x8a, 0xd9, 0xe8, 0x7f, 0x4e, 0x1d, 0x2c, 0x02, 0x33, 0x60, 0x51, 0xc6, 0xf7, 0xa4, 0x95,
+    0xf8, 0xc9, 0x9a, 0xab, 0x3c, 0x0d, 0x5e, 0x6f, 0x41, 0x70, 0x23, 0x12, 0x85, 0xb4, 0xe7, 0xd6,
+    0x7a, 0x4b, 0x18, 0x29, 0xbe, 0x8f, 0xdc, 0xed, 0xc3, 0xf2, 0xa1, 0x90, 0x07, 0x36, 0x65, 0x54,
+    0x39, 0x08, 0x5b, 0x6a, 0xfd, 0xcc, 0x9f, 0xae, 0x80, 0xb1, 0xe2, 0xd3, 0x44, 0x75, 0x26, 0x17,
+    0xfc, 0xcd, 0x9e, 0xaf, 0x38, 0x09, 0x5a, 0x6b, 0x45, 0x74, 0x27, 0x16, 0x81, 0xb0, 0xe3, 0xd2,
+    0xbf, 0x8e, 0xdd, 0xec, 0x7b, 0x4a, 0x19, 0x28, 0x06, 0x37, 0x64, 0x55, 0xc2, 0xf3, 0xa0, 0x91,
+    0x47, 0x76, 0x25, 0x14, 0x83, 0xb2, 0xe1, 0xd0, 0xfe, 0xcf, 0x9c, 0xad, 0x3a, 0x0b, 0x58, 0x69,
+    0x04, 0x35, 0x66, 0x57, 0xc0, 0xf1, 0xa2, 0x93, 0xbd, 0x8c, 0xdf, 0xee, 0x79, 0x48, 0x1b, 0x2a,
+    0xc1, 0xf0, 0xa3, 0x92, 0x05, 0x34, 0x67, 0x56, 0x78, 0x49, 0x1a, 0x2b, 0xbc, 0x8d, 0xde, 0xef,
+    0x82, 0xb3, 0xe0, 0xd1, 0x46, 0x77, 0x24, 0x15, 0x3b, 0x0a, 0x59, 0x68, 0xff, 0xce, 0x9d, 0xac,
+};
+
+uint8_t sensirion_i2c_crc8(const uint8_t *data, size_t count)
+{
+    uint8_t crc = SENSIRION_CRC8_INIT;
+
+    for (size_t i = 0; i < count; i++)
+        crc = crc8_table[crc ^ data[i]];
+
+    return crc;
+}
+
+static TickType_t deadline_after(uint32_t exec_ms)
+{
+    // one extra tick so a deadline never ends at the next tick boundary
+    return xTaskGetTickCount() + pdMS_TO_TICKS(exec_ms + SENSIRION_I2C_TIMEOUT_MS) + 1;
+}
+
+static TickType_t ticks_left(TickType_t deadline)
+{
+    TickType_t now = xTaskGetTickCount();
+    return (int32_t)(deadline - now) > 0 ? deadline - now : 0;
+}
+
+static void count_transfer(sensirion_i2c_dev_t *dev, esp_err_t res)
+{
+    dev->stats.transfers++;
+    if (res == ESP_ERR_INVALID_CRC)
+        dev->stats.crc_errors++;
+    else if (res != ESP_OK)
+        dev->stats.errors++;
+    dev->stats.last_error = res;
+}
+
+static size_t fill_cmd(uint8_t *buf, uint16_t cmd, const uint16_t *args, size_t nargs)
+{
+    buf[0] = cmd >> 8;
+    buf[1] = cmd & 0xff;
+
+    uint8_t *p = buf + SENSIRION_WORD_SIZE;
+    for (size_t i = 0; i < nargs; i++, p += SENSIRION_FRAME_SIZE(1))
+    {
+        p[0] = args[i] >> 8;
+        p[1] = args[i] & 0xff;
+        p[2] = sensirion_i2c_crc8(p, SENSIRION_WORD_SIZE);
+    }
+
+    return SENSIRION_WORD_SIZE + SENSIRION_FRAME_SIZE(nargs);
+}
+
+static esp_err_t check_frames(const uint8_t *frames, size_t words)
+{
+    for (size_t i = 0; i < words; i++)
+    {
+        const uint8_t *p = frames + SENSIRION_FRAME_SIZE(i);
+        uint8_t crc = sensirion_i2c_crc8(p, SENSIRION_WORD_SIZE);
+        if (crc != p[2])
+        {
+            ESP_LOGE(TAG, "Invalid CRC 0x%02x in word %d, expected 0x%02x", crc, (int)i, p[2]);
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+    return ESP_OK;
+}
+
+static void decode_frames(const uint8_t *frames, uint16_t *words, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *p = frames + SENSIRION_FRAME_SIZE(i);
+        words[i] = (p[0] << 8) | p[1];
+    }
+}
+
+static esp_err_t write_cmd(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs,
+        TickType_t deadline)
+{
+    if (nargs > SENSIRION_I2C_MAX_ARGS) return ESP_ERR_INVALID_SIZE;
+
+    uint8_t buf[SENSIRION_WORD_SIZE + SENSIRION_FRAME_SIZE(SENSIRION_I2C_MAX_ARGS)];
+    size_t len = fill_cmd(buf, cmd, args, nargs);
+
+    esp_err_t res = i2c_dev_write_timeout(&dev->i2c_dev, NULL, 0, buf, len, ticks_left(deadline));
+    count_transfer(dev, res);
+    return res;
+}
+
+static esp_err_t read_frames(sensirion_i2c_dev_t *dev, const uint16_t *cmd, uint8_t *frames, size_t words,
+        TickType_t deadline)
+{
+    uint8_t cmd_buf[SENSIRION_WORD_SIZE];
+    if (cmd)
+        fill_cmd(cmd_buf, *cmd, NULL, 0);
+
+    esp_err_t res = i2c_dev_read_timeout(&dev->i2c_dev, cmd ? cmd_buf : NULL, cmd ? sizeof(cmd_buf) : 0,
+            frames, SENSIRION_FRAME_SIZE(words), ticks_left(deadline));
+    if (res == ESP_OK)
+        res = check_frames(frames, words);
+    count_transfer(dev, res);
+    return res;
+}
+
+static void wait_ms(uint32_t ms)
+{
+    if (ms > 10)
+        vTaskDelay(pdMS_TO_TICKS(ms));
+    else if (ms)
+        ets_delay_us(ms * 1000);
+}
+
+static void send_reset(sensirion_i2c_dev_t *dev, TickType_t deadline)
+{
+    if (write_cmd(dev, dev->reset_cmd, NULL, 0, deadline) != ESP_OK)
+        return;
+
+    dev->stats.resets++;
+    dev->resetting = true;
+    dev->ready_at = xTaskGetTickCount() + pdMS_TO_TICKS(dev->reset_ms) + 1;
+}
+
+/*
+ * Finish a soft reset left by a failed call before a new call starts, called
+ * with the device mutex held. Returns the deadline the call has to use, which
+ * only moves if there was a reset to finish.
+ */
+static TickType_t settle(sensirion_i2c_dev_t *dev, TickType_t deadline, uint32_t exec_ms)
+{
+    if (!dev->reset_pending && !dev->resetting)
+        return deadline;
+
+    if (dev->reset_pending)
+    {
+        dev->reset_pending = false;
+        send_reset(dev, deadline_after(0));
+    }
+    if (dev->resetting)
+    {
+        TickType_t left = ticks_left(dev->ready_at);
+        if (left)
+            vTaskDelay(left);
+        dev->resetting = false;
+    }
+
+    return deadline_after(exec_ms);
+}
+
+/*
+ * Update health with the result of a call and escalate on failures. Called
+ * with the device mutex held, the escalation takes the port lock itself but
+ * waits for it no longer than what is left of the call's deadline.
+ */
+static esp_err_t finish(sensirion_i2c_dev_t *dev, esp_err_t res, TickType_t deadline)
+{
+    if (res == ESP_OK)
+    {
+        if (dev->health != SENSIRION_I2C_HEALTHY)
+            ESP_LOGI(TAG, "[0x%02x at %d] Recovered after %" PRIu32 " failures",
+                    dev->i2c_dev.addr, dev->i2c_dev.port, dev->failures);
+        dev->failures = 0;
+        dev->health = SENSIRION_I2C_HEALTHY;
+        return res;
+    }
+
+    dev->failures++;
+
+    if (dev->failures >= SENSIRION_I2C_RECOVER_AFTER
+            && i2c_dev_bus_recover(&dev->i2c_dev, ticks_left(deadline)) == ESP_OK)
+        dev->stats.recoveries++;
+
+    if (dev->failures >= SENSIRION_I2C_RESET_AFTER && dev->reset_cmd)
+    {
+        if (ticks_left(deadline))
+            send_reset(dev, deadline);
+        else
+            dev->reset_pending = true;
+    }
+
+    sensirion_i2c_health_t health = dev->failures >= SENSIRION_I2C_FAIL_AFTER
+        ? SENSIRION_I2C_FAILED
+        : SENSIRION_I2C_DEGRADED;
+    if (health != dev->health)
+        ESP_LOGW(TAG, "[0x%02x at %d] %s after %" PRIu32 " failures: %s",
+                dev->i2c_dev.addr, dev->i2c_dev.port,
+                health == SENSIRION_I2C_FAILED ? "Failed" : "Degraded",
+                dev->failures, esp_err_to_name(res));
+    dev->health = health;
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+esp_err_t sensirion_i2c_init_desc(sensirion_i2c_dev_t *dev, i2c_port_t port, uint8_t addr,
+        gpio_num_t sda_gpio, gpio_num_t scl_gpio, uint32_t clk_speed)
+{
+    CHECK_ARG(dev);
+
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->health = SENSIRION_I2C_HEALTHY;
+    dev->failures = 0;
+    dev->reset_cmd = 0;
+    dev->reset_ms = 0;
+    dev->reset_pending = false;
+    dev->resetting = false;
+    memset(&dev->trans, 0, sizeof(dev->trans));
+    dev->trans.result = ESP_OK;
+    dev->submitted = false;
+
+    dev->i2c_dev.port = port;
+    dev->i2c_dev.addr = addr;
+    dev->i2c_dev.cfg.sda_io_num = sda_gpio;
+    dev->i2c_dev.cfg.scl_io_num = scl_gpio;
+#if HELPER_TARGET_IS_ESP32
+    dev->i2c_dev.cfg.master.clk_speed = clk_speed;
+#endif
+    return i2c_dev_create_mutex(&dev->i2c_dev);
+}
+
+esp_err_t sensirion_i2c_free_desc(sensirion_i2c_dev_t *dev)
+{
+    CHECK_ARG(dev);
+
+    return i2c_dev_delete_mutex(&dev->i2c_dev);
+}
+
+esp_err_t sensirion_i2c_set_reset(sensirion_i2c_dev_t *dev, uint16_t cmd, uint32_t reset_ms)
+{
+    CHECK_ARG(dev);
+
+    dev->reset_cmd = cmd;
+    dev->reset_ms = reset_ms;
+
+    return ESP_OK;
+}
+
+sensirion_i2c_health_t sensirion_i2c_get_health(const sensirion_i2c_dev_t *dev)
+{
+    return dev ? dev->health : SENSIRION_I2C_FAILED;
+}
+
+esp_err_t sensirion_i2c_write_cmd(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs)
+{
+    CHECK_ARG(dev && (args || !nargs));
+
+    TickType_t deadline = deadline_after(0);
+
+    I2C_DEV_TAKE_MUTEX_TIMEOUT(&dev->i2c_dev, ticks_left(deadline));
+    deadline = settle(dev, deadline, 0);
+    esp_err_t res = finish(dev, write_cmd(dev, cmd, args, nargs, deadline), deadline);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return res;
+}
+
+esp_err_t sensirion_i2c_submit_cmd(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs)
+{
+    CHECK_ARG(dev && (args || !nargs));
+    if (nargs > SENSIRION_I2C_MAX_ARGS) return ESP_ERR_INVALID_SIZE;
+
+    TickType_t deadline = deadline_after(0);
+
+    I2C_DEV_TAKE_MUTEX_TIMEOUT(&dev->i2c_dev, ticks_left(deadline));
+    if (dev->submitted)
+    {
+        I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+        return ESP_ERR_INVALID_STATE;
+    }
+    deadline = settle(dev, deadline, 0);
+
+    // A command whose wait timed out may still be on the bus, the
+    // descriptor is only free again once i2cdev has completed it
+    esp_err_t res = ESP_ERR_INVALID_STATE;
+    if (dev->trans.result != ESP_ERR_NOT_FINISHED)
+    {
+        dev->trans.out_data = dev->trans_buf;
+        dev->trans.out_size = fill_cmd(dev->trans_buf, cmd, args, nargs);
+        dev->trans.in_data = NULL;
+        dev->trans.in_size = 0;
+        dev->trans.notify = xTaskGetCurrentTaskHandle();
+        res = i2c_dev_submit(&dev->i2c_dev, &dev->trans, ticks_left(deadline));
+    }
+
+    if (res == ESP_OK)
+    {
+        dev->trans_deadline = deadline;
+        dev->submitted = true;
+    }
+    else
+    {
+        count_transfer(dev, res);
+        res = finish(dev, res, deadline);
+    }
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return res;
+}
+
+esp_err_t sensirion_i2c_complete_cmd(sensirion_i2c_dev_t *dev)
+{
+    CHECK_ARG(dev);
+
+    // Only the submitting task collects, so trans_deadline is stable here
+    I2C_DEV_TAKE_MUTEX_TIMEOUT(&dev->i2c_dev, ticks_left(dev->trans_deadline));
+    if (!dev->submitted)
+    {
+        I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+        return ESP_ERR_INVALID_STATE;
+    }
+    dev->submitted = false;
+
+    esp_err_t res = i2c_dev_wait(&dev->trans, ticks_left(dev->trans_deadline));
+    count_transfer(dev, res);
+    res = finish(dev, res, dev->trans_deadline);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return res;
+}
+
+esp_err_t sensirion_i2c_read_frames(sensirion_i2c_dev_t *dev, uint8_t *frames, size_t words)
+{
+    CHECK_ARG(dev && frames && words);
+
+    TickType_t deadline = deadline_after(0);
+
+    I2C_DEV_TAKE_MUTEX_TIMEOUT(&dev->i2c_dev, ticks_left(deadline));
+    deadline = settle(dev, deadline, 0);
+    esp_err_t res = finish(dev, read_frames(dev, NULL, frames, words, deadline), deadline);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return res;
+}
+
+esp_err_t sensirion_i2c_read_words(sensirion_i2c_dev_t *dev, uint16_t *words, size_t count)
+{
+    CHECK_ARG(dev && words && count);
+
+    uint8_t frames[SENSIRION_FRAME_SIZE(count)];
+    CHECK(sensirion_i2c_read_frames(dev, frames, count));
+    decode_frames(frames, words, count);
+
+    return ESP_OK;
+}
+
+esp_err_t sensirion_i2c_cmd_read_frames(sensirion_i2c_dev_t *dev, uint16_t cmd, uint8_t *frames, size_t words)
+{
+    CHECK_ARG(dev && frames && words);
+
+    TickType_t deadline = deadline_after(0);
+
+    I2C_DEV_TAKE_MUTEX_TIMEOUT(&dev->i2c_dev, ticks_left(deadline));
+    deadline = settle(dev, deadline, 0);
+    esp_err_t res = finish(dev, read_frames(dev, &cmd, frames, words, deadline), deadline);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    return res;
+}
+
+esp_err_t sensirion_i2c_cmd_read_words(sensirion_i2c_dev_t *dev, uint16_t cmd, uint16_t *words, size_t count)
+{
+    CHECK_ARG(dev && words && count);
+
+    uint8_t frames[SENSIRION_FRAME_SIZE(count)];
+    CHECK(sensirion_i2c_cmd_read_frames(dev, cmd, frames, count));
+    decode_frames(frames, words, count);
+
+    return ESP_OK;
+}
+
+esp_err_t sensirion_i2c_execute(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs,
+        uint32_t delay_ms, uint16_t *words, size_t count)
+{
+    CHECK_ARG(dev && (args || !nargs) && (words || !count));
+
+    uint8_t frames[SENSIRION_FRAME_SIZE(count ? count : 1)];
+    TickType_t deadline = deadline_after(delay_ms);
+
+    I2C_DEV_TAKE_MUTEX_TIMEOUT(&dev->i2c_dev, ticks_left(deadline));
+    deadline = settle(dev, deadline, delay_ms);
+    esp_err_t res = write_cmd(dev, cmd, args, nargs, deadline);
+    if (res == ESP_OK)
+    {
+        wait_ms(delay_ms);
+        if (count)
+            res = read_frames(dev, NULL, frames, count, deadline);
+    }
+    res = finish(dev, res, deadline);
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    if (res == ESP_OK && count)
+        decode_frames(frames, words, count);
+
+    return res;
+}
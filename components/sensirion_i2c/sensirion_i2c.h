@@ -0,0 +1,256 @@
+/**
+ * @file sensirion_i2c.h
+ *
+ * Word protocol shared by the Sensirion drivers
+ *
+ * Sensirion devices take a 16 bit command, optionally followed by 16 bit
+ * argument words, and answer with 16 bit words. Every argument and answer
+ * word is followed by a CRC-8 byte, a word with its CRC is a frame.
+ *
+ * All functions take the device mutex, transfers go through i2cdev and so
+ * share the bus with every other device on the port. A command can also be
+ * queued without waiting for it, see ::sensirion_i2c_submit_cmd().
+ *
+ * Every call has a deadline of the command execution time from the datasheet
+ * plus SENSIRION_I2C_TIMEOUT_MS, instead of the i2cdev default. Failed calls
+ * escalate: the bus is recovered after SENSIRION_I2C_RECOVER_AFTER failures
+ * in a row, the device is also soft reset after SENSIRION_I2C_RESET_AFTER,
+ * and it is reported as failed after SENSIRION_I2C_FAIL_AFTER. The soft
+ * reset is only sent in what is left of the failing call's deadline, waiting
+ * for the device to come back, or sending the reset if no time was left, is
+ * done by the next call before its own deadline starts.
+ */
+#ifndef __SENSIRION_I2C_H__
+#define __SENSIRION_I2C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <i2cdev.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SENSIRION_WORD_SIZE 2                            //!< Bytes in a word
+#define SENSIRION_FRAME_SIZE(words) ((words) * 3)        //!< Bytes in a number of words with their CRCs
+#define SENSIRION_CRC8_INIT 0xff                         //!< CRC-8 initial value
+#define SENSIRION_CRC8_POLYNOMIAL 0x31                   //!< CRC-8 polynomial, x^8 + x^5 + x^4 + 1
+
+#define SENSIRION_I2C_MAX_ARGS 4        //!< Most argument words a command can take
+#define SENSIRION_I2C_TIMEOUT_MS 10     //!< Added to the execution time of every call
+#define SENSIRION_I2C_RECOVER_AFTER 2   //!< Failures in a row before the bus is recovered
+#define SENSIRION_I2C_RESET_AFTER 3     //!< Failures in a row before the device is soft reset
+#define SENSIRION_I2C_FAIL_AFTER 5      //!< Failures in a row before the device is failed
+
+/**
+ * Device health, derived from the number of failed calls in a row
+ */
+typedef enum
+{
+    SENSIRION_I2C_HEALTHY = 0, //!< Last call succeeded
+    SENSIRION_I2C_DEGRADED,    //!< Recent calls failed, recovery is running
+    SENSIRION_I2C_FAILED,      //!< Recovery did not help, results are not available
+} sensirion_i2c_health_t;
+
+/**
+ * Transfer statistics of a device
+ */
+typedef struct
+{
+    uint32_t transfers;   //!< Number of I2C transfers
+    uint32_t errors;      //!< Transfers that failed on the bus
+    uint32_t crc_errors;  //!< Transfers that returned a word with a wrong CRC
+    esp_err_t last_error; //!< Result of the last transfer
+    uint32_t recoveries;  //!< Successful bus recoveries
+    uint32_t resets;      //!< Soft resets sent by the escalation
+} sensirion_i2c_stats_t;
+
+/**
+ * Device descriptor
+ */
+typedef struct
+{
+    i2c_dev_t i2c_dev;              //!< I2C device descriptor
+    sensirion_i2c_stats_t stats;    //!< Transfer statistics, updated under the device mutex
+    sensirion_i2c_health_t health;  //!< Device health, updated under the device mutex
+    uint32_t failures;              //!< Failed calls in a row
+    uint16_t reset_cmd;             //!< Soft reset command, 0 if there is none
+    uint32_t reset_ms;              //!< Soft reset execution time, ms
+    bool reset_pending;             //!< Soft reset left for the next call, the failing one ran out of time
+    bool resetting;                 //!< Soft reset sent, the device is back at `ready_at`
+    TickType_t ready_at;            //!< When the last soft reset has executed
+    i2c_dev_transaction_t trans;    //!< Command queued by sensirion_i2c_submit_cmd()
+    uint8_t trans_buf[SENSIRION_WORD_SIZE + SENSIRION_FRAME_SIZE(SENSIRION_I2C_MAX_ARGS)]; //!< Its bytes
+    TickType_t trans_deadline;      //!< Its deadline
+    bool submitted;                 //!< Queued and not collected yet
+} sensirion_i2c_dev_t;
+
+/**
+ * @brief Calculate the Sensirion CRC-8 of a buffer
+ *
+ * @param data Data
+ * @param count Number of bytes
+ * @return CRC-8
+ */
+uint8_t sensirion_i2c_crc8(const uint8_t *data, size_t count);
+
+/**
+ * @brief Initialize device descriptor
+ *
+ * @param dev Device descriptor
+ * @param port I2C port
+ * @param addr I2C address
+ * @param sda_gpio SDA GPIO
+ * @param scl_gpio SCL GPIO
+ * @param clk_speed I2C clock, Hz
+ * @return `ESP_OK` on success
+ */
+esp_err_t sensirion_i2c_init_desc(sensirion_i2c_dev_t *dev, i2c_port_t port, uint8_t addr,
+        gpio_num_t sda_gpio, gpio_num_t scl_gpio, uint32_t clk_speed);
+
+/**
+ * @brief Free device descriptor
+ *
+ * @param dev Device descriptor
+ * @return `ESP_OK` on success
+ */
+esp_err_t sensirion_i2c_free_desc(sensirion_i2c_dev_t *dev);
+
+/**
+ * @brief Set the command the escalation uses to soft reset the device
+ *
+ * Drivers of devices that keep state, like a running periodic measurement,
+ * can watch `stats.resets` to restore it.
+ *
+ * @param dev Device descriptor
+ * @param cmd Soft reset command, 0 to never reset the device
+ * @param reset_ms Soft reset execution time, ms
+ * @return `ESP_OK` on success
+ */
+esp_err_t sensirion_i2c_set_reset(sensirion_i2c_dev_t *dev, uint16_t cmd, uint32_t reset_ms);
+
+/**
+ * @brief Get the device health
+ *
+ * Cheap enough to call on every control loop iteration.
+ *
+ * @param dev Device descriptor
+ * @return Device health
+ */
+sensirion_i2c_health_t sensirion_i2c_get_health(const sensirion_i2c_dev_t *dev);
+
+/**
+ * @brief Send a command with argument words
+ *
+ * @param dev Device descriptor
+ * @param cmd Command
+ * @param args Argument words, CRCs are added, may be NULL if \p nargs is 0
+ * @param nargs Number of argument words, up to 4
+ * @return `ESP_OK` on success
+ */
+esp_err_t sensirion_i2c_write_cmd(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs);
+
+/**
+ * @brief Queue a command with argument words without waiting for it
+ *
+ * Same as ::sensirion_i2c_write_cmd(), but returns as soon as the command is
+ * queued on the bus, so the caller can talk to a device on another bus in
+ * the meantime. It has to be collected with ::sensirion_i2c_complete_cmd()
+ * by the same task, until then other calls on the device fail. The deadline
+ * counts from this call.
+ *
+ * @param dev Device descriptor
+ * @param cmd Command
+ * @param args Argument words, CRCs are added, may be NULL if \p nargs is 0
+ * @param nargs Number of argument words, up to 4
+ * @return `ESP_OK` if queued, `ESP_ERR_INVALID_STATE` if a command is
+ *         already queued
+ */
+esp_err_t sensirion_i2c_submit_cmd(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs);
+
+/**
+ * @brief Wait for a command queued with ::sensirion_i2c_submit_cmd()
+ *
+ * Waits no longer than the deadline of the command, then updates the
+ * health like every other call.
+ *
+ * @param dev Device descriptor
+ * @return `ESP_OK` if the command was sent, `ESP_ERR_INVALID_STATE` if none
+ *         was queued
+ */
+esp_err_t sensirion_i2c_complete_cmd(sensirion_i2c_dev_t *dev);
+
+/**
+ * @brief Read frames and check their CRCs without decoding them
+ *
+ * For drivers that keep the raw frames, the CRCs are checked in the
+ * caller's buffer so nothing is copied.
+ *
+ * @param dev Device descriptor
+ * @param[out] frames Buffer of `SENSIRION_FRAME_SIZE(words)` bytes
+ * @param words Number of words to read, all in one transfer
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_CRC` on a CRC mismatch
+ */
+esp_err_t sensirion_i2c_read_frames(sensirion_i2c_dev_t *dev, uint8_t *frames, size_t words);
+
+/**
+ * @brief Read words
+ *
+ * @param dev Device descriptor
+ * @param[out] words Decoded words
+ * @param count Number of words to read, all in one transfer
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_CRC` on a CRC mismatch
+ */
+esp_err_t sensirion_i2c_read_words(sensirion_i2c_dev_t *dev, uint16_t *words, size_t count);
+
+/**
+ * @brief Send a command and read frames in one transfer
+ *
+ * The read follows the command after a repeated start. Only for commands
+ * that answer right away, like the SHT3x fetch command.
+ *
+ * @param dev Device descriptor
+ * @param cmd Command
+ * @param[out] frames Buffer of `SENSIRION_FRAME_SIZE(words)` bytes
+ * @param words Number of words to read
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_CRC` on a CRC mismatch
+ */
+esp_err_t sensirion_i2c_cmd_read_frames(sensirion_i2c_dev_t *dev, uint16_t cmd, uint8_t *frames, size_t words);
+
+/**
+ * @brief Send a command and read words in one transfer
+ *
+ * Same as ::sensirion_i2c_cmd_read_frames(), but decodes the words.
+ *
+ * @param dev Device descriptor
+ * @param cmd Command
+ * @param[out] words Decoded words
+ * @param count Number of words to read
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_CRC` on a CRC mismatch
+ */
+esp_err_t sensirion_i2c_cmd_read_words(sensirion_i2c_dev_t *dev, uint16_t cmd, uint16_t *words, size_t count);
+
+/**
+ * @brief Send a command, wait for it to execute and read the answer
+ *
+ * The device mutex is held for the whole sequence, which has a deadline of
+ * \p delay_ms plus SENSIRION_I2C_TIMEOUT_MS.
+ *
+ * @param dev Device descriptor
+ * @param cmd Command
+ * @param args Argument words, may be NULL if \p nargs is 0
+ * @param nargs Number of argument words, up to 4
+ * @param delay_ms Command execution time, ms
+ * @param[out] words Decoded answer words, may be NULL if \p count is 0
+ * @param count Number of answer words
+ * @return `ESP_OK` on success
+ */
+esp_err_t sensirion_i2c_execute(sensirion_i2c_dev_t *dev, uint16_t cmd, const uint16_t *args, size_t nargs,
+        uint32_t delay_ms, uint16_t *words, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SENSIRION_I2C_H__ */
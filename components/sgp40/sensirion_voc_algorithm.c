@@ -30,260 +30,11 @@
  */
 
 #include "sensirion_voc_algorithm.h"
-
-/* The fixed point arithmetic parts of this code were originally created by
- * https://github.com/PetteriAimonen/libfixmath
- */
-
-/*!< the maximum value of fix16_t */
-#define FIX16_MAXIMUM 0x7FFFFFFF
-/*!< the minimum value of fix16_t */
-#define FIX16_MINIMUM 0x80000000
-/*!< the value used to indicate overflows when FIXMATH_NO_OVERFLOW is not
- * specified */
-#define FIX16_OVERFLOW 0x80000000
-/*!< fix16_t value of 1 */
-#define FIX16_ONE 0x00010000
-
-inline fix16_t fix16_from_int(int32_t a) {
-    return a * FIX16_ONE;
-}
-
-inline int32_t fix16_cast_to_int(fix16_t a) {
-    return (a >> 16);
-}
-
-/*! Multiplies the two given fix16_t's and returns the result. */
-static fix16_t fix16_mul(fix16_t inArg0, fix16_t inArg1);
-
-/*! Divides the first given fix16_t by the second and returns the result. */
-static fix16_t fix16_div(fix16_t inArg0, fix16_t inArg1);
-
-/*! Returns the square root of the given fix16_t. */
-static fix16_t fix16_sqrt(fix16_t inValue);
-
-/*! Returns the exponent (e^) of the given fix16_t. */
-static fix16_t fix16_exp(fix16_t inValue);
-
-static fix16_t fix16_mul(fix16_t inArg0, fix16_t inArg1) {
-    // Each argument is divided to 16-bit parts.
-    //					AB
-    //			*	 CD
-    // -----------
-    //					BD	16 * 16 -> 32 bit products
-    //				 CB
-    //				 AD
-    //				AC
-    //			 |----| 64 bit product
-    int32_t A = (inArg0 >> 16), C = (inArg1 >> 16);
-    uint32_t B = (inArg0 & 0xFFFF), D = (inArg1 & 0xFFFF);
-
-    int32_t AC = A * C;
-    int32_t AD_CB = A * D + C * B;
-    uint32_t BD = B * D;
-
-    int32_t product_hi = AC + (AD_CB >> 16);
-
-    // Handle carry from lower 32 bits to upper part of result.
-    uint32_t ad_cb_temp = AD_CB << 16;
-    uint32_t product_lo = BD + ad_cb_temp;
-    if (product_lo < BD)
-        product_hi++;
-
-#ifndef FIXMATH_NO_OVERFLOW
-    // The upper 17 bits should all be the same (the sign).
-    if (product_hi >> 31 != product_hi >> 15)
-        return FIX16_OVERFLOW;
-#endif
-
-#ifdef FIXMATH_NO_ROUNDING
-    return (product_hi << 16) | (product_lo >> 16);
-#else
-    // Subtracting 0x8000 (= 0.5) and then using signed right shift
-    // achieves proper rounding to result-1, except in the corner
-    // case of negative numbers and lowest word = 0x8000.
-    // To handle that, we also have to subtract 1 for negative numbers.
-    uint32_t product_lo_tmp = product_lo;
-    product_lo -= 0x8000;
-    product_lo -= (uint32_t)product_hi >> 31;
-    if (product_lo > product_lo_tmp)
-        product_hi--;
-
-    // Discard the lowest 16 bits. Note that this is not exactly the same
-    // as dividing by 0x10000. For example if product = -1, result will
-    // also be -1 and not 0. This is compensated by adding +1 to the result
-    // and compensating this in turn in the rounding above.
-    fix16_t result = (product_hi << 16) | (product_lo >> 16);
-    result += 1;
-    return result;
-#endif
-}
-
-static fix16_t fix16_div(fix16_t a, fix16_t b) {
-    // This uses the basic binary restoring division algorithm.
-    // It appears to be faster to do the whole division manually than
-    // trying to compose a 64-bit divide out of 32-bit divisions on
-    // platforms without hardware divide.
-
-    if (b == 0)
-        return FIX16_MINIMUM;
-
-    uint32_t remainder = (a >= 0) ? a : (-a);
-    uint32_t divider = (b >= 0) ? b : (-b);
-
-    uint32_t quotient = 0;
-    uint32_t bit = 0x10000;
-
-    /* The algorithm requires D >= R */
-    while (divider < remainder) {
-        divider <<= 1;
-        bit <<= 1;
-    }
-
-#ifndef FIXMATH_NO_OVERFLOW
-    if (!bit)
-        return FIX16_OVERFLOW;
-#endif
-
-    if (divider & 0x80000000) {
-        // Perform one step manually to avoid overflows later.
-        // We know that divider's bottom bit is 0 here.
-        if (remainder >= divider) {
-            quotient |= bit;
-            remainder -= divider;
-        }
-        divider >>= 1;
-        bit >>= 1;
-    }
-
-    /* Main division loop */
-    while (bit && remainder) {
-        if (remainder >= divider) {
-            quotient |= bit;
-            remainder -= divider;
-        }
-
-        remainder <<= 1;
-        bit >>= 1;
-    }
-
-#ifndef FIXMATH_NO_ROUNDING
-    if (remainder >= divider) {
-        quotient++;
-    }
-#endif
-
-    fix16_t result = quotient;
-
-    /* Figure out the sign of result */
-    if ((a ^ b) & 0x80000000) {
-#ifndef FIXMATH_NO_OVERFLOW
-        if (result == FIX16_MINIMUM)
-            return FIX16_OVERFLOW;
-#endif
-
-        result = -result;
-    }
-
-    return result;
-}
-
-static fix16_t fix16_sqrt(fix16_t x) {
-    // It is assumed that x is not negative
-
-    uint32_t num = x;
-    uint32_t result = 0;
-    uint32_t bit;
-    uint8_t n;
-
-    bit = (uint32_t)1 << 30;
-    while (bit > num)
-        bit >>= 2;
-
-    // The main part is executed twice, in order to avoid
-    // using 64 bit values in computations.
-    for (n = 0; n < 2; n++) {
-        // First we get the top 24 bits of the answer.
-        while (bit) {
-            if (num >= result + bit) {
-                num -= result + bit;
-                result = (result >> 1) + bit;
-            } else {
-                result = (result >> 1);
-            }
-            bit >>= 2;
-        }
-
-        if (n == 0) {
-            // Then process it again to get the lowest 8 bits.
-            if (num > 65535) {
-                // The remainder 'num' is too large to be shifted left
-                // by 16, so we have to add 1 to result manually and
-                // adjust 'num' accordingly.
-                // num = a - (result + 0.5)^2
-                //	 = num + result^2 - (result + 0.5)^2
-                //	 = num - result - 0.5
-                num -= result;
-                num = (num << 16) - 0x8000;
-                result = (result << 16) + 0x8000;
-            } else {
-                num <<= 16;
-                result <<= 16;
-            }
-
-            bit = 1 << 14;
-        }
-    }
-
-#ifndef FIXMATH_NO_ROUNDING
-    // Finally, if next bit would have been 1, round the result upwards.
-    if (num > result) {
-        result++;
-    }
-#endif
-
-    return (fix16_t)result;
-}
-
-static fix16_t fix16_exp(fix16_t x) {
-// Function to approximate exp(); optimized more for code size than speed
-
-// exp(x) for x = +/- {1, 1/8, 1/64, 1/512}
-#define NUM_EXP_VALUES 4
-    static const fix16_t exp_pos_values[NUM_EXP_VALUES] = {
-        F16(2.7182818), F16(1.1331485), F16(1.0157477), F16(1.0019550)};
-    static const fix16_t exp_neg_values[NUM_EXP_VALUES] = {
-        F16(0.3678794), F16(0.8824969), F16(0.9844964), F16(0.9980488)};
-    const fix16_t* exp_values;
-
-    fix16_t res, arg;
-    uint16_t i;
-
-    if (x >= F16(10.3972))
-        return FIX16_MAXIMUM;
-    if (x <= F16(-11.7835))
-        return 0;
-
-    if (x < 0) {
-        x = -x;
-        exp_values = exp_neg_values;
-    } else {
-        exp_values = exp_pos_values;
-    }
-
-    res = FIX16_ONE;
-    arg = FIX16_ONE;
-    for (i = 0; i < NUM_EXP_VALUES; i++) {
-        while (x >= arg) {
-            res = fix16_mul(res, exp_values[i]);
-            x -= arg;
-        }
-        arg >>= 3;
-    }
-    return res;
-}
+#include "sensirion_voc_fix16.h"
 
 static void VocAlgorithm__init_instances(VocAlgorithmParams* params);
+static void VocAlgorithm__set_sampling_interval(VocAlgorithmParams* params,
+                                                int32_t interval_ms);
 static void
 VocAlgorithm__mean_variance_estimator__init(VocAlgorithmParams* params);
 static void VocAlgorithm__mean_variance_estimator___init_instances(
@@ -339,6 +90,8 @@ void VocAlgorithm_init(VocAlgorithmParams* params) {
     params->mUptime = F16(0.);
     params->mSraw = F16(0.);
     params->mVoc_Index = 0;
+    params->mSampling_Interval_Ms =
+        (int32_t)(VocAlgorithm_SAMPLING_INTERVAL * 1000.);
     VocAlgorithm__init_instances(params);
 }
 
@@ -357,6 +110,39 @@ static void VocAlgorithm__init_instances(VocAlgorithmParams* params) {
                                                  params->mVoc_Index_Offset);
     VocAlgorithm__adaptive_lowpass__init(params);
     VocAlgorithm__adaptive_lowpass__set_parameters(params);
+    VocAlgorithm__set_sampling_interval(params, params->mSampling_Interval_Ms);
+}
+
+/* Derives every coefficient that depends on the sampling interval, only
+ * called when the interval changes. Computed in fix16 so no floating point
+ * is needed at runtime, for the nominal 1000 ms interval the results are bit
+ * for bit the F16() constants of the original algorithm.
+ */
+static void VocAlgorithm__set_sampling_interval(VocAlgorithmParams* params,
+                                                int32_t interval_ms) {
+
+    /* interval_ms is at most VocAlgorithm_SAMPLING_INTERVAL_MAX_MS, so this
+     * does not overflow */
+    fix16_t dt = (fix16_t)((interval_ms * 65536 + 500) / 1000);
+    fix16_t dt_scaled =
+        fix16_mul(F16(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING), dt);
+
+    params->mSampling_Interval_Ms = interval_ms;
+    params->mSampling_Interval = dt;
+    params->mSampling_Interval_Minutes = fix16_div(dt, F16(60.));
+    params->m_Mean_Variance_Estimator___Gamma = (fix16_div(
+        fix16_mul(F16((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING /
+                       3600.)),
+                  dt),
+        (params->mTau_Mean_Variance_Hours + fix16_div(dt, F16(3600.)))));
+    params->m_Mean_Variance_Estimator___Gamma_Initial_Mean =
+        fix16_div(dt_scaled, (F16(VocAlgorithm_TAU_INITIAL_MEAN) + dt));
+    params->m_Mean_Variance_Estimator___Gamma_Initial_Variance =
+        fix16_div(dt_scaled, (F16(VocAlgorithm_TAU_INITIAL_VARIANCE) + dt));
+    params->m_Adaptive_Lowpass__A1 =
+        fix16_div(dt, (F16(VocAlgorithm_LP_TAU_FAST) + dt));
+    params->m_Adaptive_Lowpass__A2 =
+        fix16_div(dt, (F16(VocAlgorithm_LP_TAU_SLOW) + dt));
 }
 
 void VocAlgorithm_get_states(VocAlgorithmParams* params, int32_t* state0,
@@ -367,6 +153,31 @@ void VocAlgorithm_get_states(VocAlgorithmParams* params, int32_t* state0,
     return;
 }
 
+void VocAlgorithm_get_diagnostics(const VocAlgorithmParams* params,
+                                  VocAlgorithmDiagnostics* diagnostics) {
+
+    diagnostics->uptime = params->mUptime;
+    diagnostics->sraw = params->mSraw;
+    diagnostics->voc_index = params->mVoc_Index;
+    diagnostics->initialized =
+        params->m_Mean_Variance_Estimator___Initialized;
+    diagnostics->mean = params->m_Mean_Variance_Estimator___Mean +
+                        params->m_Mean_Variance_Estimator___Sraw_Offset;
+    diagnostics->std = params->m_Mean_Variance_Estimator___Std;
+    diagnostics->gamma_mean = params->m_Mean_Variance_Estimator__Gamma_Mean;
+    diagnostics->gamma_variance =
+        params->m_Mean_Variance_Estimator__Gamma_Variance;
+    diagnostics->uptime_gamma =
+        params->m_Mean_Variance_Estimator___Uptime_Gamma;
+    diagnostics->uptime_gating =
+        params->m_Mean_Variance_Estimator___Uptime_Gating;
+    diagnostics->gating_duration_minutes =
+        params->m_Mean_Variance_Estimator___Gating_Duration_Minutes;
+    diagnostics->lowpass_x1 = params->m_Adaptive_Lowpass___X1;
+    diagnostics->lowpass_x2 = params->m_Adaptive_Lowpass___X2;
+    diagnostics->lowpass_x3 = params->m_Adaptive_Lowpass___X3;
+}
+
 void VocAlgorithm_set_states(VocAlgorithmParams* params, int32_t state0,
                              int32_t state1) {
 
@@ -389,12 +200,50 @@ void VocAlgorithm_set_tuning_parameters(VocAlgorithmParams* params,
     VocAlgorithm__init_instances(params);
 }
 
+void VocAlgorithm_update_tuning_parameters(VocAlgorithmParams* params,
+                                           int32_t voc_index_offset,
+                                           int32_t learning_time_hours,
+                                           int32_t gating_max_duration_minutes,
+                                           int32_t std_initial) {
+
+    params->mVoc_Index_Offset = (fix16_from_int(voc_index_offset));
+    params->mTau_Mean_Variance_Hours = (fix16_from_int(learning_time_hours));
+    params->mGating_Max_Duration_Minutes =
+        (fix16_from_int(gating_max_duration_minutes));
+    params->mSraw_Std_Initial = (fix16_from_int(std_initial));
+    params->m_Mean_Variance_Estimator__Gating_Max_Duration_Minutes =
+        params->mGating_Max_Duration_Minutes;
+    VocAlgorithm__sigmoid_scaled__set_parameters(params,
+                                                 params->mVoc_Index_Offset);
+    /* The learning time goes into Gamma */
+    VocAlgorithm__set_sampling_interval(params, params->mSampling_Interval_Ms);
+    /* The initial std only matters until the estimator has seen a sample */
+    if (!params->m_Mean_Variance_Estimator___Initialized) {
+        params->m_Mean_Variance_Estimator___Std = params->mSraw_Std_Initial;
+        VocAlgorithm__mox_model__set_parameters(
+            params, VocAlgorithm__mean_variance_estimator__get_std(params),
+            VocAlgorithm__mean_variance_estimator__get_mean(params));
+    }
+}
+
 void VocAlgorithm_process(VocAlgorithmParams* params, int32_t sraw,
                           int32_t* voc_index) {
 
+    VocAlgorithm_process_dt(params, sraw,
+                            (int32_t)(VocAlgorithm_SAMPLING_INTERVAL * 1000.),
+                            voc_index);
+}
+
+void VocAlgorithm_process_dt(VocAlgorithmParams* params, int32_t sraw,
+                             int32_t interval_ms, int32_t* voc_index) {
+
+    interval_ms = VocAlgorithm_quantize_interval(interval_ms);
+    if (interval_ms != params->mSampling_Interval_Ms) {
+        VocAlgorithm__set_sampling_interval(params, interval_ms);
+    }
+
     if ((params->mUptime <= F16(VocAlgorithm_INITIAL_BLACKOUT))) {
-        params->mUptime =
-            (params->mUptime + F16(VocAlgorithm_SAMPLING_INTERVAL));
+        params->mUptime = (params->mUptime + params->mSampling_Interval);
     } else {
         if (((sraw > 0) && (sraw < 65000))) {
             if ((sraw < 20001)) {
@@ -449,19 +298,6 @@ static void VocAlgorithm__mean_variance_estimator__set_parameters(
     params->m_Mean_Variance_Estimator___Mean = F16(0.);
     params->m_Mean_Variance_Estimator___Sraw_Offset = F16(0.);
     params->m_Mean_Variance_Estimator___Std = std_initial;
-    params->m_Mean_Variance_Estimator___Gamma =
-        (fix16_div(F16((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING *
-                        (VocAlgorithm_SAMPLING_INTERVAL / 3600.))),
-                   (tau_mean_variance_hours +
-                    F16((VocAlgorithm_SAMPLING_INTERVAL / 3600.)))));
-    params->m_Mean_Variance_Estimator___Gamma_Initial_Mean =
-        F16(((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING *
-              VocAlgorithm_SAMPLING_INTERVAL) /
-             (VocAlgorithm_TAU_INITIAL_MEAN + VocAlgorithm_SAMPLING_INTERVAL)));
-    params->m_Mean_Variance_Estimator___Gamma_Initial_Variance = F16(
-        ((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING *
-          VocAlgorithm_SAMPLING_INTERVAL) /
-         (VocAlgorithm_TAU_INITIAL_VARIANCE + VocAlgorithm_SAMPLING_INTERVAL)));
     params->m_Mean_Variance_Estimator__Gamma_Mean = F16(0.);
     params->m_Mean_Variance_Estimator__Gamma_Variance = F16(0.);
     params->m_Mean_Variance_Estimator___Uptime_Gamma = F16(0.);
@@ -506,17 +342,17 @@ static void VocAlgorithm__mean_variance_estimator___calculate_gamma(
     fix16_t gating_threshold_variance;
     fix16_t sigmoid_gating_variance;
 
-    uptime_limit = F16((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__FIX16_MAX -
-                        VocAlgorithm_SAMPLING_INTERVAL));
+    uptime_limit = (F16(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__FIX16_MAX) -
+                    params->mSampling_Interval);
     if ((params->m_Mean_Variance_Estimator___Uptime_Gamma < uptime_limit)) {
         params->m_Mean_Variance_Estimator___Uptime_Gamma =
             (params->m_Mean_Variance_Estimator___Uptime_Gamma +
-             F16(VocAlgorithm_SAMPLING_INTERVAL));
+             params->mSampling_Interval);
     }
     if ((params->m_Mean_Variance_Estimator___Uptime_Gating < uptime_limit)) {
         params->m_Mean_Variance_Estimator___Uptime_Gating =
             (params->m_Mean_Variance_Estimator___Uptime_Gating +
-             F16(VocAlgorithm_SAMPLING_INTERVAL));
+             params->mSampling_Interval);
     }
     VocAlgorithm__mean_variance_estimator___sigmoid__set_parameters(
         params, F16(1.), F16(VocAlgorithm_INIT_DURATION_MEAN),
@@ -573,7 +409,7 @@ static void VocAlgorithm__mean_variance_estimator___calculate_gamma(
         (fix16_mul(sigmoid_gating_variance, gamma_variance));
     params->m_Mean_Variance_Estimator___Gating_Duration_Minutes =
         (params->m_Mean_Variance_Estimator___Gating_Duration_Minutes +
-         (fix16_mul(F16((VocAlgorithm_SAMPLING_INTERVAL / 60.)),
+         (fix16_mul(params->mSampling_Interval_Minutes,
                     ((fix16_mul((F16(1.) - sigmoid_gating_mean),
                                 F16((1. + VocAlgorithm_GATING_MAX_RATIO)))) -
                      F16(VocAlgorithm_GATING_MAX_RATIO)))));
@@ -753,12 +589,6 @@ static void VocAlgorithm__adaptive_lowpass__init(VocAlgorithmParams* params) {
 static void
 VocAlgorithm__adaptive_lowpass__set_parameters(VocAlgorithmParams* params) {
 
-    params->m_Adaptive_Lowpass__A1 =
-        F16((VocAlgorithm_SAMPLING_INTERVAL /
-             (VocAlgorithm_LP_TAU_FAST + VocAlgorithm_SAMPLING_INTERVAL)));
-    params->m_Adaptive_Lowpass__A2 =
-        F16((VocAlgorithm_SAMPLING_INTERVAL /
-             (VocAlgorithm_LP_TAU_SLOW + VocAlgorithm_SAMPLING_INTERVAL)));
     params->m_Adaptive_Lowpass___Initialized = false;
 }
 
@@ -795,8 +625,8 @@ VocAlgorithm__adaptive_lowpass__process(VocAlgorithmParams* params,
         ((fix16_mul(F16((VocAlgorithm_LP_TAU_SLOW - VocAlgorithm_LP_TAU_FAST)),
                     F1)) +
          F16(VocAlgorithm_LP_TAU_FAST));
-    a3 = (fix16_div(F16(VocAlgorithm_SAMPLING_INTERVAL),
-                    (F16(VocAlgorithm_SAMPLING_INTERVAL) + tau_a)));
+    a3 = (fix16_div(params->mSampling_Interval,
+                    (params->mSampling_Interval + tau_a)));
     params->m_Adaptive_Lowpass___X3 =
         ((fix16_mul((F16(1.) - a3), params->m_Adaptive_Lowpass___X3)) +
          (fix16_mul(a3, sample)));
@@ -58,6 +58,16 @@ typedef int32_t fix16_t;
   ((fix16_t)(((x) >= 0) ? ((x)*65536.0 + 0.5) : ((x)*65536.0 - 0.5)))
 
 #define VocAlgorithm_SAMPLING_INTERVAL (1.)
+/* Range of intervals accepted by VocAlgorithm_process_dt(), longer or shorter
+ * ones are clamped */
+#define VocAlgorithm_SAMPLING_INTERVAL_MIN_MS (100)
+#define VocAlgorithm_SAMPLING_INTERVAL_MAX_MS (10000)
+/* Intervals are rounded to this before the coefficients are derived from
+ * them, and within VocAlgorithm_SAMPLING_INTERVAL_SNAP_MS of the nominal
+ * interval taken as nominal, so sampling jitter does not recompute them on
+ * every sample */
+#define VocAlgorithm_SAMPLING_INTERVAL_QUANTUM_MS (50)
+#define VocAlgorithm_SAMPLING_INTERVAL_SNAP_MS (50)
 #define VocAlgorithm_INITIAL_BLACKOUT (45.)
 #define VocAlgorithm_VOC_INDEX_GAIN (230.)
 #define VocAlgorithm_SRAW_STD_INITIAL (50.)
@@ -85,6 +95,182 @@ typedef int32_t fix16_t;
 #define VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING (64.)
 #define VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__FIX16_MAX (32767.)
 
+/**
+ * Snapshot of the internal states of the VOC algorithm, to see why the index
+ * moved. All values are in the Q16.16 format of get_states/set_states for
+ * both backends. SRAW and the learned mean are offset by -20000 ticks, as
+ * inside the algorithm.
+ */
+typedef struct {
+  int32_t uptime;                  /* seconds since init */
+  int32_t sraw;                    /* last valid SRAW fed in */
+  int32_t voc_index;               /* unrounded VOC index */
+  bool initialized;                /* estimator has seen a sample */
+  int32_t mean;                    /* learned SRAW mean, what state0 saves */
+  int32_t std;                     /* learned SRAW std, what state1 saves */
+  int32_t gamma_mean;              /* weight of the last mean update */
+  int32_t gamma_variance;          /* weight of the last std update */
+  int32_t uptime_gamma;            /* seconds of the initial fast learning */
+  int32_t uptime_gating;           /* seconds of the gating warm up */
+  int32_t gating_duration_minutes; /* how long the estimator has been frozen */
+  int32_t lowpass_x1;              /* fast adaptive lowpass state */
+  int32_t lowpass_x2;              /* slow adaptive lowpass state */
+  int32_t lowpass_x3;              /* adaptive lowpass output */
+} VocAlgorithmDiagnostics;
+
+/**
+ * Struct to hold all the states of the single precision float backend
+ * (sensirion_voc_algorithm_float.c). Same fields as VocAlgorithmParams.
+ */
+typedef struct {
+  float mVoc_Index_Offset;
+  float mTau_Mean_Variance_Hours;
+  float mGating_Max_Duration_Minutes;
+  float mSraw_Std_Initial;
+  float mUptime;
+  float mSraw;
+  float mVoc_Index;
+  int32_t mSampling_Interval_Ms;
+  float mSampling_Interval;
+  float mSampling_Interval_Minutes;
+  float m_Mean_Variance_Estimator__Gating_Max_Duration_Minutes;
+  bool m_Mean_Variance_Estimator___Initialized;
+  float m_Mean_Variance_Estimator___Mean;
+  float m_Mean_Variance_Estimator___Sraw_Offset;
+  float m_Mean_Variance_Estimator___Std;
+  float m_Mean_Variance_Estimator___Gamma;
+  float m_Mean_Variance_Estimator___Gamma_Initial_Mean;
+  float m_Mean_Variance_Estimator___Gamma_Initial_Variance;
+  float m_Mean_Variance_Estimator__Gamma_Mean;
+  float m_Mean_Variance_Estimator__Gamma_Variance;
+  float m_Mean_Variance_Estimator___Uptime_Gamma;
+  float m_Mean_Variance_Estimator___Uptime_Gating;
+  float m_Mean_Variance_Estimator___Gating_Duration_Minutes;
+  float m_Mean_Variance_Estimator___Sigmoid__L;
+  float m_Mean_Variance_Estimator___Sigmoid__K;
+  float m_Mean_Variance_Estimator___Sigmoid__X0;
+  float m_Mox_Model__Sraw_Std;
+  float m_Mox_Model__Sraw_Mean;
+  float m_Sigmoid_Scaled__Offset;
+  float m_Adaptive_Lowpass__A1;
+  float m_Adaptive_Lowpass__A2;
+  bool m_Adaptive_Lowpass___Initialized;
+  float m_Adaptive_Lowpass___X1;
+  float m_Adaptive_Lowpass___X2;
+  float m_Adaptive_Lowpass___X3;
+} VocAlgorithmFloatParams;
+
+/*
+ * The interval both backends derive their coefficients from for a sample
+ * taken interval_ms after the previous one: clamped to
+ * VocAlgorithm_SAMPLING_INTERVAL_MIN_MS..MAX_MS, snapped to the nominal
+ * interval within VocAlgorithm_SAMPLING_INTERVAL_SNAP_MS and otherwise
+ * rounded to VocAlgorithm_SAMPLING_INTERVAL_QUANTUM_MS.
+ */
+static inline int32_t VocAlgorithm_quantize_interval(int32_t interval_ms) {
+  const int32_t nominal_ms = (int32_t)(VocAlgorithm_SAMPLING_INTERVAL * 1000.);
+
+  if (interval_ms < VocAlgorithm_SAMPLING_INTERVAL_MIN_MS) {
+    return VocAlgorithm_SAMPLING_INTERVAL_MIN_MS;
+  }
+  if (interval_ms > VocAlgorithm_SAMPLING_INTERVAL_MAX_MS) {
+    return VocAlgorithm_SAMPLING_INTERVAL_MAX_MS;
+  }
+  if (abs(interval_ms - nominal_ms) <= VocAlgorithm_SAMPLING_INTERVAL_SNAP_MS) {
+    return nominal_ms;
+  }
+  return (interval_ms + VocAlgorithm_SAMPLING_INTERVAL_QUANTUM_MS / 2) /
+         VocAlgorithm_SAMPLING_INTERVAL_QUANTUM_MS *
+         VocAlgorithm_SAMPLING_INTERVAL_QUANTUM_MS;
+}
+
+/*
+ * The float backend, with the same behaviour as the VocAlgorithm_*
+ * functions below. The states of get_states/set_states are in the Q16.16
+ * format of the fixed point backend, so they can be exchanged between the
+ * two.
+ */
+void VocAlgorithmFloat_init(VocAlgorithmFloatParams *params);
+void VocAlgorithmFloat_get_states(VocAlgorithmFloatParams *params,
+                                  int32_t *state0, int32_t *state1);
+void VocAlgorithmFloat_set_states(VocAlgorithmFloatParams *params,
+                                  int32_t state0, int32_t state1);
+void VocAlgorithmFloat_set_tuning_parameters(
+    VocAlgorithmFloatParams *params, int32_t voc_index_offset,
+    int32_t learning_time_hours, int32_t gating_max_duration_minutes,
+    int32_t std_initial);
+void VocAlgorithmFloat_update_tuning_parameters(
+    VocAlgorithmFloatParams *params, int32_t voc_index_offset,
+    int32_t learning_time_hours, int32_t gating_max_duration_minutes,
+    int32_t std_initial);
+void VocAlgorithmFloat_process(VocAlgorithmFloatParams *params, int32_t sraw,
+                               int32_t *voc_index);
+void VocAlgorithmFloat_process_dt(VocAlgorithmFloatParams *params,
+                                  int32_t sraw, int32_t interval_ms,
+                                  int32_t *voc_index);
+void VocAlgorithmFloat_get_diagnostics(const VocAlgorithmFloatParams *params,
+                                      VocAlgorithmDiagnostics *diagnostics);
+
+#ifdef VOC_ALGORITHM_FLOAT
+
+/*
+ * Float backend selected (CONFIG_SGP40_VOC_FLOAT), the VocAlgorithm_* API
+ * maps onto it.
+ */
+typedef VocAlgorithmFloatParams VocAlgorithmParams;
+
+static inline void VocAlgorithm_init(VocAlgorithmParams *params) {
+  VocAlgorithmFloat_init(params);
+}
+
+static inline void VocAlgorithm_get_states(VocAlgorithmParams *params,
+                                           int32_t *state0, int32_t *state1) {
+  VocAlgorithmFloat_get_states(params, state0, state1);
+}
+
+static inline void VocAlgorithm_set_states(VocAlgorithmParams *params,
+                                           int32_t state0, int32_t state1) {
+  VocAlgorithmFloat_set_states(params, state0, state1);
+}
+
+static inline void VocAlgorithm_set_tuning_parameters(
+    VocAlgorithmParams *params, int32_t voc_index_offset,
+    int32_t learning_time_hours, int32_t gating_max_duration_minutes,
+    int32_t std_initial) {
+  VocAlgorithmFloat_set_tuning_parameters(params, voc_index_offset,
+                                          learning_time_hours,
+                                          gating_max_duration_minutes,
+                                          std_initial);
+}
+
+static inline void VocAlgorithm_update_tuning_parameters(
+    VocAlgorithmParams *params, int32_t voc_index_offset,
+    int32_t learning_time_hours, int32_t gating_max_duration_minutes,
+    int32_t std_initial) {
+  VocAlgorithmFloat_update_tuning_parameters(params, voc_index_offset,
+                                             learning_time_hours,
+                                             gating_max_duration_minutes,
+                                             std_initial);
+}
+
+static inline void VocAlgorithm_process(VocAlgorithmParams *params,
+                                        int32_t sraw, int32_t *voc_index) {
+  VocAlgorithmFloat_process(params, sraw, voc_index);
+}
+
+static inline void VocAlgorithm_process_dt(VocAlgorithmParams *params,
+                                           int32_t sraw, int32_t interval_ms,
+                                           int32_t *voc_index) {
+  VocAlgorithmFloat_process_dt(params, sraw, interval_ms, voc_index);
+}
+
+static inline void VocAlgorithm_get_diagnostics(
+    const VocAlgorithmParams *params, VocAlgorithmDiagnostics *diagnostics) {
+  VocAlgorithmFloat_get_diagnostics(params, diagnostics);
+}
+
+#else
+
 /**
  * Struct to hold all the states of the VOC algorithm.
  */
@@ -96,6 +282,9 @@ typedef struct {
   fix16_t mUptime;
   fix16_t mSraw;
   fix16_t mVoc_Index;
+  int32_t mSampling_Interval_Ms;
+  fix16_t mSampling_Interval;
+  fix16_t mSampling_Interval_Minutes;
   fix16_t m_Mean_Variance_Estimator__Gating_Max_Duration_Minutes;
   bool m_Mean_Variance_Estimator___Initialized;
   fix16_t m_Mean_Variance_Estimator___Mean;
@@ -182,6 +371,20 @@ void VocAlgorithm_set_tuning_parameters(VocAlgorithmParams *params,
                                         int32_t gating_max_duration_minutes,
                                         int32_t std_initial);
 
+/**
+ * Change the tuning parameters of a running algorithm. Unlike
+ * VocAlgorithm_set_tuning_parameters() this keeps the learned mean and std,
+ * the gating and the lowpass states, so the index continues from where it
+ * was and only adapts with the new time constants from now on. std_initial
+ * only takes effect if no sample has been processed yet. Same parameters
+ * and ranges as VocAlgorithm_set_tuning_parameters().
+ */
+void VocAlgorithm_update_tuning_parameters(VocAlgorithmParams *params,
+                                           int32_t voc_index_offset,
+                                           int32_t learning_time_hours,
+                                           int32_t gating_max_duration_minutes,
+                                           int32_t std_initial);
+
 /**
  * Calculate the VOC index value from the raw sensor value.
  *
@@ -193,6 +396,34 @@ void VocAlgorithm_set_tuning_parameters(VocAlgorithmParams *params,
 void VocAlgorithm_process(VocAlgorithmParams *params, int32_t sraw,
                           int32_t *voc_index);
 
+/**
+ * Calculate the VOC index value from a raw sensor value taken interval_ms
+ * after the previous one, for sampling that is not exactly 1 Hz. The time
+ * constants of the algorithm are kept by rescaling its coefficients, which
+ * are only recalculated when the interval changes by more than jitter, see
+ * VocAlgorithm_quantize_interval(). Accurate for sampling at 0.5..2 Hz.
+ * VocAlgorithm_process() is this with a 1000 ms interval.
+ *
+ * @param params      Pointer to the VocAlgorithmParams struct
+ * @param sraw        Raw value from the SGP40 sensor
+ * @param interval_ms Time since the previous sample in milliseconds
+ * @param voc_index   Calculated VOC index value from the raw sensor value
+ */
+void VocAlgorithm_process_dt(VocAlgorithmParams *params, int32_t sraw,
+                             int32_t interval_ms, int32_t *voc_index);
+
+/**
+ * Copy the internal states of the algorithm for diagnostics. Only reads
+ * params, so it is cheap enough to call after every sample.
+ *
+ * @param params      Pointer to the VocAlgorithmParams struct
+ * @param diagnostics Copy of the internal states
+ */
+void VocAlgorithm_get_diagnostics(const VocAlgorithmParams *params,
+                                  VocAlgorithmDiagnostics *diagnostics);
+
+#endif /* VOC_ALGORITHM_FLOAT */
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2020, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Single precision float backend of the VOC algorithm.
+ *
+ * The same pipeline as sensirion_voc_algorithm.c (mean/variance estimator,
+ * MOX model, scaled sigmoid and adaptive lowpass) on the ESP32's hardware
+ * FPU instead of emulated Q16.16 arithmetic. Every constant is a float so
+ * nothing is promoted to software double precision. Indices differ slightly
+ * from the fixed point backend, tools/voc_replay/voc_conformance bounds by
+ * how much. The exception is SRAW clamped at 20001 for a while, where the
+ * fixed point estimator overflows and this one keeps tracking, and indices
+ * can differ by several points.
+ */
+
+#include <math.h>
+
+#include "sensirion_voc_algorithm.h"
+
+#define F(x) ((float)(x))
+
+static inline int32_t float_to_fix16(float x) {
+    return (int32_t)(x * F(65536.) + (x >= F(0.) ? F(0.5) : F(-0.5)));
+}
+
+static inline float fix16_to_float(int32_t x) {
+    return (float)x / F(65536.);
+}
+
+static void VocAlgorithmFloat__init_instances(VocAlgorithmFloatParams* params);
+static void VocAlgorithmFloat__set_sampling_interval(
+    VocAlgorithmFloatParams* params, int32_t interval_ms);
+static void VocAlgorithmFloat__mean_variance_estimator__set_parameters(
+    VocAlgorithmFloatParams* params, float std_initial,
+    float tau_mean_variance_hours, float gating_max_duration_minutes);
+static void VocAlgorithmFloat__mean_variance_estimator__process(
+    VocAlgorithmFloatParams* params, float sraw, float voc_index_from_prior);
+static float VocAlgorithmFloat__mox_model__process(
+    VocAlgorithmFloatParams* params, float sraw);
+static float VocAlgorithmFloat__sigmoid_scaled__process(
+    VocAlgorithmFloatParams* params, float sample);
+static void VocAlgorithmFloat__adaptive_lowpass__set_parameters(
+    VocAlgorithmFloatParams* params);
+static float VocAlgorithmFloat__adaptive_lowpass__process(
+    VocAlgorithmFloatParams* params, float sample);
+
+void VocAlgorithmFloat_init(VocAlgorithmFloatParams* params) {
+
+    params->mVoc_Index_Offset = F(VocAlgorithm_VOC_INDEX_OFFSET_DEFAULT);
+    params->mTau_Mean_Variance_Hours = F(VocAlgorithm_TAU_MEAN_VARIANCE_HOURS);
+    params->mGating_Max_Duration_Minutes =
+        F(VocAlgorithm_GATING_MAX_DURATION_MINUTES);
+    params->mSraw_Std_Initial = F(VocAlgorithm_SRAW_STD_INITIAL);
+    params->mUptime = F(0.);
+    params->mSraw = F(0.);
+    params->mVoc_Index = F(0.);
+    params->mSampling_Interval_Ms =
+        (int32_t)(VocAlgorithm_SAMPLING_INTERVAL * 1000.);
+    VocAlgorithmFloat__init_instances(params);
+}
+
+static void VocAlgorithmFloat__init_instances(VocAlgorithmFloatParams* params) {
+
+    VocAlgorithmFloat__mean_variance_estimator__set_parameters(
+        params, params->mSraw_Std_Initial, params->mTau_Mean_Variance_Hours,
+        params->mGating_Max_Duration_Minutes);
+    params->m_Mox_Model__Sraw_Std = params->m_Mean_Variance_Estimator___Std;
+    params->m_Mox_Model__Sraw_Mean =
+        params->m_Mean_Variance_Estimator___Mean +
+        params->m_Mean_Variance_Estimator___Sraw_Offset;
+    params->m_Sigmoid_Scaled__Offset = params->mVoc_Index_Offset;
+    VocAlgorithmFloat__adaptive_lowpass__set_parameters(params);
+    VocAlgorithmFloat__set_sampling_interval(params,
+                                             params->mSampling_Interval_Ms);
+}
+
+/* Derives every coefficient that depends on the sampling interval, only
+ * called when it changes. In double like the constants of the fixed point
+ * backend, the nominal interval gives the same coefficients as before.
+ */
+static void VocAlgorithmFloat__set_sampling_interval(
+    VocAlgorithmFloatParams* params, int32_t interval_ms) {
+
+    double dt = interval_ms / 1000.;
+
+    params->mSampling_Interval_Ms = interval_ms;
+    params->mSampling_Interval = F(dt);
+    params->mSampling_Interval_Minutes = F(dt / 60.);
+    params->m_Mean_Variance_Estimator___Gamma =
+        F(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING * (dt / 3600.)) /
+        (params->mTau_Mean_Variance_Hours + F(dt / 3600.));
+    params->m_Mean_Variance_Estimator___Gamma_Initial_Mean =
+        F((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING * dt) /
+          (VocAlgorithm_TAU_INITIAL_MEAN + dt));
+    params->m_Mean_Variance_Estimator___Gamma_Initial_Variance =
+        F((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING * dt) /
+          (VocAlgorithm_TAU_INITIAL_VARIANCE + dt));
+    params->m_Adaptive_Lowpass__A1 = F(dt / (VocAlgorithm_LP_TAU_FAST + dt));
+    params->m_Adaptive_Lowpass__A2 = F(dt / (VocAlgorithm_LP_TAU_SLOW + dt));
+}
+
+void VocAlgorithmFloat_get_states(VocAlgorithmFloatParams* params,
+                                  int32_t* state0, int32_t* state1) {
+
+    *state0 = float_to_fix16(params->m_Mean_Variance_Estimator___Mean +
+                             params->m_Mean_Variance_Estimator___Sraw_Offset);
+    *state1 = float_to_fix16(params->m_Mean_Variance_Estimator___Std);
+}
+
+void VocAlgorithmFloat_get_diagnostics(const VocAlgorithmFloatParams* params,
+                                      VocAlgorithmDiagnostics* diagnostics) {
+
+    diagnostics->uptime = float_to_fix16(params->mUptime);
+    diagnostics->sraw = float_to_fix16(params->mSraw);
+    diagnostics->voc_index = float_to_fix16(params->mVoc_Index);
+    diagnostics->initialized =
+        params->m_Mean_Variance_Estimator___Initialized;
+    diagnostics->mean =
+        float_to_fix16(params->m_Mean_Variance_Estimator___Mean +
+                       params->m_Mean_Variance_Estimator___Sraw_Offset);
+    diagnostics->std = float_to_fix16(params->m_Mean_Variance_Estimator___Std);
+    diagnostics->gamma_mean =
+        float_to_fix16(params->m_Mean_Variance_Estimator__Gamma_Mean);
+    diagnostics->gamma_variance =
+        float_to_fix16(params->m_Mean_Variance_Estimator__Gamma_Variance);
+    diagnostics->uptime_gamma =
+        float_to_fix16(params->m_Mean_Variance_Estimator___Uptime_Gamma);
+    diagnostics->uptime_gating =
+        float_to_fix16(params->m_Mean_Variance_Estimator___Uptime_Gating);
+    diagnostics->gating_duration_minutes = float_to_fix16(
+        params->m_Mean_Variance_Estimator___Gating_Duration_Minutes);
+    diagnostics->lowpass_x1 = float_to_fix16(params->m_Adaptive_Lowpass___X1);
+    diagnostics->lowpass_x2 = float_to_fix16(params->m_Adaptive_Lowpass___X2);
+    diagnostics->lowpass_x3 = float_to_fix16(params->m_Adaptive_Lowpass___X3);
+}
+
+void VocAlgorithmFloat_set_states(VocAlgorithmFloatParams* params,
+                                  int32_t state0, int32_t state1) {
+
+    params->m_Mean_Variance_Estimator___Mean = fix16_to_float(state0);
+    params->m_Mean_Variance_Estimator___Std = fix16_to_float(state1);
+    params->m_Mean_Variance_Estimator___Uptime_Gamma =
+        F(VocAlgorithm_PERSISTENCE_UPTIME_GAMMA);
+    params->m_Mean_Variance_Estimator___Initialized = true;
+    params->mSraw = fix16_to_float(state0);
+}
+
+void VocAlgorithmFloat_set_tuning_parameters(
+    VocAlgorithmFloatParams* params, int32_t voc_index_offset,
+    int32_t learning_time_hours, int32_t gating_max_duration_minutes,
+    int32_t std_initial) {
+
+    params->mVoc_Index_Offset = (float)voc_index_offset;
+    params->mTau_Mean_Variance_Hours = (float)learning_time_hours;
+    params->mGating_Max_Duration_Minutes = (float)gating_max_duration_minutes;
+    params->mSraw_Std_Initial = (float)std_initial;
+    VocAlgorithmFloat__init_instances(params);
+}
+
+void VocAlgorithmFloat_update_tuning_parameters(
+    VocAlgorithmFloatParams* params, int32_t voc_index_offset,
+    int32_t learning_time_hours, int32_t gating_max_duration_minutes,
+    int32_t std_initial) {
+
+    params->mVoc_Index_Offset = (float)voc_index_offset;
+    params->mTau_Mean_Variance_Hours = (float)learning_time_hours;
+    params->mGating_Max_Duration_Minutes = (float)gating_max_duration_minutes;
+    params->mSraw_Std_Initial = (float)std_initial;
+    params->m_Mean_Variance_Estimator__Gating_Max_Duration_Minutes =
+        params->mGating_Max_Duration_Minutes;
+    params->m_Sigmoid_Scaled__Offset = params->mVoc_Index_Offset;
+    VocAlgorithmFloat__set_sampling_interval(params,
+                                             params->mSampling_Interval_Ms);
+    if (!params->m_Mean_Variance_Estimator___Initialized) {
+        params->m_Mean_Variance_Estimator___Std = params->mSraw_Std_Initial;
+        params->m_Mox_Model__Sraw_Std = params->m_Mean_Variance_Estimator___Std;
+    }
+}
+
+void VocAlgorithmFloat_process(VocAlgorithmFloatParams* params, int32_t sraw,
+                               int32_t* voc_index) {
+
+    VocAlgorithmFloat_process_dt(
+        params, sraw, (int32_t)(VocAlgorithm_SAMPLING_INTERVAL * 1000.),
+        voc_index);
+}
+
+void VocAlgorithmFloat_process_dt(VocAlgorithmFloatParams* params,
+                                  int32_t sraw, int32_t interval_ms,
+                                  int32_t* voc_index) {
+
+    interval_ms = VocAlgorithm_quantize_interval(interval_ms);
+    if (interval_ms != params->mSampling_Interval_Ms) {
+        VocAlgorithmFloat__set_sampling_interval(params, interval_ms);
+    }
+
+    if (params->mUptime <= F(VocAlgorithm_INITIAL_BLACKOUT)) {
+        params->mUptime = params->mUptime + params->mSampling_Interval;
+    } else {
+        if ((sraw > 0) && (sraw < 65000)) {
+            if (sraw < 20001) {
+                sraw = 20001;
+            } else if (sraw > 52767) {
+                sraw = 52767;
+            }
+            params->mSraw = (float)(sraw - 20000);
+        }
+        params->mVoc_Index =
+            VocAlgorithmFloat__mox_model__process(params, params->mSraw);
+        params->mVoc_Index = VocAlgorithmFloat__sigmoid_scaled__process(
+            params, params->mVoc_Index);
+        params->mVoc_Index = VocAlgorithmFloat__adaptive_lowpass__process(
+            params, params->mVoc_Index);
+        if (params->mVoc_Index < F(0.5)) {
+            params->mVoc_Index = F(0.5);
+        }
+        if (params->mSraw > F(0.)) {
+            VocAlgorithmFloat__mean_variance_estimator__process(
+                params, params->mSraw, params->mVoc_Index);
+            params->m_Mox_Model__Sraw_Std =
+                params->m_Mean_Variance_Estimator___Std;
+            params->m_Mox_Model__Sraw_Mean =
+                params->m_Mean_Variance_Estimator___Mean +
+                params->m_Mean_Variance_Estimator___Sraw_Offset;
+        }
+    }
+    // The index is at least 0.5 here, truncating is rounding down
+    *voc_index = (int32_t)(params->mVoc_Index + F(0.5));
+}
+
+static void VocAlgorithmFloat__mean_variance_estimator__set_parameters(
+    VocAlgorithmFloatParams* params, float std_initial,
+    float tau_mean_variance_hours, float gating_max_duration_minutes) {
+
+    params->m_Mean_Variance_Estimator__Gating_Max_Duration_Minutes =
+        gating_max_duration_minutes;
+    params->m_Mean_Variance_Estimator___Initialized = false;
+    params->m_Mean_Variance_Estimator___Mean = F(0.);
+    params->m_Mean_Variance_Estimator___Sraw_Offset = F(0.);
+    params->m_Mean_Variance_Estimator___Std = std_initial;
+    params->m_Mean_Variance_Estimator__Gamma_Mean = F(0.);
+    params->m_Mean_Variance_Estimator__Gamma_Variance = F(0.);
+    params->m_Mean_Variance_Estimator___Uptime_Gamma = F(0.);
+    params->m_Mean_Variance_Estimator___Uptime_Gating = F(0.);
+    params->m_Mean_Variance_Estimator___Gating_Duration_Minutes = F(0.);
+    params->m_Mean_Variance_Estimator___Sigmoid__L = F(0.);
+    params->m_Mean_Variance_Estimator___Sigmoid__K = F(0.);
+    params->m_Mean_Variance_Estimator___Sigmoid__X0 = F(0.);
+}
+
+static float VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+    float L, float X0, float K, float sample) {
+
+    float x = K * (sample - X0);
+
+    if (x < F(-50.)) {
+        return L;
+    } else if (x > F(50.)) {
+        return F(0.);
+    } else {
+        return L / (F(1.) + expf(x));
+    }
+}
+
+static void VocAlgorithmFloat__mean_variance_estimator___calculate_gamma(
+    VocAlgorithmFloatParams* params, float voc_index_from_prior) {
+
+    const float uptime_limit =
+        F(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__FIX16_MAX) -
+        params->mSampling_Interval;
+    float sigmoid_gamma_mean;
+    float gamma_mean;
+    float gating_threshold_mean;
+    float sigmoid_gating_mean;
+    float sigmoid_gamma_variance;
+    float gamma_variance;
+    float gating_threshold_variance;
+    float sigmoid_gating_variance;
+
+    if (params->m_Mean_Variance_Estimator___Uptime_Gamma < uptime_limit) {
+        params->m_Mean_Variance_Estimator___Uptime_Gamma +=
+            params->mSampling_Interval;
+    }
+    if (params->m_Mean_Variance_Estimator___Uptime_Gating < uptime_limit) {
+        params->m_Mean_Variance_Estimator___Uptime_Gating +=
+            params->mSampling_Interval;
+    }
+    sigmoid_gamma_mean = VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+        F(1.), F(VocAlgorithm_INIT_DURATION_MEAN),
+        F(VocAlgorithm_INIT_TRANSITION_MEAN),
+        params->m_Mean_Variance_Estimator___Uptime_Gamma);
+    gamma_mean = params->m_Mean_Variance_Estimator___Gamma +
+                 (params->m_Mean_Variance_Estimator___Gamma_Initial_Mean -
+                  params->m_Mean_Variance_Estimator___Gamma) *
+                     sigmoid_gamma_mean;
+    gating_threshold_mean =
+        F(VocAlgorithm_GATING_THRESHOLD) +
+        F(VocAlgorithm_GATING_THRESHOLD_INITIAL -
+          VocAlgorithm_GATING_THRESHOLD) *
+            VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+                F(1.), F(VocAlgorithm_INIT_DURATION_MEAN),
+                F(VocAlgorithm_INIT_TRANSITION_MEAN),
+                params->m_Mean_Variance_Estimator___Uptime_Gating);
+    sigmoid_gating_mean = VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+        F(1.), gating_threshold_mean,
+        F(VocAlgorithm_GATING_THRESHOLD_TRANSITION), voc_index_from_prior);
+    params->m_Mean_Variance_Estimator__Gamma_Mean =
+        sigmoid_gating_mean * gamma_mean;
+    sigmoid_gamma_variance =
+        VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+            F(1.), F(VocAlgorithm_INIT_DURATION_VARIANCE),
+            F(VocAlgorithm_INIT_TRANSITION_VARIANCE),
+            params->m_Mean_Variance_Estimator___Uptime_Gamma);
+    gamma_variance =
+        params->m_Mean_Variance_Estimator___Gamma +
+        (params->m_Mean_Variance_Estimator___Gamma_Initial_Variance -
+         params->m_Mean_Variance_Estimator___Gamma) *
+            (sigmoid_gamma_variance - sigmoid_gamma_mean);
+    gating_threshold_variance =
+        F(VocAlgorithm_GATING_THRESHOLD) +
+        F(VocAlgorithm_GATING_THRESHOLD_INITIAL -
+          VocAlgorithm_GATING_THRESHOLD) *
+            VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+                F(1.), F(VocAlgorithm_INIT_DURATION_VARIANCE),
+                F(VocAlgorithm_INIT_TRANSITION_VARIANCE),
+                params->m_Mean_Variance_Estimator___Uptime_Gating);
+    sigmoid_gating_variance =
+        VocAlgorithmFloat__mean_variance_estimator___sigmoid(
+            F(1.), gating_threshold_variance,
+            F(VocAlgorithm_GATING_THRESHOLD_TRANSITION), voc_index_from_prior);
+    params->m_Mean_Variance_Estimator__Gamma_Variance =
+        sigmoid_gating_variance * gamma_variance;
+    params->m_Mean_Variance_Estimator___Gating_Duration_Minutes +=
+        params->mSampling_Interval_Minutes *
+        ((F(1.) - sigmoid_gating_mean) * F(1. + VocAlgorithm_GATING_MAX_RATIO) -
+         F(VocAlgorithm_GATING_MAX_RATIO));
+    if (params->m_Mean_Variance_Estimator___Gating_Duration_Minutes < F(0.)) {
+        params->m_Mean_Variance_Estimator___Gating_Duration_Minutes = F(0.);
+    }
+    if (params->m_Mean_Variance_Estimator___Gating_Duration_Minutes >
+        params->m_Mean_Variance_Estimator__Gating_Max_Duration_Minutes) {
+        params->m_Mean_Variance_Estimator___Uptime_Gating = F(0.);
+    }
+}
+
+static void VocAlgorithmFloat__mean_variance_estimator__process(
+    VocAlgorithmFloatParams* params, float sraw, float voc_index_from_prior) {
+
+    float delta_sgp;
+    float c;
+    float additional_scaling;
+
+    if (params->m_Mean_Variance_Estimator___Initialized == false) {
+        params->m_Mean_Variance_Estimator___Initialized = true;
+        params->m_Mean_Variance_Estimator___Sraw_Offset = sraw;
+        params->m_Mean_Variance_Estimator___Mean = F(0.);
+    } else {
+        if ((params->m_Mean_Variance_Estimator___Mean >= F(100.)) ||
+            (params->m_Mean_Variance_Estimator___Mean <= F(-100.))) {
+            params->m_Mean_Variance_Estimator___Sraw_Offset +=
+                params->m_Mean_Variance_Estimator___Mean;
+            params->m_Mean_Variance_Estimator___Mean = F(0.);
+        }
+        sraw = sraw - params->m_Mean_Variance_Estimator___Sraw_Offset;
+        VocAlgorithmFloat__mean_variance_estimator___calculate_gamma(
+            params, voc_index_from_prior);
+        delta_sgp = (sraw - params->m_Mean_Variance_Estimator___Mean) /
+                    F(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING);
+        if (delta_sgp < F(0.)) {
+            c = params->m_Mean_Variance_Estimator___Std - delta_sgp;
+        } else {
+            c = params->m_Mean_Variance_Estimator___Std + delta_sgp;
+        }
+        additional_scaling = F(1.);
+        if (c > F(1440.)) {
+            additional_scaling = F(4.);
+        }
+        params->m_Mean_Variance_Estimator___Std =
+            sqrtf(additional_scaling *
+                  (F(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING) -
+                   params->m_Mean_Variance_Estimator__Gamma_Variance)) *
+            sqrtf(params->m_Mean_Variance_Estimator___Std *
+                      (params->m_Mean_Variance_Estimator___Std /
+                       (F(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING) *
+                        additional_scaling)) +
+                  (params->m_Mean_Variance_Estimator__Gamma_Variance *
+                   delta_sgp / additional_scaling) *
+                      delta_sgp);
+        params->m_Mean_Variance_Estimator___Mean +=
+            params->m_Mean_Variance_Estimator__Gamma_Mean * delta_sgp;
+    }
+}
+
+static float VocAlgorithmFloat__mox_model__process(
+    VocAlgorithmFloatParams* params, float sraw) {
+
+    return (sraw - params->m_Mox_Model__Sraw_Mean) /
+           (-(params->m_Mox_Model__Sraw_Std + F(VocAlgorithm_SRAW_STD_BONUS))) *
+           F(VocAlgorithm_VOC_INDEX_GAIN);
+}
+
+static float VocAlgorithmFloat__sigmoid_scaled__process(
+    VocAlgorithmFloatParams* params, float sample) {
+
+    float x;
+    float shift;
+
+    x = F(VocAlgorithm_SIGMOID_K) * (sample - F(VocAlgorithm_SIGMOID_X0));
+    if (x < F(-50.)) {
+        return F(VocAlgorithm_SIGMOID_L);
+    } else if (x > F(50.)) {
+        return F(0.);
+    } else {
+        if (sample >= F(0.)) {
+            shift = (F(VocAlgorithm_SIGMOID_L) -
+                     F(5.) * params->m_Sigmoid_Scaled__Offset) /
+                    F(4.);
+            return (F(VocAlgorithm_SIGMOID_L) + shift) / (F(1.) + expf(x)) -
+                   shift;
+        } else {
+            return (params->m_Sigmoid_Scaled__Offset /
+                    F(VocAlgorithm_VOC_INDEX_OFFSET_DEFAULT)) *
+                   (F(VocAlgorithm_SIGMOID_L) / (F(1.) + expf(x)));
+        }
+    }
+}
+
+static void VocAlgorithmFloat__adaptive_lowpass__set_parameters(
+    VocAlgorithmFloatParams* params) {
+
+    params->m_Adaptive_Lowpass___Initialized = false;
+}
+
+static float VocAlgorithmFloat__adaptive_lowpass__process(
+    VocAlgorithmFloatParams* params, float sample) {
+
+    float abs_delta;
+    float F1;
+    float tau_a;
+    float a3;
+
+    if (params->m_Adaptive_Lowpass___Initialized == false) {
+        params->m_Adaptive_Lowpass___X1 = sample;
+        params->m_Adaptive_Lowpass___X2 = sample;
+        params->m_Adaptive_Lowpass___X3 = sample;
+        params->m_Adaptive_Lowpass___Initialized = true;
+    }
+    params->m_Adaptive_Lowpass___X1 =
+        (F(1.) - params->m_Adaptive_Lowpass__A1) *
+            params->m_Adaptive_Lowpass___X1 +
+        params->m_Adaptive_Lowpass__A1 * sample;
+    params->m_Adaptive_Lowpass___X2 =
+        (F(1.) - params->m_Adaptive_Lowpass__A2) *
+            params->m_Adaptive_Lowpass___X2 +
+        params->m_Adaptive_Lowpass__A2 * sample;
+    abs_delta =
+        fabsf(params->m_Adaptive_Lowpass___X1 - params->m_Adaptive_Lowpass___X2);
+    F1 = expf(F(VocAlgorithm_LP_ALPHA) * abs_delta);
+    tau_a = F(VocAlgorithm_LP_TAU_SLOW - VocAlgorithm_LP_TAU_FAST) * F1 +
+            F(VocAlgorithm_LP_TAU_FAST);
+    a3 = params->mSampling_Interval / (params->mSampling_Interval + tau_a);
+    params->m_Adaptive_Lowpass___X3 =
+        (F(1.) - a3) * params->m_Adaptive_Lowpass___X3 + a3 * sample;
+    return params->m_Adaptive_Lowpass___X3;
+}
@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2020, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Fixed point kernels of the VOC algorithm.
+ *
+ * Internal to the sgp40 component: shared by sensirion_voc_algorithm.c and
+ * the host side batch engine so both produce bit identical indices.
+ *
+ * Two kernel sets are provided. The reference kernels are the libfixmath
+ * ones Sensirion ships, built from 32 bit operations and bit-by-bit loops.
+ * With CONFIG_SGP40_VOC_FAST_MATH the algorithm uses the fast kernels
+ * instead:
+ *
+ * - fix16_mul_fast: one 32x32->64 multiply. Identical to the reference.
+ * - fix16_div_fast: one 64/32 divide. Identical to the reference for every
+ *   result that fits a fix16_t. For results that overflow, both return
+ *   FIX16_OVERFLOW.
+ * - fix16_sqrt_fast: a float estimate corrected with 64 bit integer
+ *   arithmetic, always correctly rounded. Identical to the reference below
+ *   16642.0. Above that the reference can be 1 LSB low. Negative arguments
+ *   are taken as unsigned, like the reference does, with the same 1 LSB
+ *   bound. The correction takes a few steps at most for every argument.
+ * - fix16_exp_fast: 2^(x * log2(e)) from a 257 entry 2^(i/256) table with
+ *   linear interpolation. It keeps the reference's saturation bounds.
+ *   Within them it is within 2e-6 relative or 1 LSB of the true value,
+ *   whichever is larger. The reference's chain of roundings is less
+ *   accurate, with errors of several LSB for small results and about 1e-5
+ *   relative for large ones.
+ *
+ * tools/voc_replay/voc_kernels checks these bounds against the reference
+ * kernels.
+ */
+
+#ifndef VOCALGORITHM_FIX16_H_
+#define VOCALGORITHM_FIX16_H_
+
+#include "sensirion_voc_algorithm.h"
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#include <math.h>
+
+/* The fixed point arithmetic parts of this code were originally created by
+ * https://github.com/PetteriAimonen/libfixmath
+ */
+
+/*!< the maximum value of fix16_t */
+#define FIX16_MAXIMUM 0x7FFFFFFF
+/*!< the minimum value of fix16_t */
+#define FIX16_MINIMUM 0x80000000
+/*!< the value used to indicate overflows when FIXMATH_NO_OVERFLOW is not
+ * specified */
+#define FIX16_OVERFLOW 0x80000000
+/*!< fix16_t value of 1 */
+#define FIX16_ONE 0x00010000
+
+static inline fix16_t fix16_from_int(int32_t a) {
+    return a * FIX16_ONE;
+}
+
+static inline int32_t fix16_cast_to_int(fix16_t a) {
+    return (a >> 16);
+}
+
+/*! Multiplies the two given fix16_t's and returns the result. */
+static inline fix16_t fix16_mul_reference(fix16_t inArg0, fix16_t inArg1) {
+    // Each argument is divided to 16-bit parts.
+    //					AB
+    //			*	 CD
+    // -----------
+    //					BD	16 * 16 -> 32 bit products
+    //				 CB
+    //				 AD
+    //				AC
+    //			 |----| 64 bit product
+    int32_t A = (inArg0 >> 16), C = (inArg1 >> 16);
+    uint32_t B = (inArg0 & 0xFFFF), D = (inArg1 & 0xFFFF);
+
+    int32_t AC = A * C;
+    int32_t AD_CB = A * D + C * B;
+    uint32_t BD = B * D;
+
+    int32_t product_hi = AC + (AD_CB >> 16);
+
+    // Handle carry from lower 32 bits to upper part of result.
+    uint32_t ad_cb_temp = AD_CB << 16;
+    uint32_t product_lo = BD + ad_cb_temp;
+    if (product_lo < BD)
+        product_hi++;
+
+#ifndef FIXMATH_NO_OVERFLOW
+    // The upper 17 bits should all be the same (the sign).
+    if (product_hi >> 31 != product_hi >> 15)
+        return FIX16_OVERFLOW;
+#endif
+
+#ifdef FIXMATH_NO_ROUNDING
+    return (product_hi << 16) | (product_lo >> 16);
+#else
+    // Subtracting 0x8000 (= 0.5) and then using signed right shift
+    // achieves proper rounding to result-1, except in the corner
+    // case of negative numbers and lowest word = 0x8000.
+    // To handle that, we also have to subtract 1 for negative numbers.
+    uint32_t product_lo_tmp = product_lo;
+    product_lo -= 0x8000;
+    product_lo -= (uint32_t)product_hi >> 31;
+    if (product_lo > product_lo_tmp)
+        product_hi--;
+
+    // Discard the lowest 16 bits. Note that this is not exactly the same
+    // as dividing by 0x10000. For example if product = -1, result will
+    // also be -1 and not 0. This is compensated by adding +1 to the result
+    // and compensating this in turn in the rounding above.
+    fix16_t result = (product_hi << 16) | (product_lo >> 16);
+    result += 1;
+    return result;
+#endif
+}
+
+/*! Divides the first given fix16_t by the second and returns the result. */
+static inline fix16_t fix16_div_reference(fix16_t a, fix16_t b) {
+    // This uses the basic binary restoring division algorithm.
+    // It appears to be faster to do the whole division manually than
+    // trying to compose a 64-bit divide out of 32-bit divisions on
+    // platforms without hardware divide.
+
+    if (b == 0)
+        return FIX16_MINIMUM;
+
+    uint32_t remainder = (a >= 0) ? a : (-a);
+    uint32_t divider = (b >= 0) ? b : (-b);
+
+    uint32_t quotient = 0;
+    uint32_t bit = 0x10000;
+
+    /* The algorithm requires D >= R */
+    while (divider < remainder) {
+        divider <<= 1;
+        bit <<= 1;
+    }
+
+#ifndef FIXMATH_NO_OVERFLOW
+    if (!bit)
+        return FIX16_OVERFLOW;
+#endif
+
+    if (divider & 0x80000000) {
+        // Perform one step manually to avoid overflows later.
+        // We know that divider's bottom bit is 0 here.
+        if (remainder >= divider) {
+            quotient |= bit;
+            remainder -= divider;
+        }
+        divider >>= 1;
+        bit >>= 1;
+    }
+
+    /* Main division loop */
+    while (bit && remainder) {
+        if (remainder >= divider) {
+            quotient |= bit;
+            remainder -= divider;
+        }
+
+        remainder <<= 1;
+        bit >>= 1;
+    }
+
+#ifndef FIXMATH_NO_ROUNDING
+    if (remainder >= divider) {
+        quotient++;
+    }
+#endif
+
+    fix16_t result = quotient;
+
+    /* Figure out the sign of result */
+    if ((a ^ b) & 0x80000000) {
+#ifndef FIXMATH_NO_OVERFLOW
+        if (result == FIX16_MINIMUM)
+            return FIX16_OVERFLOW;
+#endif
+
+        result = -result;
+    }
+
+    return result;
+}
+
+/*! Returns the square root of the given fix16_t. */
+static inline fix16_t fix16_sqrt_reference(fix16_t x) {
+    // It is assumed that x is not negative
+
+    uint32_t num = x;
+    uint32_t result = 0;
+    uint32_t bit;
+    uint8_t n;
+
+    bit = (uint32_t)1 << 30;
+    while (bit > num)
+        bit >>= 2;
+
+    // The main part is executed twice, in order to avoid
+    // using 64 bit values in computations.
+    for (n = 0; n < 2; n++) {
+        // First we get the top 24 bits of the answer.
+        while (bit) {
+            if (num >= result + bit) {
+                num -= result + bit;
+                result = (result >> 1) + bit;
+            } else {
+                result = (result >> 1);
+            }
+            bit >>= 2;
+        }
+
+        if (n == 0) {
+            // Then process it again to get the lowest 8 bits.
+            if (num > 65535) {
+                // The remainder 'num' is too large to be shifted left
+                // by 16, so we have to add 1 to result manually and
+                // adjust 'num' accordingly.
+                // num = a - (result + 0.5)^2
+                //	 = num + result^2 - (result + 0.5)^2
+                //	 = num - result - 0.5
+                num -= result;
+                num = (num << 16) - 0x8000;
+                result = (result << 16) + 0x8000;
+            } else {
+                num <<= 16;
+                result <<= 16;
+            }
+
+            bit = 1 << 14;
+        }
+    }
+
+#ifndef FIXMATH_NO_ROUNDING
+    // Finally, if next bit would have been 1, round the result upwards.
+    if (num > result) {
+        result++;
+    }
+#endif
+
+    return (fix16_t)result;
+}
+
+/*! Returns the exponent (e^) of the given fix16_t. */
+static inline fix16_t fix16_exp_reference(fix16_t x) {
+// Function to approximate exp(); optimized more for code size than speed
+
+// exp(x) for x = +/- {1, 1/8, 1/64, 1/512}
+#define NUM_EXP_VALUES 4
+    static const fix16_t exp_pos_values[NUM_EXP_VALUES] = {
+        F16(2.7182818), F16(1.1331485), F16(1.0157477), F16(1.0019550)};
+    static const fix16_t exp_neg_values[NUM_EXP_VALUES] = {
+        F16(0.3678794), F16(0.8824969), F16(0.9844964), F16(0.9980488)};
+    const fix16_t* exp_values;
+
+    fix16_t res, arg;
+    uint16_t i;
+
+    if (x >= F16(10.3972))
+        return FIX16_MAXIMUM;
+    if (x <= F16(-11.7835))
+        return 0;
+
+    if (x < 0) {
+        x = -x;
+        exp_values = exp_neg_values;
+    } else {
+        exp_values = exp_pos_values;
+    }
+
+    res = FIX16_ONE;
+    arg = FIX16_ONE;
+    for (i = 0; i < NUM_EXP_VALUES; i++) {
+        while (x >= arg) {
+            res = fix16_mul_reference(res, exp_values[i]);
+            x -= arg;
+        }
+        arg >>= 3;
+    }
+    return res;
+}
+
+/*! 2^(i/256) for i = 0..256 in Q2.30 */
+static const uint32_t fix16_exp2_table[257] = {
+    0x40000000, 0x402c6be9, 0x4058f6a8, 0x4085a051, 0x40b268fa, 0x40df50b8,
+    0x410c57a2, 0x41397dcc, 0x4166c34c, 0x41942839, 0x41c1aca7, 0x41ef50ae,
+    0x421d1462, 0x424af7da, 0x4278fb2b, 0x42a71e6c, 0x42d561b4, 0x4303c518,
+    0x433248ae, 0x4360ec8d, 0x438fb0cb, 0x43be957f, 0x43ed9ac0, 0x441cc0a3,
+    0x444c0740, 0x447b6ead, 0x44aaf702, 0x44daa054, 0x450a6abb, 0x453a564d,
+    0x456a6323, 0x459a9152, 0x45cae0f2, 0x45fb521a, 0x462be4e2, 0x465c9961,
+    0x468d6fae, 0x46be67e0, 0x46ef8210, 0x4720be55, 0x47521cc6, 0x47839d7b,
+    0x47b5408c, 0x47e70611, 0x4818ee22, 0x484af8d6, 0x487d2646, 0x48af768a,
+    0x48e1e9ba, 0x49147fee, 0x4947393f, 0x497a15c4, 0x49ad1598, 0x49e038d0,
+    0x4a137f88, 0x4a46e9d6, 0x4a7a77d4, 0x4aae299b, 0x4ae1ff43, 0x4b15f8e6,
+    0x4b4a169c, 0x4b7e587e, 0x4bb2bea5, 0x4be7492b, 0x4c1bf829, 0x4c50cbb8,
+    0x4c85c3f1, 0x4cbae0ef, 0x4cf022ca, 0x4d25899c, 0x4d5b157e, 0x4d90c68b,
+    0x4dc69cdd, 0x4dfc988c, 0x4e32b9b4, 0x4e69006e, 0x4e9f6cd4, 0x4ed5ff00,
+    0x4f0cb70c, 0x4f439514, 0x4f7a9930, 0x4fb1c37c, 0x4fe91413, 0x50208b0e,
+    0x50582888, 0x508fec9c, 0x50c7d765, 0x50ffe8fe, 0x51382182, 0x5170810b,
+    0x51a907b4, 0x51e1b59a, 0x521a8ad7, 0x52538786, 0x528cabc3, 0x52c5f7aa,
+    0x52ff6b55, 0x533906e0, 0x5372ca68, 0x53acb607, 0x53e6c9da, 0x542105fd,
+    0x545b6a8b, 0x5495f7a1, 0x54d0ad5a, 0x550b8bd4, 0x55469329, 0x5581c378,
+    0x55bd1cdb, 0x55f89f70, 0x56344b52, 0x567020a0, 0x56ac1f75, 0x56e847ef,
+    0x57249a29, 0x57611642, 0x579dbc57, 0x57da8c83, 0x581786e6, 0x5854ab9b,
+    0x5891fac1, 0x58cf7474, 0x590d18d3, 0x594ae7fb, 0x5988e209, 0x59c7071c,
+    0x5a055751, 0x5a43d2c6, 0x5a82799a, 0x5ac14bea, 0x5b0049d4, 0x5b3f7377,
+    0x5b7ec8f2, 0x5bbe4a61, 0x5bfdf7e5, 0x5c3dd19c, 0x5c7dd7a4, 0x5cbe0a1c,
+    0x5cfe6923, 0x5d3ef4d7, 0x5d7fad59, 0x5dc092c7, 0x5e01a53f, 0x5e42e4e3,
+    0x5e8451d0, 0x5ec5ec26, 0x5f07b405, 0x5f49a98c, 0x5f8bccdb, 0x5fce1e12,
+    0x60109d51, 0x60534ab7, 0x60962665, 0x60d9307b, 0x611c6919, 0x615fd05e,
+    0x61a3666d, 0x61e72b65, 0x622b1f66, 0x626f4292, 0x62b39509, 0x62f816eb,
+    0x633cc85b, 0x6381a978, 0x63c6ba64, 0x640bfb41, 0x64516c2e, 0x64970d4f,
+    0x64dcdec3, 0x6522e0ad, 0x6569132f, 0x65af766a, 0x65f60a7f, 0x663ccf92,
+    0x6683c5c3, 0x66caed35, 0x6712460b, 0x6759d065, 0x67a18c68, 0x67e97a34,
+    0x683199ed, 0x6879ebb6, 0x68c26fb1, 0x690b2601, 0x69540ec9, 0x699d2a2c,
+    0x69e6784d, 0x6a2ff94f, 0x6a79ad56, 0x6ac39485, 0x6b0daeff, 0x6b57fce9,
+    0x6ba27e65, 0x6bed3399, 0x6c381ca6, 0x6c8339b2, 0x6cce8ae1, 0x6d1a1057,
+    0x6d65ca38, 0x6db1b8a8, 0x6dfddbcc, 0x6e4a33c9, 0x6e96c0c3, 0x6ee382de,
+    0x6f307a41, 0x6f7da710, 0x6fcb096f, 0x7018a185, 0x70666f76, 0x70b47368,
+    0x7102ad80, 0x71511de4, 0x719fc4b9, 0x71eea226, 0x723db650, 0x728d015d,
+    0x72dc8374, 0x732c3cba, 0x737c2d55, 0x73cc556d, 0x741cb528, 0x746d4cac,
+    0x74be1c20, 0x750f23ab, 0x75606374, 0x75b1dba2, 0x76038c5b, 0x765575c8,
+    0x76a7980f, 0x76f9f359, 0x774c87cc, 0x779f5590, 0x77f25cce, 0x78459dac,
+    0x78991854, 0x78ecccec, 0x7940bb9e, 0x7994e492, 0x79e947ef, 0x7a3de5df,
+    0x7a92be8b, 0x7ae7d21a, 0x7b3d20b6, 0x7b92aa88, 0x7be86fba, 0x7c3e7073,
+    0x7c94acde, 0x7ceb2523, 0x7d41d96e, 0x7d98c9e6, 0x7deff6b6, 0x7e476009,
+    0x7e9f0606, 0x7ef6e8da, 0x7f4f08ae, 0x7fa765ad, 0x80000000,
+};
+
+/*! Multiplies with a 32x32->64 multiply, rounding like the reference. */
+static inline fix16_t fix16_mul_fast(fix16_t inArg0, fix16_t inArg1) {
+    int64_t product = (int64_t)inArg0 * inArg1;
+
+    // The upper 17 bits should all be the same (the sign).
+    if ((uint64_t)((product >> 47) + 1) > 1)
+        return FIX16_OVERFLOW;
+
+    // Like the reference, round -x.5 towards zero, without a branch on the
+    // sign that random data would mispredict.
+    product -= (int64_t)((uint64_t)product >> 63);
+
+    fix16_t result = (fix16_t)(product >> 16);
+    result += (fix16_t)((product & 0x8000) >> 15);
+    return result;
+}
+
+/*! Divides with a 64/32 divide, rounding half away from zero. */
+static inline fix16_t fix16_div_fast(fix16_t a, fix16_t b) {
+    if (b == 0)
+        return FIX16_MINIMUM;
+
+    uint32_t ua = (a >= 0) ? (uint32_t)a : -(uint32_t)a;
+    uint32_t ub = (b >= 0) ? (uint32_t)b : -(uint32_t)b;
+    uint64_t num = (uint64_t)ua << 16;
+    uint64_t quotient = num / ub;
+    uint32_t remainder = (uint32_t)(num - quotient * ub);
+
+    if (remainder >= ub - remainder)
+        quotient++;
+
+    if (quotient > 0x7FFFFFFF)
+        return FIX16_OVERFLOW;
+
+    fix16_t result = (fix16_t)quotient;
+    return ((a ^ b) & 0x80000000) ? -result : result;
+}
+
+/*! Square root from a float estimate, corrected to the rounded result. */
+static inline fix16_t fix16_sqrt_fast(fix16_t x) {
+    if (x == 0)
+        return 0;
+
+    // Negative x, like FIX16_OVERFLOW from the mean/variance estimator on a
+    // saturated signal, is taken as unsigned like the reference does. This
+    // also keeps NaN out of the estimate.
+    uint32_t ux = (uint32_t)x;
+
+    // sqrt(x / 2^16) * 2^16 = sqrt(x * 2^16)
+    uint64_t num = (uint64_t)ux << 16;
+    uint64_t result = (uint64_t)(sqrtf((float)ux) * 256.0f);
+
+    // The float estimate is off by a few LSB at most. sqrt(num) is below
+    // 2^24, the clamp keeps the correction below bounded even if it is not.
+    if (result > 0xFFFFFF)
+        result = 0xFFFFFF;
+    while (result * result > num)
+        result--;
+    while ((result + 1) * (result + 1) <= num)
+        result++;
+
+    // Round to nearest: up if num - result^2 > result
+    if (num - result * result > result)
+        result++;
+
+    return (fix16_t)result;
+}
+
+/*! Returns e^x as 2^(x * log2(e)) using fix16_exp2_table. */
+static inline fix16_t fix16_exp_fast(fix16_t x) {
+    // Same saturation as the reference
+    if (x >= F16(10.3972))
+        return FIX16_MAXIMUM;
+    if (x <= F16(-11.7835))
+        return 0;
+
+    // x * log2(e) in Q46, split into integer and fractional parts
+    int64_t t = (int64_t)x * 1549082005; // log2(e) in Q30
+    int32_t n = (int32_t)(t >> 46);
+    uint64_t f = (uint64_t)t & ((UINT64_C(1) << 46) - 1);
+    uint32_t i = (uint32_t)(f >> 38);
+    uint32_t weight = (uint32_t)(f >> 22) & 0xFFFF;
+
+    // 2^f in Q30, interpolated between table entries
+    uint32_t lo = fix16_exp2_table[i];
+    uint32_t hi = fix16_exp2_table[i + 1];
+    uint64_t p = lo + (((uint64_t)(hi - lo) * weight + 0x8000) >> 16);
+
+    // Scale by 2^n from Q30 to Q16, rounding
+    int32_t shift = 14 - n;
+    uint64_t result = shift > 0 ? (p + (UINT64_C(1) << (shift - 1))) >> shift : p;
+
+    return result > FIX16_MAXIMUM ? FIX16_MAXIMUM : (fix16_t)result;
+}
+
+#ifdef CONFIG_SGP40_VOC_FAST_MATH
+#define fix16_mul fix16_mul_fast
+#define fix16_div fix16_div_fast
+#define fix16_sqrt fix16_sqrt_fast
+#define fix16_exp fix16_exp_fast
+#else
+#define fix16_mul fix16_mul_reference
+#define fix16_div fix16_div_reference
+#define fix16_sqrt fix16_sqrt_reference
+#define fix16_exp fix16_exp_reference
+#endif
+
+#endif /* VOCALGORITHM_FIX16_H_ */
@@ -15,6 +15,9 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <ets_sys.h>
+#include <esp_timer.h>
+#include <esp_cpu.h>
+#include <inttypes.h>
 
 #define I2C_FREQ_HZ 400000
 
@@ -39,90 +42,12 @@ static const char *TAG = "sgp40";
 #define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
 #define CHECK_ARG(ARG) do { if (!(ARG)) return ESP_ERR_INVALID_ARG; } while (0)
 
-static uint8_t crc8(const uint8_t *data, size_t count)
-{
-    uint8_t res = 0xff;
-
-    for (size_t i = 0; i < count; ++i)
-    {
-        res ^= data[i];
-        for (uint8_t bit = 8; bit > 0; --bit)
-        {
-            if (res & 0x80)
-                res = (res << 1) ^ 0x31;
-            else
-                res = (res << 1);
-        }
-    }
-    return res;
-}
-
-static inline uint16_t swap(uint16_t v)
-{
-    return (v << 8) | (v >> 8);
-}
-
-static esp_err_t send_cmd(i2c_dev_t *dev, uint16_t cmd, uint16_t *data, size_t words)
-{
-    uint8_t buf[2 + words * 3];
-    // add command
-    *(uint16_t *)buf = swap(cmd);
-    if (data && words)
-        // add arguments
-        for (size_t i = 0; i < words; i++)
-        {
-            uint8_t *p = buf + 2 + i * 3;
-            *(uint16_t *)p = swap(data[i]);
-            *(p + 2) = crc8(p, 2);
-        }
-
-    ESP_LOGV(TAG, "Sending buffer:");
-    ESP_LOG_BUFFER_HEX_LEVEL(TAG, buf, sizeof(buf), ESP_LOG_VERBOSE);
-
-    return i2c_dev_write(dev, NULL, 0, buf, sizeof(buf));
-}
-
-static esp_err_t read_resp(i2c_dev_t *dev, uint16_t *data, size_t words)
-{
-    uint8_t buf[words * 3];
-    CHECK(i2c_dev_read(dev, NULL, 0, buf, sizeof(buf)));
-
-    ESP_LOGV(TAG, "Received buffer:");
-    ESP_LOG_BUFFER_HEX_LEVEL(TAG, buf, sizeof(buf), ESP_LOG_VERBOSE);
-
-    for (size_t i = 0; i < words; i++)
-    {
-        uint8_t *p = buf + i * 3;
-        uint8_t crc = crc8(p, 2);
-        if (crc != *(p + 2))
-        {
-            ESP_LOGE(TAG, "Invalid CRC 0x%02x, expected 0x%02x", crc, *(p + 2));
-            return ESP_ERR_INVALID_CRC;
-        }
-        data[i] = swap(*(uint16_t *)p);
-    }
-    return ESP_OK;
-}
-
 static esp_err_t execute_cmd(sgp40_t *dev, uint16_t cmd, uint32_t timeout_ms,
         uint16_t *out_data, size_t out_words, uint16_t *in_data, size_t in_words)
 {
     CHECK_ARG(dev);
 
-    I2C_DEV_TAKE_MUTEX(&dev->i2c_dev);
-    I2C_DEV_CHECK(&dev->i2c_dev, send_cmd(&dev->i2c_dev, cmd, out_data, out_words));
-    if (timeout_ms)
-    {
-        if (timeout_ms > 10)
-            vTaskDelay(pdMS_TO_TICKS(timeout_ms));
-        else
-            ets_delay_us(timeout_ms * 1000);
-    }
-    if (in_data && in_words)
-        I2C_DEV_CHECK(&dev->i2c_dev, read_resp(&dev->i2c_dev, in_data, in_words));
-    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
-
-    return ESP_OK;
+    return sensirion_i2c_execute(&dev->i2c_dev, cmd, out_data, out_words, timeout_ms, in_data, in_words);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -131,21 +56,16 @@ esp_err_t sgp40_init_desc(sgp40_t *dev, i2c_port_t port, gpio_num_t sda_gpio, gp
 {
     CHECK_ARG(dev);
 
-    dev->i2c_dev.port = port;
-    dev->i2c_dev.addr = SGP40_ADDR;
-    dev->i2c_dev.cfg.sda_io_num = sda_gpio;
-    dev->i2c_dev.cfg.scl_io_num = scl_gpio;
-#if HELPER_TARGET_IS_ESP32
-    dev->i2c_dev.cfg.master.clk_speed = I2C_FREQ_HZ;
-#endif
-    return i2c_dev_create_mutex(&dev->i2c_dev);
+    CHECK(sensirion_i2c_init_desc(&dev->i2c_dev, port, SGP40_ADDR, sda_gpio, scl_gpio, I2C_FREQ_HZ));
+
+    return sensirion_i2c_set_reset(&dev->i2c_dev, CMD_SOFT_RESET, TIME_SOFT_RESET);
 }
 
 esp_err_t sgp40_free_desc(sgp40_t *dev)
 {
     CHECK_ARG(dev);
 
-    return i2c_dev_delete_mutex(&dev->i2c_dev);
+    return sensirion_i2c_free_desc(&dev->i2c_dev);
 }
 
 esp_err_t sgp40_init(sgp40_t *dev)
@@ -159,6 +79,9 @@ esp_err_t sgp40_init(sgp40_t *dev)
             dev->serial[0], dev->serial[1], dev->serial[2], dev->featureset);
 
     VocAlgorithm_init(&dev->voc);
+    dev->voc_samples = 0;
+    dev->voc_sample_time = 0;
+    dev->measuring = false;
 
     return ESP_OK;
 }
@@ -187,15 +110,12 @@ esp_err_t sgp40_heater_off(sgp40_t *dev)
     return execute_cmd(dev, CMD_HEATER_OFF, TIME_HEATER_OFF, NULL, 0, NULL, 0);
 }
 
-esp_err_t sgp40_measure_raw(sgp40_t *dev, float humidity, float temperature, uint16_t *raw)
+static void compensation_params(float humidity, float temperature, uint16_t *params)
 {
-    CHECK_ARG(dev && raw);
-
-    uint16_t params[2];
     if (isnan(humidity) || isnan(temperature))
     {
-        params[0] = 0x8000;
-        params[1] = 0x6666;
+        params[0] = SGP40_HUMIDITY_TICKS_DEFAULT;
+        params[1] = SGP40_TEMPERATURE_TICKS_DEFAULT;
         ESP_LOGW(TAG, "Uncompensated measurement");
     }
     else
@@ -210,20 +130,166 @@ esp_err_t sgp40_measure_raw(sgp40_t *dev, float humidity, float temperature, uin
         else if (temperature > 129.76)
             temperature = 129.76;
 
-        params[0] = (uint16_t)(humidity / 100.0 * 65536);
-        params[1] = (uint16_t)((temperature + 45) / 175.0 * 65535);
+        // 65535 per the datasheet, 100 %RH used to wrap around to 0
+        params[0] = SGP40_HUMIDITY_TICKS(humidity);
+        params[1] = SGP40_TEMPERATURE_TICKS(temperature);
     }
+}
+
+esp_err_t sgp40_measure_raw(sgp40_t *dev, float humidity, float temperature, uint16_t *raw)
+{
+    CHECK_ARG(dev && raw);
+
+    uint16_t params[2];
+    compensation_params(humidity, temperature, params);
 
     return execute_cmd(dev, CMD_MEASURE_RAW, TIME_MEASURE_RAW, params, 2, raw, 1);
 }
 
+esp_err_t sgp40_measure_raw_ticks(sgp40_t *dev, uint16_t humidity, uint16_t temperature, uint16_t *raw)
+{
+    CHECK_ARG(dev && raw);
+
+    uint16_t params[2] = { humidity, temperature };
+
+    return execute_cmd(dev, CMD_MEASURE_RAW, TIME_MEASURE_RAW, params, 2, raw, 1);
+}
+
+static void process_sample(sgp40_t *dev, uint16_t sraw, uint16_t *raw, int32_t *voc_index)
+{
+    // Feed the actual sample spacing so retries do not skew the time
+    // constants of the VOC algorithm. Loop jitter is snapped away by
+    // VocAlgorithm_quantize_interval(), so the coefficients stay cached.
+    int64_t now = esp_timer_get_time();
+    int32_t interval_ms = dev->voc_samples
+        ? (int32_t)((now - dev->voc_sample_time) / 1000)
+        : (int32_t)(VocAlgorithm_SAMPLING_INTERVAL * 1000);
+
+    int32_t index;
+    VocAlgorithm_process_dt(&dev->voc, sraw, interval_ms, &index);
+
+    dev->voc_sample_time = now;
+    dev->voc_samples++;
+
+    if (raw)
+        *raw = sraw;
+    if (voc_index)
+        *voc_index = index;
+}
+
+esp_err_t sgp40_measure(sgp40_t *dev, float humidity, float temperature, uint16_t *raw, int32_t *voc_index)
+{
+    CHECK_ARG(dev);
+
+    uint16_t sraw;
+    CHECK(sgp40_measure_raw(dev, humidity, temperature, &sraw));
+    process_sample(dev, sraw, raw, voc_index);
+
+    return ESP_OK;
+}
+
+esp_err_t sgp40_start_measure(sgp40_t *dev, float humidity, float temperature)
+{
+    CHECK_ARG(dev);
+
+    uint16_t params[2];
+    compensation_params(humidity, temperature, params);
+
+    return sgp40_start_measure_ticks(dev, params[0], params[1]);
+}
+
+esp_err_t sgp40_start_measure_ticks(sgp40_t *dev, uint16_t humidity, uint16_t temperature)
+{
+    CHECK_ARG(dev);
+
+    uint16_t params[2] = { humidity, temperature };
+
+    // Collect a start that was never read, so the command slot is free
+    if (dev->measuring)
+        sensirion_i2c_complete_cmd(&dev->i2c_dev);
+
+    // The command is only queued, it goes out while the caller carries on
+    dev->measuring = false;
+    CHECK(sensirion_i2c_submit_cmd(&dev->i2c_dev, CMD_MEASURE_RAW, params, 2));
+    dev->measure_start = esp_timer_get_time();
+    dev->measuring = true;
+
+    return ESP_OK;
+}
+
+esp_err_t sgp40_read_measure(sgp40_t *dev, uint16_t *raw, int32_t *voc_index)
+{
+    CHECK_ARG(dev);
+
+    if (!dev->measuring)
+        return ESP_ERR_INVALID_STATE;
+    dev->measuring = false;
+
+    CHECK(sensirion_i2c_complete_cmd(&dev->i2c_dev));
+
+    // only wait for what is left of the measurement time
+    int64_t left_us = (int64_t)TIME_MEASURE_RAW * 1000 - (esp_timer_get_time() - dev->measure_start);
+    if (left_us > 0)
+    {
+        TickType_t ticks = left_us / (portTICK_PERIOD_MS * 1000);
+        if (ticks)
+            vTaskDelay(ticks + 1);
+        else
+            ets_delay_us(left_us);
+    }
+
+    uint16_t sraw;
+    CHECK(sensirion_i2c_read_words(&dev->i2c_dev, &sraw, 1));
+    process_sample(dev, sraw, raw, voc_index);
+
+    return ESP_OK;
+}
+
 esp_err_t sgp40_measure_voc(sgp40_t *dev, float humidity, float temperature, int32_t *voc_index)
 {
     CHECK_ARG(dev && voc_index);
 
-    uint16_t raw;
-    CHECK(sgp40_measure_raw(dev, humidity, temperature, &raw));
-    VocAlgorithm_process(&dev->voc, raw, voc_index);
+    return sgp40_measure(dev, humidity, temperature, NULL, voc_index);
+}
+
+esp_err_t sgp40_get_voc_diagnostics(const sgp40_t *dev, VocAlgorithmDiagnostics *diagnostics)
+{
+    CHECK_ARG(dev && diagnostics);
+
+    if (!dev->voc_samples)
+        return ESP_ERR_INVALID_STATE;
+
+    VocAlgorithm_get_diagnostics(&dev->voc, diagnostics);
+
+    return ESP_OK;
+}
+
+esp_err_t sgp40_voc_benchmark(uint32_t samples, uint32_t *cycles_per_sample)
+{
+    CHECK_ARG(samples && cycles_per_sample);
+
+    VocAlgorithmParams voc;
+    uint32_t rng = 0x5eed;
+    int32_t voc_index;
+    uint32_t cycles = 0;
+
+    VocAlgorithm_init(&voc);
+
+    for (uint32_t i = 0; i < samples; i++)
+    {
+        // Slow drift around 30000 ticks with some noise
+        rng = rng * 1664525u + 1013904223u;
+        int32_t sraw = 30000 + (int32_t)((i / 60) % 120) - 60 + (int32_t)((rng >> 24) % 41) - 20;
+
+        uint32_t start = esp_cpu_get_cycle_count();
+        VocAlgorithm_process(&voc, sraw, &voc_index);
+        cycles += esp_cpu_get_cycle_count() - start;
+    }
+
+    *cycles_per_sample = cycles / samples;
+
+    ESP_LOGI(TAG, "VOC algorithm: %" PRIu32 " cycles per sample over %" PRIu32 " samples, last index %" PRIi32,
+            *cycles_per_sample, samples, voc_index);
 
     return ESP_OK;
 }
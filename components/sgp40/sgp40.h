@@ -14,7 +14,7 @@
 
 #include <stdbool.h>
 #include <time.h>
-#include <i2cdev.h>
+#include <sensirion_i2c.h>
 #include <esp_err.h>
 #include "sensirion_voc_algorithm.h"
 
@@ -24,15 +24,32 @@ extern "C" {
 
 #define SGP40_ADDR 0x59 //!< I2C address
 
+#define SGP40_HUMIDITY_TICKS_DEFAULT    0x8000 //!< 50 %RH, used for uncompensated measurements
+#define SGP40_TEMPERATURE_TICKS_DEFAULT 0x6666 //!< 25 degrees Celsius, used for uncompensated measurements
+
+/**
+ * Humidity in percents to compensation ticks
+ */
+#define SGP40_HUMIDITY_TICKS(rh) ((uint16_t)((rh) * 65535 / 100))
+
+/**
+ * Temperature in degrees Celsius to compensation ticks
+ */
+#define SGP40_TEMPERATURE_TICKS(t) ((uint16_t)(((t) + 45) * 65535 / 175))
+
 /**
  * Device descriptor
  */
 typedef struct
 {
-    i2c_dev_t i2c_dev;
+    sensirion_i2c_dev_t i2c_dev;
     uint16_t serial[3];
     uint16_t featureset;
     VocAlgorithmParams voc;
+    uint32_t voc_samples;  //!< Number of samples fed into the VOC algorithm since init
+    bool measuring;        //!< A measurement was started and not read yet
+    int64_t measure_start; //!< esp_timer time the measurement was started at, us
+    int64_t voc_sample_time; //!< esp_timer time of the last sample fed into the VOC algorithm, us
 } sgp40_t;
 
 /**
@@ -100,9 +117,29 @@ esp_err_t sgp40_heater_off(sgp40_t *dev);
  */
 esp_err_t sgp40_measure_raw(sgp40_t *dev, float humidity, float temperature, uint16_t *raw);
 
+/**
+ * @brief Perform a measurement compensated with raw ticks
+ *
+ * See ::sgp40_start_measure_ticks() for the format of the ticks.
+ *
+ * @param dev Device descriptor
+ * @param humidity Relative humidity ticks
+ * @param temperature Temperature ticks
+ * @param[out] raw Raw value, proportional to the logarithm
+ *                 of the resistance of the sensing element
+ * @return `ESP_OK` on success
+ */
+esp_err_t sgp40_measure_raw_ticks(sgp40_t *dev, uint16_t humidity, uint16_t temperature, uint16_t *raw);
+
 /**
  * @brief Perform a measurement and update VOC index
  *
+ * Every call feeds one sample into the VOC algorithm, which is calibrated for
+ * exactly one sample per ::VocAlgorithm_SAMPLING_INTERVAL. It must only be
+ * called by the single task that owns the sensor, at that fixed rate. Other
+ * tasks must not touch the descriptor, the owner has to publish the results
+ * it shares.
+ *
  * @param dev Device descriptor
  * @param humidity Relative humidity, percents. Use NaN if
  *                 you want uncompensated measurement
@@ -113,6 +150,105 @@ esp_err_t sgp40_measure_raw(sgp40_t *dev, float humidity, float temperature, uin
  */
 esp_err_t sgp40_measure_voc(sgp40_t *dev, float humidity, float temperature, int32_t *voc_index);
 
+/**
+ * @brief Perform one measurement, update VOC index and return both values
+ *
+ * Issues a single raw measurement and feeds it into the VOC algorithm, so it
+ * costs one hotplate cycle instead of the two that ::sgp40_measure_voc()
+ * followed by ::sgp40_measure_raw() would. The same single owner rule as for
+ * ::sgp40_measure_voc() applies.
+ *
+ * @param dev Device descriptor
+ * @param humidity Relative humidity, percents. Use NaN if
+ *                 you want uncompensated measurement
+ * @param temperature Temperature, degrees Celsius. Use NaN if
+ *                    you want uncompensated measurement
+ * @param[out] raw Raw value the VOC index was calculated from, may be NULL
+ * @param[out] voc_index Calculated VOC index, may be NULL
+ * @return `ESP_OK` on success
+ */
+esp_err_t sgp40_measure(sgp40_t *dev, float humidity, float temperature, uint16_t *raw, int32_t *voc_index);
+
+/**
+ * @brief Start a measurement without waiting for the result
+ *
+ * First half of ::sgp40_measure(). Queues the measure command with the given
+ * compensation values and returns without waiting for the bus, so the caller
+ * can do other work, like reading a sensor on another bus, while the command
+ * goes out and the hotplate is running. The result has to be collected with
+ * ::sgp40_read_measure() from the same task, which also reports a failed
+ * command.
+ *
+ * @param dev Device descriptor
+ * @param humidity Relative humidity, percents. Use NaN if
+ *                 you want uncompensated measurement
+ * @param temperature Temperature, degrees Celsius. Use NaN if
+ *                    you want uncompensated measurement
+ * @return `ESP_OK` on success
+ */
+esp_err_t sgp40_start_measure(sgp40_t *dev, float humidity, float temperature);
+
+/**
+ * @brief Start a measurement compensated with raw ticks
+ *
+ * Same as ::sgp40_start_measure(), but takes the compensation words as they
+ * are sent to the device: humidity is 65535 * %RH / 100 and temperature is
+ * 65535 * (T + 45) / 175. These are the raw words of a Sensirion SHT3x/SHT4x,
+ * which can be passed through without any floating point. Use
+ * ::SGP40_HUMIDITY_TICKS_DEFAULT and ::SGP40_TEMPERATURE_TICKS_DEFAULT for
+ * an uncompensated measurement.
+ *
+ * @param dev Device descriptor
+ * @param humidity Relative humidity ticks
+ * @param temperature Temperature ticks
+ * @return `ESP_OK` on success
+ */
+esp_err_t sgp40_start_measure_ticks(sgp40_t *dev, uint16_t humidity, uint16_t temperature);
+
+/**
+ * @brief Read the result of a started measurement and update VOC index
+ *
+ * Second half of ::sgp40_measure(). Waits for the measure command to have
+ * been sent and for whatever is left of the measurement time since
+ * ::sgp40_start_measure(), then reads the raw value
+ * and feeds it into the VOC algorithm. The same single owner rule as for
+ * ::sgp40_measure_voc() applies.
+ *
+ * @param dev Device descriptor
+ * @param[out] raw Raw value the VOC index was calculated from, may be NULL
+ * @param[out] voc_index Calculated VOC index, may be NULL
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_STATE` if no measurement
+ *         was started
+ */
+esp_err_t sgp40_read_measure(sgp40_t *dev, uint16_t *raw, int32_t *voc_index);
+
+/**
+ * @brief Get the internal states of the VOC algorithm
+ *
+ * Copies the learned baseline, gating and lowpass states as they were left
+ * by the last processed sample, without talking to the device. Must be
+ * called from the task that steps the algorithm.
+ *
+ * @param dev Device descriptor
+ * @param[out] diagnostics Internal states of the VOC algorithm
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_STATE` if no sample has
+ *         been processed yet
+ */
+esp_err_t sgp40_get_voc_diagnostics(const sgp40_t *dev, VocAlgorithmDiagnostics *diagnostics);
+
+/**
+ * @brief Measure the cost of the VOC algorithm on this CPU
+ *
+ * Runs synthetic raw values through a separate VOC algorithm instance, so
+ * no device is needed and no device state is touched. Interrupts are not
+ * disabled, so the result includes their cost.
+ *
+ * @param samples Number of samples to process
+ * @param[out] cycles_per_sample Mean CPU cycles per VocAlgorithm_process()
+ * @return `ESP_OK` on success
+ */
+esp_err_t sgp40_voc_benchmark(uint32_t samples, uint32_t *cycles_per_sample);
+
 #ifdef __cplusplus
 }
 #endif
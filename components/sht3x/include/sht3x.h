@@ -83,6 +83,7 @@ extern "C" {
 #define SHT3x_SEND_RESET_CMD_FAILED  (6  << 8)
 #define SHT3x_SEND_STATUS_CMD_FAILED (7  << 8)
 #define SHT3x_SEND_FETCH_CMD_FAILED  (8  << 8)
+#define SHT3x_SEND_BREAK_CMD_FAILED  (11 << 8)
 
 #define SHT3x_WRONG_CRC_TEMPERATURE  (9  << 8)
 #define SHT3x_WRONG_CRC_HUMIDITY     (10 << 8)
@@ -104,7 +105,8 @@ typedef enum {
     sht3x_periodic_1mps,    // periodic with   1 measurements per second (mps)
     sht3x_periodic_2mps,    // periodic with   2 measurements per second (mps)
     sht3x_periodic_4mps,    // periodic with   4 measurements per second (mps)
-    sht3x_periodic_10mps    // periodic with  10 measurements per second (mps)
+    sht3x_periodic_10mps,   // periodic with  10 measurements per second (mps)
+    sht3x_periodic_art      // periodic with accelerated response time (4 mps)
 } sht3x_mode_t;
     
     
@@ -126,6 +128,7 @@ typedef struct {
     
     uint8_t         bus;             // I2C bus at which sensor is connected
     uint8_t         addr;            // I2C slave address of the sensor
+    sensirion_i2c_dev_t i2c_dev;     // shared Sensirion transport
     
     sht3x_mode_t    mode;            // used measurement mode
     sht3x_repeat_t  repeatability;   // used repeatability
@@ -133,6 +136,7 @@ typedef struct {
     bool            meas_started;    // indicates whether measurement started
     uint32_t        meas_start_time; // measurement start time in us
     bool            meas_first;      // first measurement in periodic mode
+    uint32_t        resets_seen;     // soft resets by the transport so far
     
 } sht3x_sensor_t;    
 
@@ -143,11 +147,19 @@ typedef struct {
  * The function creates a data structure describing the sensor and
  * initializes the sensor device.
  *  
+ * The bus is driven through i2cdev, so *i2cdev_init* has to be called
+ * before. Transfers that keep failing are recovered by the transport, which
+ * may soft reset the sensor. A periodic measurement is started again on the
+ * next *sht3x_get_raw_data* after such a reset.
+ *
  * @param   bus       I2C bus at which the sensor is connected
  * @param   addr      I2C slave address of the sensor
+ * @param   sda       SDA GPIO
+ * @param   scl       SCL GPIO
  * @return            pointer to sensor data structure, or NULL on error
  */
-sht3x_sensor_t* sht3x_init_sensor (uint8_t bus, uint8_t addr);
+sht3x_sensor_t* sht3x_init_sensor (i2c_port_t bus, uint8_t addr,
+                                   gpio_num_t sda, gpio_num_t scl);
 
 
 /**
@@ -190,7 +202,12 @@ bool sht3x_measure (sht3x_sensor_t* dev, float* temperature, float* humidity);
  * the measurement duration has to be waited only once until the first
  * results are available. After this first measurement, the sensor then
  * automatically performs all subsequent measurements. The rate of periodic
- * measurements can be 10, 4, 2, 1 or 0.5 measurements per second (mps).
+ * measurements can be 10, 4, 2, 1 or 0.5 measurements per second (mps),
+ * or 4 mps with accelerated response time (ART). The repeatability is
+ * ignored in ART mode.
+ *
+ * Starting a periodic measurement while another one is running stops the
+ * running one first.
  * 
  * Please note: Due to inaccuracies in timing of the sensor, the user task
  * should fetch the results at a lower rate. The rate of the periodic
@@ -204,6 +221,19 @@ bool sht3x_measure (sht3x_sensor_t* dev, float* temperature, float* humidity);
 bool sht3x_start_measurement (sht3x_sensor_t* dev, sht3x_mode_t mode,
                               sht3x_repeat_t repeat);
 
+/**
+ * @brief   Stop a running periodic measurement
+ *
+ * The function sends the break command, which returns the sensor to single
+ * shot mode. It is not necessary to call this function before switching
+ * between periodic modes, *sht3x_start_measurement* takes care of that.
+ *
+ * @param   dev         pointer to sensor device data structure
+ * @return              true on success, false on error
+ */
+bool sht3x_stop_measurement (sht3x_sensor_t* dev);
+
+
 /**
  * @brief   Get the duration of a measurement in RTOS ticks.
  *
@@ -236,6 +266,11 @@ uint8_t sht3x_get_measurement_duration (sht3x_repeat_t repeat);
  *      data[2] = Pressure CRC
  *
  * In case that there are no new data that can be read, the function fails.
+ *
+ * In *periodic mode*, the fetch command and the read are done in a single
+ * I2C transaction with a repeated start, so every call costs exactly one bus
+ * transfer and returns the latest result. The sensor clears its result
+ * buffer on every fetch, so fetch at a lower rate than the periodic rate.
  * 
  * @param   dev         pointer to sensor device data structure
  * @param   raw_data    byte array in which raw data are stored 
@@ -273,6 +308,57 @@ bool sht3x_get_results (sht3x_sensor_t* dev,
                         float* temperature, float* humidity);
 
 
+/**
+ * @brief   Extract the raw sensor words from raw data
+ *
+ * The raw words are the ticks the sensor measured, temperature is
+ * -45 + 175 * ticks / 65535 degree Celsius and humidity is
+ * 100 * ticks / 65535 percent. These are exactly the scales the Sensirion
+ * SGP4x take their compensation words in, so the ticks can be passed on
+ * without any conversion.
+ *
+ * @param   raw_data    byte array that contains raw data
+ * @param   temperature returns temperature ticks
+ * @param   humidity    returns humidity ticks
+ * @return              true on success, false on error
+ */
+bool sht3x_compute_ticks (sht3x_raw_data_t raw_data,
+                          uint16_t* temperature, uint16_t* humidity);
+
+
+/**
+ * @brief   Get measurement results as raw sensor words
+ *
+ * Integer only counterpart of *sht3x_get_results*, see
+ * *sht3x_compute_ticks*.
+ *
+ * @param   dev         pointer to sensor device data structure
+ * @param   temperature returns temperature ticks
+ * @param   humidity    returns humidity ticks
+ * @return              true on success, false on error
+ */
+bool sht3x_get_ticks (sht3x_sensor_t* dev,
+                      uint16_t* temperature, uint16_t* humidity);
+
+
+/**
+ * @brief   Convert temperature ticks to degree Celsius
+ */
+static inline float sht3x_ticks_to_celsius (uint16_t ticks)
+{
+    return ticks * 175.0f / 65535.0f - 45.0f;
+}
+
+
+/**
+ * @brief   Convert humidity ticks to percent
+ */
+static inline float sht3x_ticks_to_percent (uint16_t ticks)
+{
+    return ticks * 100.0f / 65535.0f;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,8 +50,10 @@
 #ifdef ESP_PLATFORM  // ESP32 (ESP-IDF)
 
 // platform specific includes
-#include "esp8266_wrapper.h"
-#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "sensirion_i2c.h"
 
 #endif // ESP_PLATFORM
 
@@ -51,14 +51,24 @@
 #define SHT3x_RESET_CMD                0x30A2
 #define SHT3x_FETCH_DATA_CMD           0xE000
 #define SHT3x_HEATER_OFF_CMD           0x3066
+#define SHT3x_BREAK_CMD                0x3093
 
-const uint16_t SHT3x_MEASURE_CMD[6][3] = {
+#define SHT3x_I2C_FREQ_HZ              100000
+
+// soft reset time in ms, 1.5 ms according to the datasheet
+#define SHT3x_RESET_DURATION           2
+
+// time the sensor needs to return to idle after the break command in ms
+#define SHT3x_BREAK_DURATION           1
+
+const uint16_t SHT3x_MEASURE_CMD[7][3] = {
         {0x2400,0x240b,0x2416},    // [SINGLE_SHOT][H,M,L] without clock stretching
         {0x2032,0x2024,0x202f},    // [PERIODIC_05][H,M,L]
         {0x2130,0x2126,0x212d},    // [PERIODIC_1 ][H,M,L]
         {0x2236,0x2220,0x222b},    // [PERIODIC_2 ][H,M,L]
-        {0x2234,0x2322,0x2329},    // [PERIODIC_4 ][H,M,L]
-        {0x2737,0x2721,0x272a} };  // [PERIODIC_10][H,M,L]
+        {0x2334,0x2322,0x2329},    // [PERIODIC_4 ][H,M,L]
+        {0x2737,0x2721,0x272a},    // [PERIODIC_10][H,M,L]
+        {0x2b32,0x2b32,0x2b32} };  // [PERIODIC_ART] repeatability not used
 
 // due to the fact that ticks can be smaller than portTICK_PERIOD_MS, one and
 // a half tick period added to the duration to be sure that waiting time for
@@ -100,10 +110,10 @@ const uint8_t SHT3x_MEAS_DURATION_TICKS[3] = { TIME_TO_TICKS(SHT3x_MEAS_DURATION
 static bool sht3x_is_measuring  (sht3x_sensor_t*);
 static bool sht3x_send_command  (sht3x_sensor_t*, uint16_t);
 static bool sht3x_read_data     (sht3x_sensor_t*, uint8_t*,  uint32_t);
+static bool sht3x_fetch_data    (sht3x_sensor_t*, uint8_t*,  uint32_t);
 static bool sht3x_get_status    (sht3x_sensor_t*, uint16_t*);
 static bool sht3x_reset         (sht3x_sensor_t*);
-
-static uint8_t crc8 (uint8_t data[], int len);
+static void sht3x_set_i2c_error (sht3x_sensor_t*, esp_err_t, uint32_t, uint8_t*);
 
 /** ------------------------------------------------ */
 
@@ -113,7 +123,8 @@ bool sht3x_init_driver()
 }
 
 
-sht3x_sensor_t* sht3x_init_sensor(uint8_t bus, uint8_t addr)
+sht3x_sensor_t* sht3x_init_sensor(i2c_port_t bus, uint8_t addr,
+                                  gpio_num_t sda, gpio_num_t scl)
 {
     sht3x_sensor_t* dev;
 
@@ -123,8 +134,20 @@ sht3x_sensor_t* sht3x_init_sensor(uint8_t bus, uint8_t addr)
     }
 
     // inititalize sensor data structure
+    memset(dev, 0, sizeof(sht3x_sensor_t));
     dev->bus  = bus;
     dev->addr = addr;
+
+    if (sensirion_i2c_init_desc(&dev->i2c_dev, bus, addr, sda, scl,
+                                SHT3x_I2C_FREQ_HZ) != ESP_OK)
+    {
+        printf("could not initialize I2C device\n");
+        free(dev);
+        return NULL;
+    }
+    dev->i2c_dev.i2c_dev.cfg.sda_pullup_en = GPIO_PULLUP_ENABLE;
+    dev->i2c_dev.i2c_dev.cfg.scl_pullup_en = GPIO_PULLUP_ENABLE;
+    sensirion_i2c_set_reset(&dev->i2c_dev, SHT3x_RESET_CMD, SHT3x_RESET_DURATION);
     dev->mode = sht3x_single_shot;
     dev->meas_start_time = 0;
     dev->meas_started = false;
@@ -142,6 +165,7 @@ sht3x_sensor_t* sht3x_init_sensor(uint8_t bus, uint8_t addr)
     if (!sht3x_get_status(dev, &status))
     {
         printf("could not get sensor status\n");
+        sensirion_i2c_free_desc(&dev->i2c_dev);
         free(dev);
         return NULL;
     }
@@ -178,6 +202,12 @@ bool sht3x_start_measurement (sht3x_sensor_t* dev, sht3x_mode_t mode, sht3x_repe
     if (!dev) return false;
 
     dev->error_code = SHT3x_OK;
+
+    // the sensor ignores measurement commands while in periodic mode
+    if (dev->mode != sht3x_single_shot && dev->meas_started &&
+        !sht3x_stop_measurement(dev))
+        return false;
+
     dev->mode = mode;
     dev->repeatability = repeat;
 
@@ -189,8 +219,8 @@ bool sht3x_start_measurement (sht3x_sensor_t* dev, sht3x_mode_t mode, sht3x_repe
         return false;
     }
 
-    dev->meas_start_time = sdk_system_get_time ();
-    printf("start time = %lu\n", dev->meas_start_time);
+    dev->meas_start_time = (uint32_t)esp_timer_get_time ();
+    debug_dev ("start time = %lu", __FUNCTION__, dev, dev->meas_start_time);
     dev->meas_started = true;
     dev->meas_first = true;
 
@@ -198,6 +228,29 @@ bool sht3x_start_measurement (sht3x_sensor_t* dev, sht3x_mode_t mode, sht3x_repe
 }
 
 
+bool sht3x_stop_measurement (sht3x_sensor_t* dev)
+{
+    if (!dev) return false;
+
+    dev->error_code = SHT3x_OK;
+
+    if (!sht3x_send_command(dev, SHT3x_BREAK_CMD))
+    {
+        error_dev ("could not send break command", __FUNCTION__, dev);
+        dev->error_code |= SHT3x_SEND_BREAK_CMD_FAILED;
+        return false;
+    }
+
+    dev->mode = sht3x_single_shot;
+    dev->meas_started = false;
+    dev->meas_first = false;
+
+    vTaskDelay (TIME_TO_TICKS(SHT3x_BREAK_DURATION));
+
+    return true;
+}
+
+
 uint8_t sht3x_get_measurement_duration (sht3x_repeat_t repeat)
 {
     return SHT3x_MEAS_DURATION_TICKS[repeat];  // in RTOS ticks
@@ -213,6 +266,20 @@ bool sht3x_get_raw_data(sht3x_sensor_t* dev, sht3x_raw_data_t raw_data)
 
     dev->error_code = SHT3x_OK;
 
+    // a soft reset by the transport drops the sensor out of periodic mode
+    if (dev->i2c_dev.stats.resets != dev->resets_seen)
+    {
+        dev->resets_seen = dev->i2c_dev.stats.resets;
+        if (dev->mode != sht3x_single_shot && dev->meas_started)
+        {
+            printf("restarting periodic measurement after reset\n");
+            dev->meas_started = false;
+            sht3x_start_measurement (dev, dev->mode, dev->repeatability);
+            dev->error_code |= SHT3x_MEAS_STILL_RUNNING;
+            return false;
+        }
+    }
+
     if (!dev->meas_started)
     {
         printf ("measurement is not started\n");
@@ -227,16 +294,17 @@ bool sht3x_get_raw_data(sht3x_sensor_t* dev, sht3x_raw_data_t raw_data)
         return false;
     }
 
-    // send fetch command in any periodic mode (mode > 0) before read raw data
-    if (dev->mode && !sht3x_send_command(dev, SHT3x_FETCH_DATA_CMD))
+    // in any periodic mode (mode > 0) fetch and read in one transaction,
+    // in single shot mode the results are read directly
+    if (dev->mode)
     {
-        printf ("send fetch command failed\n");
-        dev->error_code |= SHT3x_SEND_FETCH_CMD_FAILED;
-        return false;
+        if (!sht3x_fetch_data(dev, raw_data, sizeof(sht3x_raw_data_t)))
+        {
+            printf ("fetch raw data failed\n");
+            return false;
+        }
     }
-
-    // read raw data
-    if (!sht3x_read_data(dev, raw_data, sizeof(sht3x_raw_data_t)))
+    else if (!sht3x_read_data(dev, raw_data, sizeof(sht3x_raw_data_t)))
     {
         printf("read raw data failed\n");
         dev->error_code |= SHT3x_READ_RAW_DATA_FAILED;
@@ -250,22 +318,7 @@ bool sht3x_get_raw_data(sht3x_sensor_t* dev, sht3x_raw_data_t raw_data)
     if (dev->mode == sht3x_single_shot)
         dev->meas_started = false;
 
-    // check temperature crc
-    if (crc8(raw_data,2) != raw_data[2])
-    {
-        printf("CRC check for temperature data failed\n");
-        dev->error_code |= SHT3x_WRONG_CRC_TEMPERATURE;
-        return false;
-    }
-
-    // check humidity crc
-    if (crc8(raw_data+3,2) != raw_data[5])
-    {
-        printf ("CRC check for humidity data failed\n");
-        dev->error_code |= SHT3x_WRONG_CRC_HUMIDITY;
-        return false;
-    }
-
+    // the CRCs were already checked by the transport
     return true;
 }
 
@@ -299,6 +352,33 @@ bool sht3x_get_results (sht3x_sensor_t* dev, float* temperature, float* humidity
     return sht3x_compute_values (raw_data, temperature, humidity);
 }
 
+
+bool sht3x_compute_ticks (sht3x_raw_data_t raw_data, uint16_t* temperature, uint16_t* humidity)
+{
+    if (!raw_data) return false;
+
+    if (temperature)
+        *temperature = (raw_data[0] << 8) | raw_data[1];
+
+    if (humidity)
+        *humidity = (raw_data[3] << 8) | raw_data[4];
+
+    return true;
+}
+
+
+bool sht3x_get_ticks (sht3x_sensor_t* dev, uint16_t* temperature, uint16_t* humidity)
+{
+    if (!dev || (!temperature && !humidity)) return false;
+
+    sht3x_raw_data_t raw_data;
+
+    if (!sht3x_get_raw_data (dev, raw_data))
+        return false;
+
+    return sht3x_compute_ticks (raw_data, temperature, humidity);
+}
+
 /* Functions for internal use only */
 
 static bool sht3x_is_measuring (sht3x_sensor_t* dev)
@@ -313,15 +393,29 @@ static bool sht3x_is_measuring (sht3x_sensor_t* dev)
       return false;
 
     // not running if time elapsed is greater than duration
-    printf("start time = %lu\n", dev->meas_start_time);
-    printf("current time = %lu\n", sdk_system_get_time());
-    printf("difference = %lu\n", sdk_system_get_time() - dev->meas_start_time);
-    uint32_t elapsed = sdk_system_get_time() - dev->meas_start_time;
+    uint32_t elapsed = (uint32_t)esp_timer_get_time() - dev->meas_start_time;
 
     return elapsed < SHT3x_MEAS_DURATION_US[dev->repeatability];
 }
 
 
+static void sht3x_set_i2c_error (sht3x_sensor_t* dev, esp_err_t err,
+                                 uint32_t i2c_error, uint8_t* data)
+{
+    if (err != ESP_ERR_INVALID_CRC)
+    {
+        dev->error_code |= (err == ESP_ERR_TIMEOUT) ? SHT3x_I2C_BUSY : i2c_error;
+        return;
+    }
+
+    // tell which of the two measurement words was broken
+    if (sensirion_i2c_crc8(data, 2) != data[2])
+        dev->error_code |= SHT3x_WRONG_CRC_TEMPERATURE;
+    else
+        dev->error_code |= SHT3x_WRONG_CRC_HUMIDITY;
+}
+
+
 static bool sht3x_send_command(sht3x_sensor_t* dev, uint16_t cmd)
 {
     if (!dev) {
@@ -329,18 +423,14 @@ static bool sht3x_send_command(sht3x_sensor_t* dev, uint16_t cmd)
       return false;
     }
 
-    uint8_t data[2] = { cmd >> 8, cmd & 0xff };
+    debug_dev ("send command %04x", __FUNCTION__, dev, cmd);
 
-    printf("send command MSB=%02x LSB=%02x\n", data[0], data[1]);
+    esp_err_t err = sensirion_i2c_write_cmd(&dev->i2c_dev, cmd, NULL, 0);
 
-    int err = i2c_slave_write(dev->bus, dev->addr, 0, data, 2);
-
-    if (err)
+    if (err != ESP_OK)
     {
-        dev->error_code |= (err == -EBUSY) ? SHT3x_I2C_BUSY : SHT3x_I2C_SEND_CMD_FAILED;
-        printf ("i2c error %d on write command %02x\n", err, cmd);
-        printf("err = %d\n", err);
-        printf("busy = %d\n", -EBUSY);
+        sht3x_set_i2c_error(dev, err, SHT3x_I2C_SEND_CMD_FAILED, NULL);
+        printf ("i2c error %d on write command %04x\n", err, cmd);
         return false;
     }
 
@@ -350,11 +440,12 @@ static bool sht3x_send_command(sht3x_sensor_t* dev, uint16_t cmd)
 static bool sht3x_read_data(sht3x_sensor_t* dev, uint8_t *data,  uint32_t len)
 {
     if (!dev) return false;
-    int err = i2c_slave_read(dev->bus, dev->addr, 0, data, len);
 
-    if (err)
+    esp_err_t err = sensirion_i2c_read_frames(&dev->i2c_dev, data, len / 3);
+
+    if (err != ESP_OK)
     {
-        dev->error_code |= (err == -EBUSY) ? SHT3x_I2C_BUSY : SHT3x_I2C_READ_FAILED;
+        sht3x_set_i2c_error(dev, err, SHT3x_I2C_READ_FAILED, data);
         error_dev ("error %d on read %d byte", __FUNCTION__, dev, err, len);
         return false;
     }
@@ -370,6 +461,26 @@ static bool sht3x_read_data(sht3x_sensor_t* dev, uint8_t *data,  uint32_t len)
     return true;
 }
 
+static bool sht3x_fetch_data(sht3x_sensor_t* dev, uint8_t *data,  uint32_t len)
+{
+    if (!dev) return false;
+
+    // the sensor NACKs the read header if there is no new result yet
+    esp_err_t err = sensirion_i2c_cmd_read_frames(&dev->i2c_dev, SHT3x_FETCH_DATA_CMD,
+                                                  data, len / 3);
+
+    if (err != ESP_OK)
+    {
+        sht3x_set_i2c_error(dev, err, SHT3x_I2C_READ_FAILED, data);
+        if (err != ESP_ERR_INVALID_CRC)
+            dev->error_code |= SHT3x_SEND_FETCH_CMD_FAILED;
+        error_dev ("error %d on fetch %d byte", __FUNCTION__, dev, err, len);
+        return false;
+    }
+
+    return true;
+}
+
 
 static bool sht3x_reset (sht3x_sensor_t* dev)
 {
@@ -422,27 +533,3 @@ static bool sht3x_get_status (sht3x_sensor_t* dev, uint16_t* status)
     debug_dev ("status=%02x", __FUNCTION__, dev, *status);
     return true;
 }
-
-
-const uint8_t g_polynom = 0x31;
-
-static uint8_t crc8 (uint8_t data[], int len)
-{
-    // initialization value
-    uint8_t crc = 0xff;
-
-    // iterate over all bytes
-    for (int i=0; i < len; i++)
-    {
-        crc ^= data[i];
-
-        for (int i = 0; i < 8; i++)
-        {
-            bool xor = crc & 0x80;
-            crc = crc << 1;
-            crc = xor ? crc ^ g_polynom : crc;
-        }
-    }
-
-    return crc;
-}
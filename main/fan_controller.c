@@ -15,7 +15,7 @@ static sgp40_t air_q_sensor;
 
 // Timer type definitions
 const TickType_t fan_TIMER_DELAY = (1000*60) / portTICK_PERIOD_MS;
-const TickType_t sensor_TIMER_DELAY = 1000 / portTICK_PERIOD_MS;
+const TickType_t sensor_SAMPLE_PERIOD = SENSOR_SAMPLE_PERIOD_MS / portTICK_PERIOD_MS;
 const TickType_t fan_CB_PERIOD = (1000*10) / portTICK_PERIOD_MS;
 const TickType_t mqtt_handler_DELAY = (1000*5) / portTICK_PERIOD_MS;
 
@@ -24,14 +24,63 @@ static uint8_t fanQueueStorage[FAN_EV_NUM*sizeof (struct fan_event)];
 static StaticQueue_t fanEvents;
 static QueueHandle_t fanEventsHandle;
 
-static uint8_t thresholdQueueStorage[10*sizeof (struct threshold_event)];
+// The fan runner task waits on its events and on the end of a fade at once.
+// Every fade gets the next number in fanFadeStarted, the fade end interrupt
+// sends it back so the task can tell a stale end from the current one.
+static uint8_t fanFadeEndsStorage[FAN_FADE_END_EV_NUM*sizeof (uint32_t)];
+static StaticQueue_t fanFadeEnds;
+static QueueHandle_t fanFadeEndsHandle;
+static uint32_t fanFadeStarted = 0;
+static QueueSetHandle_t fanRunnerSet;
+
+// Fan commands that were dropped because the fan queue was full
+static uint32_t fanCommandDrops = 0;
+
+// Read by the sensor manager and fan runner tasks every iteration, written
+// by POST /fan_config. The spinlock keeps the readers cheap, POST
+// /fan_config merges into and saves the config while also holding the
+// mutex, like vocTuning
+static struct fan_config fanConfig = FAN_CONFIG_DEFAULT;
+static portMUX_TYPE fanConfigLock = portMUX_INITIALIZER_UNLOCKED;
+static StaticSemaphore_t fanConfigUpdateLockBuffer;
+static SemaphoreHandle_t fanConfigUpdateLock;
+
+// Published by the fan runner task after every change, for GET /fans
+static struct fan_status fanStatus = {.winner = LOWEST_PRIORITY};
+static portMUX_TYPE fanStatusLock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t thresholdQueueStorage[SENSOR_EVENTS_NUM*sizeof (struct threshold_event)];
 static StaticQueue_t thresholdEvents;
 static QueueHandle_t thresholdEventsHandle;
 
-static uint8_t printerEventsQueueStorage[10*sizeof (struct printer_event)];
+static uint8_t printerEventsQueueStorage[SENSOR_EVENTS_NUM*sizeof (struct printer_event)];
 static StaticQueue_t printerEvents;
 static QueueHandle_t printerEventsHandle;
 
+static uint8_t vocTuningQueueStorage[VOC_TUNING_EVENTS_NUM*sizeof (struct voc_tuning)];
+static StaticQueue_t vocTuningEvents;
+static QueueHandle_t vocTuningEventsHandle;
+
+// The tuning last handed to the sensor manager task. POST /voc_tuning merges
+// into it and saves it while holding the lock, so partial updates arriving
+// close together cannot undo each other.
+static struct voc_tuning vocTuning;
+static StaticSemaphore_t vocTuningLockBuffer;
+static SemaphoreHandle_t vocTuningLock;
+
+static uint8_t fanCurvesQueueStorage[FAN_CURVES_EVENTS_NUM*sizeof (struct fan_curves)];
+static StaticQueue_t fanCurvesEvents;
+static QueueHandle_t fanCurvesEventsHandle;
+
+// The curves last handed to the sensor manager task, merged into and saved
+// by POST /fan_curves while holding the lock, like vocTuning
+static struct fan_curves fanCurves;
+static StaticSemaphore_t fanCurvesLockBuffer;
+static SemaphoreHandle_t fanCurvesLock;
+
+// Everything the sensor manager task waits on between samples
+static QueueSetHandle_t sensorEventsSet;
+
 static uint8_t mqttHandlerQueueStorage[10*sizeof (struct mqtt_handler_event)];
 static StaticQueue_t mqttHandlerEvents;
 static QueueHandle_t mqttHandlerEventsHandle;
@@ -47,29 +96,142 @@ static StackType_t sensorManagerTaskStack[TASK_STACK_SIZE];
 static StaticTask_t mqttEventHandlerTaskBuffer;
 static StackType_t mqttEventHandlerTaskStack[TASK_STACK_SIZE];
 
-SemaphoreHandle_t sensorSemaphore = NULL; // Used to control access to sensors
+// Latest sensor sample. The sensor manager task is the only writer and the
+// only task that talks to the sensors, everyone else copies the sample out of
+// here. Two copies are kept and the latch counter is bumped before each one is
+// rewritten, so readers always have a stable copy and never wait on the writer.
+static struct sensor_snapshot sensorSnapshots[2];
+static uint32_t sensorSnapshotLatch = 0;
+
+// VOC algorithm internals of every sample, only recorded while the stream is
+// enabled through POST /voc_diagnostics. vocDiagNext counts the records ever
+// written. The sensor manager task never waits for the lock, it drops the
+// record instead so a slow HTTP client cannot delay sampling.
+static struct voc_diag_record vocDiagRing[VOC_DIAG_RING_SIZE];
+static uint32_t vocDiagNext = 0;
+static uint32_t vocDiagDropped = 0;
+static bool vocDiagEnabled = false;
+static StaticSemaphore_t vocDiagLockBuffer;
+static SemaphoreHandle_t vocDiagLock;
+
+// Moves the fan to duty, 0..LEDC_DUTY, over fade_ms without waiting for it.
+// Returns whether a fade was started, fan_fade_end_cb sends its number,
+// fanFadeStarted, once it ends.
+static bool
+set_fan(int fan_num, uint32_t duty, uint32_t fade_ms) {
+    if (fade_ms < FAN_FADE_MIN_MS) {
+      // Set duty, 0..LEDC_DUTY
+      ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, fan_num, duty));
+      // Update duty to apply the new value
+      ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, fan_num));
+      return false;
+    }
+
+    // The fade engine steps the duty in hardware, no CPU time until the end
+    __atomic_add_fetch(&fanFadeStarted, 1, __ATOMIC_RELAXED);
+    ESP_ERROR_CHECK(ledc_set_fade_with_time(LEDC_MODE, fan_num, duty, fade_ms));
+    ESP_ERROR_CHECK(ledc_fade_start(LEDC_MODE, fan_num, LEDC_FADE_NO_WAIT));
+    return true;
+}
+
+// Runs in the LEDC interrupt, wakes the fan runner task so it can start the
+// next fade if the duty changed meanwhile. A new fade only starts once this
+// one has ended or is long overdue, so the number read here is the one of
+// the fade that ended, unless its interrupt came later than
+// FAN_FADE_MARGIN_MS.
+static bool IRAM_ATTR
+fan_fade_end_cb(const ledc_cb_param_t *param, void *user_arg) {
+  BaseType_t task_woken = pdFALSE;
+
+  if (param->event == LEDC_FADE_END_EVT) {
+    uint32_t fade = __atomic_load_n(&fanFadeStarted, __ATOMIC_RELAXED);
+
+    xQueueSendFromISR(fanFadeEndsHandle, &fade, &task_woken);
+  }
+
+  return task_woken == pdTRUE;
+}
+
+// How long a fade from one duty to another takes with the configured ramps
+static uint32_t
+fan_fade_ms(uint32_t from, uint32_t to, const struct fan_config *config) {
+  if (to > from) {
+    return config->ramp_up_ms * (to - from) / LEDC_DUTY;
+  }
+  return config->ramp_down_ms * (from - to) / LEDC_DUTY;
+}
 
 static void
-set_fan(int fan_num, int state) {
-    // Set duty to 100%
-    ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, fan_num, state == 1 ? LEDC_DUTY: 0));
-    // Update duty to apply the new value
-    ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, fan_num));
+publish_sensor_snapshot(struct sensor_snapshot *sample) {
+  sample->seq = (sensorSnapshotLatch / 2) + 1;
+
+  for (int i = 0; i < 2; i++) {
+    // Readers move over to the other copy before this one is touched
+    __atomic_add_fetch(&sensorSnapshotLatch, 1, __ATOMIC_SEQ_CST);
+    sensorSnapshots[i] = *sample;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
 }
 
 static void
-fan_on() {
-  set_fan(1, 1);
+read_sensor_snapshot(struct sensor_snapshot *snapshot) {
+  uint32_t latch;
+
+  // Only retries if a whole new sample got published while we were copying
+  do {
+    latch = __atomic_load_n(&sensorSnapshotLatch, __ATOMIC_ACQUIRE);
+    memcpy(snapshot, &sensorSnapshots[latch & 1], sizeof *snapshot);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&sensorSnapshotLatch, __ATOMIC_RELAXED) != latch);
 }
 
 static void
-fans_off() {
-  set_fan(1, 0);
+record_voc_diag(const struct sensor_snapshot *sample) {
+  if (!__atomic_load_n(&vocDiagEnabled, __ATOMIC_RELAXED) || !sample->voc_diag_valid) {
+    return;
+  }
+
+  if (xSemaphoreTake(vocDiagLock, 0) != pdTRUE) {
+    vocDiagDropped++;
+    return;
+  }
+
+  struct voc_diag_record *record = &vocDiagRing[vocDiagNext % VOC_DIAG_RING_SIZE];
+  record->seq = sample->seq;
+  record->sample_time_us = sample->sample_time_us;
+  record->raw_voc = sample->raw_voc;
+  record->voc_index = sample->voc_index;
+  record->diag = sample->voc_diag;
+  vocDiagNext++;
+
+  xSemaphoreGive(vocDiagLock);
+}
+
+// Copies out the oldest recorded sample newer than since, if there is one
+static bool
+read_voc_diag(uint32_t since, struct voc_diag_record *record) {
+  bool found = false;
+
+  if (vocDiagLock == NULL || xSemaphoreTake(vocDiagLock, portMAX_DELAY) != pdTRUE) {
+    return false;
+  }
+
+  uint32_t oldest = vocDiagNext > VOC_DIAG_RING_SIZE ? vocDiagNext - VOC_DIAG_RING_SIZE : 0;
+
+  for (uint32_t i = oldest; i < vocDiagNext; i++) {
+    if (vocDiagRing[i % VOC_DIAG_RING_SIZE].seq > since) {
+      *record = vocDiagRing[i % VOC_DIAG_RING_SIZE];
+      found = true;
+      break;
+    }
+  }
+
+  xSemaphoreGive(vocDiagLock);
+  return found;
 }
 
 static void
 initSGP40() {
-    i2cdev_init();
     sgp40_init_desc(&air_q_sensor, AC_I2C_BUS, AC_SDA, AC_SCL);
     sgp40_init(&air_q_sensor);
     ESP_LOGI(TAG, "SGP40 initilalized. Serial: 0x%04x%04x%04x",
@@ -145,7 +307,7 @@ mqtt_event_handler(void *handler_args,
               if (strncmp(gcode_state_val->valuestring, "RUNNING", gcode_str_len) &&
                   bed_temper > 83.0) {
                 printf("Starting air filter fans\n");
-                run_fans_forever(BED_TEMP_PRIORITY);
+                run_fans_forever(BED_TEMP_PRIORITY, LEDC_DUTY);
               }
 
               if (strncmp(gcode_state_val->valuestring, "FINISH", gcode_str_len)) {
@@ -234,244 +396,1594 @@ make_delay(int seconds) {
   return (1000*seconds) / portTICK_PERIOD_MS;
 }
 
-static void
-sensor_manager_task_function(void *params) {
-  int voc_max_threshold = VOC_MAX_THRESHOLD_DEFAULT;
-  int voc_min_threshold = voc_max_threshold > 10 ? voc_max_threshold - 10 : 0;
+/* Last VOC algorithm checkpoint. Unlike RTC_DATA_ATTR it is not cleared on
+ * a software reset, so it has to be checked before use.
+ */
+RTC_NOINIT_ATTR static struct voc_state vocStateRtc;
 
-  float bed_temper_min_threshold = 83.0;
-  float bed_temper_max_threshold = 83.0;
+static uint32_t
+voc_state_crc(const struct voc_state *state) {
+  return esp_rom_crc32_le(0, (const uint8_t *)state, offsetof(struct voc_state, crc));
+}
 
-  double bed_temper = 0.0f;
+static bool
+wall_clock_valid(time_t now) {
+  struct tm timeinfo;
+  localtime_r(&now, &timeinfo);
+  return timeinfo.tm_year >= (2016 - 1900);
+}
 
-  struct threshold_event thresholdMessage = {0};
-  struct printer_event printerEventMessage = {0};
-  while (1) {
-    if (fanEventsHandle != NULL) {
-      if (xQueueReceive(printerEventsHandle, &printerEventMessage, (TickType_t)sensor_TIMER_DELAY) == pdPASS) {
-        if (printerEventMessage.bed_temper > 0.0f) {
-          bed_temper = printerEventMessage.bed_temper;
-          printf("Got bed temper in sensor manager, bed_temper = %f\n", bed_temper);
-        }
-      }
+static bool
+voc_state_usable(const struct voc_state *state, time_t now) {
+  return state->magic == VOC_STATE_MAGIC &&
+         state->crc == voc_state_crc(state) &&
+         state->learned_s >= VOC_STATE_MIN_LEARNED_S &&
+         state->saved_at <= now &&
+         now - state->saved_at <= VOC_STATE_MAX_AGE_S;
+}
+
+// Restores the freshest usable checkpoint from RTC memory or NVS into the
+// VOC algorithm. Returns how long the restored state had been learning, or
+// 0 when the algorithm has to start learning from scratch.
+static uint32_t
+restore_voc_state(void) {
+  time_t now = time(NULL);
+
+  if (!wall_clock_valid(now)) {
+    printf("Wall clock not set, not restoring VOC state\n");
+    return 0;
+  }
+
+  struct voc_state nvs_state = {0};
+  size_t nvs_state_size = sizeof nvs_state;
+  nvs_handle_t nvs_handle;
+
+  if (nvs_open("storage", NVS_READONLY, &nvs_handle) == ESP_OK) {
+    if (nvs_get_blob(nvs_handle, VOC_STATE_NVS_KEY, &nvs_state, &nvs_state_size) != ESP_OK ||
+        nvs_state_size != sizeof nvs_state) {
+      memset(&nvs_state, 0, sizeof nvs_state);
     }
+    nvs_close(nvs_handle);
+  }
 
-    if (thresholdEventsHandle != NULL) {
-      if (xQueueReceive(thresholdEventsHandle, &thresholdMessage, (TickType_t)sensor_TIMER_DELAY) == pdPASS) {
-        if (thresholdMessage.voc_max_threshold > 0 && thresholdMessage.voc_max_threshold <= 500) {
-          voc_max_threshold = thresholdMessage.voc_max_threshold;
-        }
-        else {
-        #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Could not set voc_max_threshold to %d\n", thresholdMessage.voc_max_threshold);
-          printf("current voc_max_threshold = %d, current voc_min_threshold = %d\n", voc_max_threshold, voc_min_threshold);
-        #endif
-        }
-        if (thresholdMessage.voc_min_threshold > 0 && thresholdMessage.voc_min_threshold < voc_max_threshold) {
-          voc_min_threshold = thresholdMessage.voc_min_threshold;
-        }
-        else {
-        #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Could not set voc_min_threshold to %d\n", thresholdMessage.voc_min_threshold);
-          printf("current voc_max_threshold = %d, current voc_min_threshold = %d\n", voc_max_threshold, voc_min_threshold);
-        #endif
-        }
+  const struct voc_state *state = NULL;
 
-        if (thresholdMessage.bed_temper_min_threshold > 0.0f && thresholdMessage.bed_temper_min_threshold <= bed_temper_max_threshold) {
-          bed_temper_min_threshold = thresholdMessage.bed_temper_min_threshold;
-        }
-        else {
-        #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Could not set bed_temper_min_threshold to %f\n", thresholdMessage.bed_temper_min_threshold);
-          printf("current bed_temper_max_threshold = %f, current bed_temper_min_threshold = %f\n",
-                 bed_temper_max_threshold,
-                 bed_temper_min_threshold);
-        #endif
-        }
+  if (voc_state_usable(&vocStateRtc, now)) {
+    state = &vocStateRtc;
+  }
+  if (voc_state_usable(&nvs_state, now) && (state == NULL || nvs_state.saved_at > state->saved_at)) {
+    state = &nvs_state;
+  }
 
-        if (thresholdMessage.bed_temper_max_threshold > 0.0f && thresholdMessage.bed_temper_max_threshold >= bed_temper_min_threshold) {
-          bed_temper_max_threshold = thresholdMessage.bed_temper_max_threshold;
-        }
-        else {
-        #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Could not set bed_temper_max_threshold to %f\n", thresholdMessage.bed_temper_max_threshold);
-          printf("current bed_temper_max_threshold = %f, current bed_temper_min_threshold = %f\n",
-                 bed_temper_max_threshold,
-                 bed_temper_min_threshold);
-        #endif
-        }
+  if (state == NULL) {
+    printf("No fresh VOC state to restore, learning from scratch\n");
+    return 0;
+  }
 
-      }
+  VocAlgorithm_set_states(&air_q_sensor.voc, state->state0, state->state1);
+  printf("Restored VOC state from %s, %ld s old, learned for %lu s\n",
+         state == &vocStateRtc ? "RTC memory" : "NVS",
+         (long)(now - state->saved_at),
+         (unsigned long)state->learned_s);
+
+  return state->learned_s;
+}
+
+// Checkpoints the VOC algorithm state. RTC memory has no wear, so it is
+// written every VOC_STATE_RTC_INTERVAL_S, NVS only every
+// VOC_STATE_NVS_INTERVAL_S and only if the state changed.
+static void
+checkpoint_voc_state(uint32_t learned_s) {
+  static time_t last_rtc_save = 0;
+  static time_t last_nvs_save = 0;
+  static struct voc_state last_nvs_state = {0};
+
+  if (learned_s < VOC_STATE_MIN_LEARNED_S) {
+    return;
+  }
+
+  time_t now = time(NULL);
+
+  if (!wall_clock_valid(now) || now - last_rtc_save < VOC_STATE_RTC_INTERVAL_S) {
+    return;
+  }
+
+  struct voc_state state = {0};
+  state.magic = VOC_STATE_MAGIC;
+  VocAlgorithm_get_states(&air_q_sensor.voc, &state.state0, &state.state1);
+  state.learned_s = learned_s;
+  state.saved_at = now;
+  state.crc = voc_state_crc(&state);
+
+  vocStateRtc = state;
+  last_rtc_save = now;
+
+  if (now - last_nvs_save < VOC_STATE_NVS_INTERVAL_S ||
+      (state.state0 == last_nvs_state.state0 && state.state1 == last_nvs_state.state1)) {
+    return;
+  }
+
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
+
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_set_blob(nvs_handle, VOC_STATE_NVS_KEY, &state, sizeof state);
+    if (nvs_err == ESP_OK) {
+      nvs_err = nvs_commit(nvs_handle);
     }
+    nvs_close(nvs_handle);
+  }
 
-    vTaskDelay(make_delay(2));
-    if (sensorSemaphore != NULL) {
-      if (xSemaphoreTake(sensorSemaphore, (TickType_t)4) == pdTRUE) {
+  if (nvs_err != ESP_OK) {
+    printf("Could not save VOC state to NVS: %s\n", esp_err_to_name(nvs_err));
+  }
 
-        float temperature = 0.0;
-        float humidity = 0.0;
-        int32_t voc_index = 0;
-        uint16_t raw_voc = 0;
+  // Even on failure, so a broken NVS is not hammered every second
+  last_nvs_save = now;
+  last_nvs_state = state;
+}
 
-        if (sht3x_measure(sensor, &temperature, &humidity)) {
-        #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("temperature = %f\n", (double)temperature);
-          printf("humidity = %f\n", (double)humidity);
-        #endif
+static struct voc_tuning
+voc_tuning_defaults(void) {
+  struct voc_tuning tuning = {
+    .voc_index_offset = (int32_t)VocAlgorithm_VOC_INDEX_OFFSET_DEFAULT,
+    .learning_time_hours = (int32_t)VocAlgorithm_TAU_MEAN_VARIANCE_HOURS,
+    .gating_max_duration_minutes = (int32_t)VocAlgorithm_GATING_MAX_DURATION_MINUTES,
+    .std_initial = (int32_t)VocAlgorithm_SRAW_STD_INITIAL,
+  };
+  return tuning;
+}
 
-          esp_err_t sgp40_status = sgp40_measure_voc(&air_q_sensor,
-                                                     humidity,
-                                                     temperature,
-                                                     &voc_index);
+static bool
+voc_tuning_valid(const struct voc_tuning *tuning) {
+  return tuning->voc_index_offset >= VOC_INDEX_OFFSET_MIN &&
+         tuning->voc_index_offset <= VOC_INDEX_OFFSET_MAX &&
+         tuning->learning_time_hours >= VOC_LEARNING_TIME_HOURS_MIN &&
+         tuning->learning_time_hours <= VOC_LEARNING_TIME_HOURS_MAX &&
+         tuning->gating_max_duration_minutes >= VOC_GATING_MAX_DURATION_MINUTES_MIN &&
+         tuning->gating_max_duration_minutes <= VOC_GATING_MAX_DURATION_MINUTES_MAX &&
+         tuning->std_initial >= VOC_STD_INITIAL_MIN &&
+         tuning->std_initial <= VOC_STD_INITIAL_MAX;
+}
 
-          esp_err_t sgp40_status_raw = sgp40_measure_raw(&air_q_sensor,
-                                                         humidity,
-                                                         temperature,
-                                                         &raw_voc);
+// The tuning saved by POST /voc_tuning, or the Sensirion defaults
+static struct voc_tuning
+load_voc_tuning(void) {
+  struct voc_tuning tuning = {0};
+  size_t tuning_size = sizeof tuning;
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READONLY, &nvs_handle);
 
-          if (sgp40_status == ESP_OK) {
-          #ifdef CONFIG_DEBUG_MODE_ENABLED
-            printf("voc_index = %ld\n", voc_index);
-          #endif
-            if (voc_index > voc_max_threshold) { // TODO, make threshold configurable, test with ABS, etc
-              run_fans_forever(SENSOR_PRIORITY);
-            }
-            if (voc_index <= voc_min_threshold) {
-              stop_running_fans(SENSOR_PRIORITY);
-            }
-          }
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_get_blob(nvs_handle, VOC_TUNING_NVS_KEY, &tuning, &tuning_size);
+    nvs_close(nvs_handle);
+  }
 
-          #ifdef CONFIG_DEBUG_MODE_ENABLED
-          if (sgp40_status_raw == ESP_OK) {
-            printf("raw_voc = %d\n", raw_voc);
-          }
-          #endif
-          if (bed_temper > bed_temper_max_threshold) {
-            run_fans_forever(BED_TEMP_PRIORITY);
-          }
+  if (nvs_err != ESP_OK || tuning_size != sizeof tuning || !voc_tuning_valid(&tuning)) {
+    return voc_tuning_defaults();
+  }
 
-          if (bed_temper < bed_temper_min_threshold) {
-            stop_running_fans(BED_TEMP_PRIORITY);
-          }
+  return tuning;
+}
 
-        }
+static esp_err_t
+save_voc_tuning(const struct voc_tuning *tuning) {
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
 
-        xSemaphoreGive(sensorSemaphore);
-      }
-      else {
-        printf("failed to acquire sensor semaphore in manager task\n");
-      }
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_set_blob(nvs_handle, VOC_TUNING_NVS_KEY, tuning, sizeof *tuning);
+    if (nvs_err == ESP_OK) {
+      nvs_err = nvs_commit(nvs_handle);
     }
+    nvs_close(nvs_handle);
   }
+
+  return nvs_err;
 }
 
+// Only called by the sensor manager task, which owns the VOC algorithm. The
+// learned state is kept, the new time constants apply from the next sample.
 static void
-fan_runner_task_function(void *params) {
-  struct fan_event fanMessage;
-  int current_priority = LOWEST_PRIORITY;
+apply_voc_tuning(const struct voc_tuning *tuning) {
+  VocAlgorithm_update_tuning_parameters(&air_q_sensor.voc,
+                                        tuning->voc_index_offset,
+                                        tuning->learning_time_hours,
+                                        tuning->gating_max_duration_minutes,
+                                        tuning->std_initial);
+  printf("VOC tuning: index offset %ld, learning time %ld h, gating max %ld min, std initial %ld\n",
+         (long)tuning->voc_index_offset,
+         (long)tuning->learning_time_hours,
+         (long)tuning->gating_max_duration_minutes,
+         (long)tuning->std_initial);
+}
 
-  printf("Task started\n");
+// What the sensor manager task runs with, or is about to
+static struct voc_tuning
+current_voc_tuning(void) {
+  xSemaphoreTake(vocTuningLock, portMAX_DELAY);
+  struct voc_tuning tuning = vocTuning;
+  xSemaphoreGive(vocTuningLock);
 
-  configASSERT( ( uint32_t ) params == 1UL );
+  return tuning;
+}
 
-  while (1) {
-    if (fanEventsHandle != NULL) {
-      // The queue exists and is created
-      if (xQueueReceive(fanEventsHandle, &fanMessage, (TickType_t)fan_TIMER_DELAY) == pdPASS) {
-        if (fanMessage.fan == FAN_ON && fanMessage.priority <= current_priority) {
-          current_priority = fanMessage.priority;
-          fan_on();
-
-          // If it should run on a delay, then delay and turn them off
-          if (fanMessage.run_forever != 1) {
-            vTaskDelay(fanMessage.fan_delay);
-            current_priority = LOWEST_PRIORITY;
-            fans_off();
-          }
-        }
+static void
+apply_threshold_event(struct threshold_event *thresholds,
+                      const struct threshold_event *thresholdMessage) {
+  if (thresholdMessage->voc_max_threshold > 0 && thresholdMessage->voc_max_threshold <= 500) {
+    thresholds->voc_max_threshold = thresholdMessage->voc_max_threshold;
+  }
+  else {
+  #ifdef CONFIG_DEBUG_MODE_ENABLED
+    printf("Could not set voc_max_threshold to %d\n", thresholdMessage->voc_max_threshold);
+    printf("current voc_max_threshold = %d, current voc_min_threshold = %d\n",
+           thresholds->voc_max_threshold,
+           thresholds->voc_min_threshold);
+  #endif
+  }
+  if (thresholdMessage->voc_min_threshold > 0 && thresholdMessage->voc_min_threshold < thresholds->voc_max_threshold) {
+    thresholds->voc_min_threshold = thresholdMessage->voc_min_threshold;
+  }
+  else {
+  #ifdef CONFIG_DEBUG_MODE_ENABLED
+    printf("Could not set voc_min_threshold to %d\n", thresholdMessage->voc_min_threshold);
+    printf("current voc_max_threshold = %d, current voc_min_threshold = %d\n",
+           thresholds->voc_max_threshold,
+           thresholds->voc_min_threshold);
+  #endif
+  }
 
-        if (fanMessage.fan == FAN_OFF && fanMessage.priority <= current_priority) {
-          fans_off();
-          current_priority = LOWEST_PRIORITY;
-        }
-      }
-    }
+  if (thresholdMessage->bed_temper_min_threshold > 0.0f && thresholdMessage->bed_temper_min_threshold <= thresholds->bed_temper_max_threshold) {
+    thresholds->bed_temper_min_threshold = thresholdMessage->bed_temper_min_threshold;
+  }
+  else {
+  #ifdef CONFIG_DEBUG_MODE_ENABLED
+    printf("Could not set bed_temper_min_threshold to %f\n", thresholdMessage->bed_temper_min_threshold);
+    printf("current bed_temper_max_threshold = %f, current bed_temper_min_threshold = %f\n",
+           thresholds->bed_temper_max_threshold,
+           thresholds->bed_temper_min_threshold);
+  #endif
+  }
+
+  if (thresholdMessage->bed_temper_max_threshold > 0.0f && thresholdMessage->bed_temper_max_threshold >= thresholds->bed_temper_min_threshold) {
+    thresholds->bed_temper_max_threshold = thresholdMessage->bed_temper_max_threshold;
+  }
+  else {
+  #ifdef CONFIG_DEBUG_MODE_ENABLED
+    printf("Could not set bed_temper_max_threshold to %f\n", thresholdMessage->bed_temper_max_threshold);
+    printf("current bed_temper_max_threshold = %f, current bed_temper_min_threshold = %f\n",
+           thresholds->bed_temper_max_threshold,
+           thresholds->bed_temper_min_threshold);
+  #endif
   }
 }
 
 static void
-createSensorManagerTask(void) {
-  xTaskCreateStatic(sensor_manager_task_function,
-                    "sensorman_task",
-                     TASK_STACK_SIZE,
-                     (void*)1,
-                     tskIDLE_PRIORITY + 2,
-                     sensorManagerTaskStack,
-                     &sensorManagerTaskBuffer);
+read_fan_config(struct fan_config *config) {
+  taskENTER_CRITICAL(&fanConfigLock);
+  *config = fanConfig;
+  taskEXIT_CRITICAL(&fanConfigLock);
 }
 
 static void
-createfanRunnerTask(void) {
-  xTaskCreateStatic(fan_runner_task_function,
-                    "fan_task",
-                     TASK_STACK_SIZE,
-                     (void*)1,
-                     tskIDLE_PRIORITY + 2,
-                     fanRunnerTaskStack,
-                     &fanRunnerTaskBuffer);
+write_fan_config(const struct fan_config *config) {
+  taskENTER_CRITICAL(&fanConfigLock);
+  fanConfig = *config;
+  taskEXIT_CRITICAL(&fanConfigLock);
+}
+
+static bool
+fan_gain_valid(float gain) {
+  return isfinite(gain) && gain >= 0.0f && gain <= FAN_GAIN_MAX;
+}
+
+static bool
+fan_config_valid(const struct fan_config *config) {
+  return fan_gain_valid(config->voc_kp) && fan_gain_valid(config->voc_ki) &&
+         fan_gain_valid(config->bed_temp_kp) && fan_gain_valid(config->bed_temp_ki) &&
+         config->min_duty <= LEDC_DUTY &&
+         config->kick_duty <= LEDC_DUTY &&
+         config->kick_duty >= config->min_duty &&
+         config->kick_ms <= FAN_KICK_MS_MAX &&
+         config->ramp_up_ms <= FAN_RAMP_MS_MAX &&
+         config->ramp_down_ms <= FAN_RAMP_MS_MAX;
+}
+
+// The config saved by POST /fan_config, or FAN_CONFIG_DEFAULT
+static struct fan_config
+load_fan_config(void) {
+  struct fan_config config = {0};
+  size_t config_size = sizeof config;
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READONLY, &nvs_handle);
+
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_get_blob(nvs_handle, FAN_CONFIG_NVS_KEY, &config, &config_size);
+    nvs_close(nvs_handle);
+  }
+
+  if (nvs_err != ESP_OK || config_size != sizeof config || !fan_config_valid(&config)) {
+    return (struct fan_config)FAN_CONFIG_DEFAULT;
+  }
+
+  return config;
+}
+
+static esp_err_t
+save_fan_config(const struct fan_config *config) {
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
+
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_set_blob(nvs_handle, FAN_CONFIG_NVS_KEY, config, sizeof *config);
+    if (nvs_err == ESP_OK) {
+      nvs_err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+  }
+
+  return nvs_err;
+}
+
+static bool
+fan_curve_valid(const struct fan_curve *curve) {
+  if (curve->points > FAN_CURVE_POINTS_MAX) {
+    return false;
+  }
+
+  for (int i = 0; i < curve->points; i++) {
+    const struct fan_curve_point *point = &curve->point[i];
+
+    if (point->x < FAN_CURVE_X_MIN || point->x > FAN_CURVE_X_MAX || point->duty > LEDC_DUTY) {
+      return false;
+    }
+    if (i > 0 && point->x <= curve->point[i - 1].x) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool
+fan_curves_valid(const struct fan_curves *curves) {
+  return fan_curve_valid(&curves->voc) && fan_curve_valid(&curves->bed_temp);
+}
+
+// Integer interpolation, rounded to the nearest duty step
+static uint32_t
+fan_curve_duty(const struct fan_curve *curve, int32_t x) {
+  const struct fan_curve_point *point = curve->point;
+
+  if (curve->points == 0) {
+    return 0;
+  }
+  if (x <= point[0].x) {
+    return point[0].duty;
+  }
+
+  for (int i = 1; i < curve->points; i++) {
+    if (x <= point[i].x) {
+      int32_t dx = point[i].x - point[i - 1].x;
+      int32_t rise = ((int32_t)point[i].duty - point[i - 1].duty) * (x - point[i - 1].x);
+
+      return point[i - 1].duty + (rise + (rise < 0 ? -dx : dx) / 2) / dx;
+    }
+  }
+
+  return point[curve->points - 1].duty;
+}
+
+// The curves saved by POST /fan_curves, or none
+static struct fan_curves
+load_fan_curves(void) {
+  struct fan_curves curves = {0};
+  size_t curves_size = sizeof curves;
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READONLY, &nvs_handle);
+
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_get_blob(nvs_handle, FAN_CURVES_NVS_KEY, &curves, &curves_size);
+    nvs_close(nvs_handle);
+  }
+
+  if (nvs_err != ESP_OK || curves_size != sizeof curves || !fan_curves_valid(&curves)) {
+    return (struct fan_curves){0};
+  }
+
+  return curves;
+}
+
+static esp_err_t
+save_fan_curves(const struct fan_curves *curves) {
+  nvs_handle_t nvs_handle;
+  esp_err_t nvs_err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
+
+  if (nvs_err == ESP_OK) {
+    nvs_err = nvs_set_blob(nvs_handle, FAN_CURVES_NVS_KEY, curves, sizeof *curves);
+    if (nvs_err == ESP_OK) {
+      nvs_err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+  }
+
+  return nvs_err;
+}
+
+// What the sensor manager task runs with, or is about to
+static struct fan_curves
+current_fan_curves(void) {
+  xSemaphoreTake(fanCurvesLock, portMAX_DELAY);
+  struct fan_curves curves = fanCurves;
+  xSemaphoreGive(fanCurvesLock);
+
+  return curves;
 }
 
+// Sends a fan command for demand only when the duty changes past the
+// deadband, or to refresh it while on. If the fan queue is full nothing is
+// recorded, so the next sample tries again.
 static void
-createMqttHandlerTask(void) {
-  xTaskCreateStatic(mqtt_event_handler_function,
-                    "mqttevhandler_task",
-                     TASK_STACK_SIZE,
-                     (void*)1,
-                     tskIDLE_PRIORITY + 1,
-                     mqttEventHandlerTaskStack,
-                     &mqttEventHandlerTaskBuffer);
+update_fan_demand(struct fan_demand *demand, uint32_t duty) {
+  TickType_t now = xTaskGetTickCount();
+  uint32_t step = duty > demand->duty ? duty - demand->duty : demand->duty - duty;
+  bool changed = step >= FAN_DEMAND_DEADBAND ||
+                 (step > 0 && (duty == 0 || duty == LEDC_DUTY || demand->duty == 0));
+
+  if (!changed && (duty == 0 || now - demand->sent_at < make_delay(FAN_DEMAND_REFRESH_S))) {
+    return;
+  }
+
+  bool sent = duty > 0 ? run_fans_forever(demand->priority, duty) : stop_running_fans(demand->priority);
+
+  if (sent) {
+    demand->duty = duty;
+    demand->sent_at = now;
+  }
+}
+
+// One step of a PI controller on error, the distance above the min
+// threshold, dt seconds after the last one. saturated forces full duty, for
+// readings above the max threshold. The integral only grows while the output is not already at
+// full duty (anti-windup) and never goes below zero, so the fans stop soon
+// after the reading is back under the min threshold.
+static uint32_t
+pi_controller_update(struct pi_controller *pi,
+                     float kp,
+                     float ki,
+                     float error,
+                     bool saturated,
+                     float dt,
+                     const struct fan_config *config) {
+  float proportional = kp * error;
+  float output = proportional + pi->integral;
+
+  if (saturated) {
+    output = LEDC_DUTY;
+  }
+  else if (!(output >= LEDC_DUTY && error > 0.0f)) {
+    pi->integral += ki * error * dt;
+  }
+
+  if (pi->integral < 0.0f) {
+    pi->integral = 0.0f;
+  }
+  if (pi->integral > LEDC_DUTY) {
+    pi->integral = LEDC_DUTY;
+  }
+
+  if (!saturated) {
+    output = proportional + pi->integral;
+  }
+
+  // Start at min_duty, stop below half of it
+  if (output >= config->min_duty) {
+    pi->running = true;
+  }
+  else if (output < config->min_duty / 2) {
+    pi->running = false;
+  }
+
+  if (!pi->running) {
+    return 0;
+  }
+  if (output < config->min_duty) {
+    return config->min_duty;
+  }
+  if (output > LEDC_DUTY) {
+    return LEDC_DUTY;
+  }
+  return (uint32_t)(output + 0.5f);
+}
+
+// Duty one source asks for given its reading and thresholds, through its PI
+// controller or, with pi_enabled off, switched at the thresholds
+static uint32_t
+source_duty(struct pi_controller *pi,
+            float kp,
+            float ki,
+            double value,
+            double min_threshold,
+            double max_threshold,
+            float dt,
+            const struct fan_config *config) {
+  if (config->pi_enabled) {
+    return pi_controller_update(pi, kp, ki, (float)(value - min_threshold), value > max_threshold, dt, config);
+  }
+
+  // Between the thresholds the demand stays as it is
+  pi->integral = 0.0f;
+  if (value > max_threshold) {
+    pi->running = true;
+  }
+  else if (value <= min_threshold) {
+    pi->running = false;
+  }
+  return pi->running ? LEDC_DUTY : 0;
 }
 
-static void
-run_fans(int delay, int priority) {
-  struct fan_event message;
-  message.fan = FAN_ON;
-  message.priority = priority;
-  message.fan_delay = make_delay(delay);
-  message.run_forever = 0;
+static void
+update_sampler_stats(struct sampler_stats *stats, int64_t period_us) {
+  int32_t period = (int32_t)period_us;
+  int32_t jitter = period - (SENSOR_SAMPLE_PERIOD_MS * 1000);
+
+  if (jitter < 0) {
+    jitter = -jitter;
+  }
+
+  stats->last_period_us = period;
+
+  if (stats->samples == 0 || period < stats->min_period_us) {
+    stats->min_period_us = period;
+  }
+  if (stats->samples == 0 || period > stats->max_period_us) {
+    stats->max_period_us = period;
+  }
+  if (jitter > stats->max_jitter_us) {
+    stats->max_jitter_us = jitter;
+  }
+
+  // Running mean, good enough without keeping a 64 bit sum around
+  stats->samples++;
+  stats->mean_jitter_us += (jitter - stats->mean_jitter_us) / (int32_t)stats->samples;
+}
+
+static void
+sensor_manager_task_function(void *params) {
+  struct threshold_event thresholds = {0};
+  thresholds.voc_max_threshold = VOC_MAX_THRESHOLD_DEFAULT;
+  thresholds.voc_min_threshold = thresholds.voc_max_threshold > 10 ? thresholds.voc_max_threshold - 10 : 0;
+  thresholds.bed_temper_min_threshold = BED_TEMPER_MAX_THRESHOLD_DEFAULT;
+  thresholds.bed_temper_max_threshold = BED_TEMPER_MAX_THRESHOLD_DEFAULT;
+
+  double bed_temper = 0.0f;
+
+  struct threshold_event thresholdMessage = {0};
+  struct printer_event printerEventMessage = {0};
+  struct sampler_stats sampler = {0};
+
+  // SHT3x ticks are on the same scale as the SGP40 compensation words, so
+  // they go straight from one sensor to the other without any float math.
+  // The SGP40 runs uncompensated until the first SHT3x result.
+  uint16_t compensation_temperature = SGP40_TEMPERATURE_TICKS_DEFAULT;
+  uint16_t compensation_humidity = SGP40_HUMIDITY_TICKS_DEFAULT;
+
+  struct voc_tuning voc_tuning = current_voc_tuning();
+  struct voc_tuning vocTuningMessage = {0};
+  apply_voc_tuning(&voc_tuning);
+
+  // Warm start the VOC algorithm if the last run left a fresh enough state
+  uint32_t voc_learned_base = restore_voc_state();
+
+  struct fan_demand voc_demand = {.priority = SENSOR_PRIORITY};
+  struct fan_demand bed_temp_demand = {.priority = BED_TEMP_PRIORITY};
+  struct pi_controller voc_pi = {0};
+  struct pi_controller bed_temp_pi = {0};
+  struct fan_config fan_config;
+
+  // Only ever replaced as a whole, by a message from POST /fan_curves
+  struct fan_curves fan_curves = current_fan_curves();
+  struct fan_curves fanCurvesMessage;
+
+  // Last health of the VOC sensor, to act once when it fails
+  sensirion_i2c_health_t voc_health = SENSIRION_I2C_HEALTHY;
+
+  int64_t last_sample_us = 0;
+  TickType_t next_sample = xTaskGetTickCount();
+
+  while (1) {
+    // Sample on an absolute deadline so that the VOC algorithm sees a fixed
+    // cadence no matter how many events arrive in between
+    TickType_t now = xTaskGetTickCount();
+
+    if ((int32_t)(next_sample - now) > 0) {
+      QueueSetMemberHandle_t ready = xQueueSelectFromSet(sensorEventsSet, next_sample - now);
+
+      if (ready == printerEventsHandle) {
+        if (xQueueReceive(printerEventsHandle, &printerEventMessage, (TickType_t)0) == pdPASS) {
+          if (printerEventMessage.bed_temper > 0.0f) {
+            bed_temper = printerEventMessage.bed_temper;
+            printf("Got bed temper in sensor manager, bed_temper = %f\n", bed_temper);
+          }
+        }
+      }
+      else if (ready == thresholdEventsHandle) {
+        if (xQueueReceive(thresholdEventsHandle, &thresholdMessage, (TickType_t)0) == pdPASS) {
+          apply_threshold_event(&thresholds, &thresholdMessage);
+        }
+      }
+      else if (ready == vocTuningEventsHandle) {
+        if (xQueueReceive(vocTuningEventsHandle, &vocTuningMessage, (TickType_t)0) == pdPASS &&
+            voc_tuning_valid(&vocTuningMessage)) {
+          voc_tuning = vocTuningMessage;
+          apply_voc_tuning(&voc_tuning);
+        }
+      }
+      else if (ready == fanCurvesEventsHandle) {
+        if (xQueueReceive(fanCurvesEventsHandle, &fanCurvesMessage, (TickType_t)0) == pdPASS &&
+            fan_curves_valid(&fanCurvesMessage)) {
+          fan_curves = fanCurvesMessage;
+          // Start the controllers over if they take back from the curves
+          voc_pi = (struct pi_controller){0};
+          bed_temp_pi = (struct pi_controller){0};
+        }
+      }
+      continue;
+    }
+
+    next_sample += sensor_SAMPLE_PERIOD;
+
+    // If a whole period was missed, start over from now instead of firing a
+    // burst of catch up samples at the VOC algorithm
+    if ((int32_t)(xTaskGetTickCount() - next_sample) >= 0) {
+      sampler.overruns++;
+      next_sample = xTaskGetTickCount() + sensor_SAMPLE_PERIOD;
+    }
+
+    struct sensor_snapshot sample = {0};
+    uint16_t temperature = 0;
+    uint16_t humidity = 0;
+    int32_t voc_index = 0;
+    uint16_t raw_voc = 0;
+
+    sample.sample_time_us = esp_timer_get_time();
+
+    // The PI controllers integrate over the time since the last sample, but
+    // no more than a few periods of it after a stall
+    float sample_dt = SENSOR_SAMPLE_PERIOD_MS / 1000.0f;
+
+    if (last_sample_us != 0) {
+      int64_t period_us = sample.sample_time_us - last_sample_us;
+
+      update_sampler_stats(&sampler, period_us);
+      sample_dt = MIN(period_us, SENSOR_DT_MAX_PERIODS * SENSOR_SAMPLE_PERIOD_MS * 1000LL) / 1e6f;
+    }
+    last_sample_us = sample.sample_time_us;
+
+    // The two sensors sit on separate buses, so the SHT3x fetch can run
+    // while the SGP40 hotplate is measuring
+    int64_t stage_start = sample.sample_time_us;
+    bool climate_ok = false;
+
+  #if SENSOR_COMPENSATION == SENSOR_COMPENSATION_FRESH
+    climate_ok = sht3x_get_ticks(sensor, &temperature, &humidity);
+    if (climate_ok) {
+      compensation_temperature = temperature;
+      compensation_humidity = humidity;
+    }
+    sample.timings.sht3x_fetch_us = (int32_t)(esp_timer_get_time() - stage_start);
+    stage_start = esp_timer_get_time();
+  #endif
+
+    // This task is the only one allowed to step the VOC algorithm, everyone
+    // else gets the index from the published snapshot
+    esp_err_t sgp40_status = sgp40_start_measure_ticks(&air_q_sensor,
+                                                       compensation_humidity,
+                                                       compensation_temperature);
+    sample.timings.sgp40_start_us = (int32_t)(esp_timer_get_time() - stage_start);
+    stage_start = esp_timer_get_time();
+
+  #if SENSOR_COMPENSATION == SENSOR_COMPENSATION_PREVIOUS
+    // Periodic mode, so this is a single fetch of the latest result. The
+    // SGP40 start above was only queued, so its command goes out on the
+    // other bus at the same time
+    climate_ok = sht3x_get_ticks(sensor, &temperature, &humidity);
+    if (climate_ok) {
+      compensation_temperature = temperature;
+      compensation_humidity = humidity;
+    }
+    sample.timings.sht3x_fetch_us = (int32_t)(esp_timer_get_time() - stage_start);
+    stage_start = esp_timer_get_time();
+  #endif
+
+    if (sgp40_status == ESP_OK) {
+      sgp40_status = sgp40_read_measure(&air_q_sensor, &raw_voc, &voc_index);
+    }
+    sample.timings.sgp40_read_us = (int32_t)(esp_timer_get_time() - stage_start);
+    sample.timings.total_us = (int32_t)(esp_timer_get_time() - sample.sample_time_us);
+
+    // Every transfer above has a deadline of its datasheet time plus a small
+    // margin, so a sensor that hangs only costs this sample, and the
+    // transport recovers the bus and resets the sensor on its own
+    sample.sht3x_health = sensor != NULL ? sensirion_i2c_get_health(&sensor->i2c_dev) : SENSIRION_I2C_FAILED;
+    sample.sgp40_health = sensirion_i2c_get_health(&air_q_sensor.i2c_dev);
+
+    // Rather uncompensated than compensated with values that are long gone
+    if (sample.sht3x_health == SENSIRION_I2C_FAILED) {
+      compensation_temperature = SGP40_TEMPERATURE_TICKS_DEFAULT;
+      compensation_humidity = SGP40_HUMIDITY_TICKS_DEFAULT;
+    }
+
+    read_fan_config(&fan_config);
+
+    // A dead VOC sensor must not keep the fans running forever, leave it to
+    // the other sources until it is back
+    if (sample.sgp40_health == SENSIRION_I2C_FAILED && voc_health != SENSIRION_I2C_FAILED) {
+      printf("VOC sensor failed, releasing the fans\n");
+    }
+    if (sample.sgp40_health == SENSIRION_I2C_FAILED) {
+      voc_pi = (struct pi_controller){0};
+      update_fan_demand(&voc_demand, 0);
+    }
+    voc_health = sample.sgp40_health;
+
+    if (climate_ok) {
+    #ifdef CONFIG_DEBUG_MODE_ENABLED
+      printf("temperature = %f\n", (double)sht3x_ticks_to_celsius(temperature));
+      printf("humidity = %f\n", (double)sht3x_ticks_to_percent(humidity));
+    #endif
+      sample.temperature_ticks = temperature;
+      sample.humidity_ticks = humidity;
+      sample.climate_valid = true;
+    }
+
+    if (sgp40_status == ESP_OK) {
+    #ifdef CONFIG_DEBUG_MODE_ENABLED
+      printf("voc_index = %ld\n", voc_index);
+      printf("raw_voc = %d\n", raw_voc);
+    #endif
+      sample.voc_index = voc_index;
+      sample.raw_voc = raw_voc;
+      sample.voc_valid = true;
+      sample.raw_voc_valid = true;
+      sample.voc_diag_valid = sgp40_get_voc_diagnostics(&air_q_sensor, &sample.voc_diag) == ESP_OK;
+
+      // One processed sample per second of learning
+      checkpoint_voc_state(voc_learned_base + air_q_sensor.voc_samples);
+
+      update_fan_demand(&voc_demand,
+                        fan_curves.enabled ?
+                        fan_curve_duty(&fan_curves.voc, voc_index) :
+                        source_duty(&voc_pi,
+                                    fan_config.voc_kp,
+                                    fan_config.voc_ki,
+                                    voc_index,
+                                    thresholds.voc_min_threshold,
+                                    thresholds.voc_max_threshold,
+                                    sample_dt,
+                                    &fan_config));
+    }
+
+    // The fan runner combines the two by taking the higher duty
+    update_fan_demand(&bed_temp_demand,
+                      fan_curves.enabled ?
+                      fan_curve_duty(&fan_curves.bed_temp, (int32_t)(bed_temper + 0.5)) :
+                      source_duty(&bed_temp_pi,
+                                  fan_config.bed_temp_kp,
+                                  fan_config.bed_temp_ki,
+                                  bed_temper,
+                                  thresholds.bed_temper_min_threshold,
+                                  thresholds.bed_temper_max_threshold,
+                                  sample_dt,
+                                  &fan_config));
+
+    sample.sampler = sampler;
+    if (sensor != NULL) {
+      sample.sht3x_i2c = sensor->i2c_dev.stats;
+    }
+    sample.sgp40_i2c = air_q_sensor.i2c_dev.stats;
+    publish_sensor_snapshot(&sample);
+    record_voc_diag(&sample);
+  }
+}
+
+// Records what a fan event asks for in the demand table
+static void
+apply_fan_event(struct fan_source_demand *sources, const struct fan_event *message) {
+  if (message->priority < MANUAL_PRIORITY || message->priority >= LOWEST_PRIORITY) {
+    printf("Fan event from unknown source %d\n", message->priority);
+    return;
+  }
+
+  struct fan_source_demand *demand = &sources[message->priority];
+
+  if (message->fan == FAN_OFF) {
+    demand->active = false;
+    return;
+  }
+
+  if (message->run_forever == 1) {
+    demand->timed = false;
+  }
+  else {
+    // A timed run of a source that is already timed never gets shorter
+    TickType_t until = xTaskGetTickCount() + message->fan_delay;
+
+    if (!(demand->active && demand->timed) || (int32_t)(until - demand->until) > 0) {
+      demand->until = until;
+    }
+    // Does not cut short a run forever of the same source
+    demand->timed = !(demand->active && !demand->timed);
+  }
+
+  demand->active = true;
+  demand->duty = message->duty;
+}
+
+// Drops the expired demands and returns the ticks until the next one
+// expires, or fan_TIMER_DELAY if none is timed
+static TickType_t
+expire_fan_demands(struct fan_source_demand *sources) {
+  TickType_t now = xTaskGetTickCount();
+  TickType_t timeout = fan_TIMER_DELAY;
+
+  for (int priority = MANUAL_PRIORITY; priority < LOWEST_PRIORITY; priority++) {
+    struct fan_source_demand *demand = &sources[priority];
+
+    if (!demand->active || !demand->timed) {
+      continue;
+    }
+    if ((int32_t)(demand->until - now) <= 0) {
+      demand->active = false;
+    }
+    else if (demand->until - now < timeout) {
+      timeout = demand->until - now;
+    }
+  }
+
+  return timeout;
+}
+
+// A manual demand wins outright, otherwise the highest duty wins and ties go
+// to the higher priority source
+static int
+arbitrate_fan_demands(const struct fan_source_demand *sources) {
+  int winner = LOWEST_PRIORITY;
+
+  if (sources[MANUAL_PRIORITY].active) {
+    return MANUAL_PRIORITY;
+  }
+
+  for (int priority = MANUAL_PRIORITY + 1; priority < LOWEST_PRIORITY; priority++) {
+    if (sources[priority].active &&
+        (winner == LOWEST_PRIORITY || sources[priority].duty > sources[winner].duty)) {
+      winner = priority;
+    }
+  }
+
+  return winner;
+}
+
+// Ticks until deadline, at most timeout
+static TickType_t
+ticks_until(TickType_t deadline, TickType_t timeout) {
+  TickType_t left = deadline - xTaskGetTickCount();
+
+  if ((int32_t)left <= 0) {
+    return 0;
+  }
+  return left < timeout ? left : timeout;
+}
+
+// Owns the fans. Every source has its own entry in the demand table, and the
+// fan duty is recomputed from the whole table whenever an event arrives or a
+// timed demand expires. The queue is never left unserviced for longer than
+// it takes until the next expiry, the end of a start kick or of a fade, so
+// every event is handled within a tick.
+//
+// Duty changes are faded by the LEDC hardware. While a fade runs the task
+// keeps serving events, a change of duty in the meantime is faded to once
+// the fade end interrupt arrives.
+static void
+fan_runner_task_function(void *params) {
+  struct fan_event fanMessage;
+  struct fan_source_demand sources[LOWEST_PRIORITY] = {0};
+  struct fan_config config;
+  uint32_t current_duty = 0;
+  bool kicking = false;
+  bool kick_armed = false;
+  TickType_t kick_until = 0;
+  // What the fan channel is at, or fading to
+  uint32_t fan_duty = 0;
+  bool fading = false;
+  TickType_t fade_until = 0;
+
+  printf("Task started\n");
+
+  configASSERT( ( uint32_t ) params == 1UL );
+
+  while (1) {
+    if (fanRunnerSet != NULL) {
+      TickType_t timeout = expire_fan_demands(sources);
+
+      if (kicking && kick_armed) {
+        timeout = ticks_until(kick_until, timeout);
+      }
+      if (fading) {
+        timeout = ticks_until(fade_until, timeout);
+      }
+
+      QueueSetMemberHandle_t ready = xQueueSelectFromSet(fanRunnerSet, timeout);
+
+      if (ready == fanEventsHandle) {
+        if (xQueueReceive(fanEventsHandle, &fanMessage, (TickType_t)0) == pdPASS) {
+          apply_fan_event(sources, &fanMessage);
+        }
+      }
+      else if (ready == fanFadeEndsHandle) {
+        uint32_t fade;
+
+        // The end of an earlier fade that was already given up on is stale
+        if (xQueueReceive(fanFadeEndsHandle, &fade, (TickType_t)0) == pdPASS &&
+            fade == __atomic_load_n(&fanFadeStarted, __ATOMIC_RELAXED)) {
+          fading = false;
+        }
+      }
+      expire_fan_demands(sources);
+
+      // Should the interrupt ever get lost the fade is over by now, its
+      // number tells a late one apart from the next fade's
+      if (fading && (int32_t)(xTaskGetTickCount() - fade_until) >= 0) {
+        fading = false;
+      }
+
+      int winner = arbitrate_fan_demands(sources);
+      uint32_t duty = winner != LOWEST_PRIORITY ? sources[winner].duty : 0;
+
+      read_fan_config(&config);
+
+      if (duty != current_duty) {
+        // A low duty may not get the fans turning from standstill, so they
+        // are kicked first
+        if (current_duty == 0 && duty < config.kick_duty && config.kick_ms > 0) {
+          kicking = true;
+          kick_armed = false;
+        }
+        else if (duty == 0 || duty >= config.kick_duty) {
+          kicking = false;
+        }
+        current_duty = duty;
+      }
+
+      if (kicking && kick_armed && (int32_t)(xTaskGetTickCount() - kick_until) >= 0) {
+        kicking = false;
+      }
+
+      uint32_t target = kicking ? config.kick_duty : current_duty;
+
+      if (!fading && target != fan_duty) {
+        uint32_t fade_ms = fan_fade_ms(fan_duty, target, &config);
+
+        fading = set_fan(LEDC_CHANNEL, target, fade_ms);
+        fade_until = xTaskGetTickCount() + pdMS_TO_TICKS(fade_ms + FAN_FADE_MARGIN_MS);
+        fan_duty = target;
+      }
+
+      // The kick counts from when the fan gets to kick_duty, which is only
+      // known once the fade there has started, possibly after an earlier one
+      if (kicking && !kick_armed && fan_duty == config.kick_duty) {
+        kick_until = (fading ? fade_until : xTaskGetTickCount()) + pdMS_TO_TICKS(config.kick_ms);
+        kick_armed = true;
+      }
+
+      taskENTER_CRITICAL(&fanStatusLock);
+      fanStatus.winner = winner;
+      fanStatus.duty = duty;
+      memcpy(fanStatus.sources, sources, sizeof fanStatus.sources);
+      taskEXIT_CRITICAL(&fanStatusLock);
+    }
+  }
+}
+
+static void
+createSensorManagerTask(void) {
+  xTaskCreateStatic(sensor_manager_task_function,
+                    "sensorman_task",
+                     TASK_STACK_SIZE,
+                     (void*)1,
+                     tskIDLE_PRIORITY + 2,
+                     sensorManagerTaskStack,
+                     &sensorManagerTaskBuffer);
+}
+
+static void
+createfanRunnerTask(void) {
+  xTaskCreateStatic(fan_runner_task_function,
+                    "fan_task",
+                     TASK_STACK_SIZE,
+                     (void*)1,
+                     tskIDLE_PRIORITY + 2,
+                     fanRunnerTaskStack,
+                     &fanRunnerTaskBuffer);
+}
+
+static void
+createMqttHandlerTask(void) {
+  xTaskCreateStatic(mqtt_event_handler_function,
+                    "mqttevhandler_task",
+                     TASK_STACK_SIZE,
+                     (void*)1,
+                     tskIDLE_PRIORITY + 1,
+                     mqttEventHandlerTaskStack,
+                     &mqttEventHandlerTaskBuffer);
+}
+
+// Never blocks the caller, a full queue is counted instead
+static bool
+send_fan_event(const struct fan_event *message) {
+  if (xQueueSend(fanEventsHandle, (void*)message, (TickType_t)0) != pdPASS) {
+    __atomic_add_fetch(&fanCommandDrops, 1, __ATOMIC_RELAXED);
+    printf("Fan queue full, dropped fan command from priority %d\n", message->priority);
+    return false;
+  }
+  return true;
+}
+
+static bool
+run_fans(int delay, int priority, uint32_t duty) {
+  struct fan_event message;
+  message.fan = FAN_ON;
+  message.priority = priority;
+  message.fan_delay = make_delay(delay);
+  message.run_forever = 0;
+  message.duty = duty;
+
+  return send_fan_event(&message);
+}
+
+static bool
+stop_running_fans(int priority) {
+  struct fan_event message = {0};
+  message.fan = FAN_OFF;
+  message.priority = priority;
+
+  return send_fan_event(&message);
+}
+
+static bool
+run_fans_forever(int priority, uint32_t duty) {
+  struct fan_event message;
+  message.fan = FAN_ON;
+  message.fan_delay = -1;
+  message.run_forever = 1;
+  message.priority = priority;
+  message.duty = duty;
+
+  return send_fan_event(&message);
+}
+
+
+static esp_err_t
+set_sensor_thresholds_handler(httpd_req_t *req) {
+  printf("set sensor thresholds handler executed\n");
+  char req_body[HTTPD_RESP_SIZE];
+  char resp[] = "Set thresholds";
+
+  size_t body_size = MIN(req->content_len, (sizeof(req_body)-1));
+
+  // Receive body and do error handling
+  int ret = httpd_req_recv(req, req_body, body_size);
+
+  // if ret == 0 then no data
+  if (ret < 0) {
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      httpd_resp_send_408(req);
+    }
+    return ESP_FAIL;
+  }
+
+  struct threshold_event thresholdMessage;
+  thresholdMessage.voc_max_threshold = -1;
+  thresholdMessage.voc_min_threshold = -1; // -1 means no change
+  thresholdMessage.bed_temper_min_threshold = -1.0f;
+  thresholdMessage.bed_temper_max_threshold = -1.0f; // -1 means no change
+
+  cJSON *json = cJSON_ParseWithLength(req_body, body_size);
+
+  if (json != NULL) {
+    if (cJSON_IsObject(json)) {
+      cJSON *voc_max_j = cJSON_GetObjectItemCaseSensitive(json, "voc_max_threshold");
+      cJSON *voc_min_j = cJSON_GetObjectItemCaseSensitive(json, "voc_min_threshold");
+
+      cJSON *bed_temper_max_j = cJSON_GetObjectItemCaseSensitive(json, "bed_temper_max_threshold");
+      cJSON *bed_temper_min_j = cJSON_GetObjectItemCaseSensitive(json, "bed_temper_min_threshold");
+
+      if (cJSON_IsNumber(voc_max_j) && cJSON_IsNumber(voc_min_j)) {
+        thresholdMessage.voc_max_threshold = voc_max_j->valueint;
+        thresholdMessage.voc_min_threshold = voc_min_j->valueint;
+        if ((thresholdMessage.voc_min_threshold > thresholdMessage.voc_max_threshold) ||
+            (thresholdMessage.voc_max_threshold < 0) ||
+            (thresholdMessage.voc_min_threshold < 0)) {
+          #ifdef CONFIG_DEBUG_MODE_ENABLED
+          printf("Could not set voc values, attempted max = %d, attempted min = %d\n", voc_max_j->valueint, voc_min_j->valueint);
+          printf("Setting voc_min_threshold = %d\n", VOC_MAX_THRESHOLD_DEFAULT-10);
+          printf("Setting voc_max_threshold = %d\n", VOC_MAX_THRESHOLD_DEFAULT);
+          #endif
+          thresholdMessage.voc_max_threshold = VOC_MAX_THRESHOLD_DEFAULT;
+          thresholdMessage.voc_min_threshold = VOC_MAX_THRESHOLD_DEFAULT-10;
+        }
+        else {
+          #ifdef CONFIG_DEBUG_MODE_ENABLED
+          printf("Setting new voc max: voc_max_threshold = %d\n", voc_max_j->valueint);
+          printf("Setting new voc min: voc_min_threshold = %d\n", voc_min_j->valueint);
+          #endif
+        }
+      }
+
+      if (cJSON_IsNumber(bed_temper_max_j) && cJSON_IsNumber(bed_temper_min_j)) {
+        thresholdMessage.bed_temper_max_threshold = bed_temper_max_j->valuedouble;
+        thresholdMessage.bed_temper_min_threshold = bed_temper_min_j->valuedouble;
+        if ((thresholdMessage.bed_temper_min_threshold > thresholdMessage.bed_temper_max_threshold) ||
+            (thresholdMessage.bed_temper_max_threshold < 0.0f) ||
+            (thresholdMessage.bed_temper_min_threshold < 0.0f)) {
+          #ifdef CONFIG_DEBUG_MODE_ENABLED
+          printf("Could not set bed temper values, attempted max = %f, attempted min = %f\n",
+                 bed_temper_max_j->valuedouble,
+                 bed_temper_min_j->valuedouble);
+
+          printf("Setting bed_temper_max_threshold = %f\n", BED_TEMPER_MAX_THRESHOLD_DEFAULT-2);
+          printf("Setting bed_temper_min_threshold = %f\n", BED_TEMPER_MAX_THRESHOLD_DEFAULT);
+          #endif
+
+          thresholdMessage.bed_temper_max_threshold = BED_TEMPER_MAX_THRESHOLD_DEFAULT;
+          thresholdMessage.bed_temper_min_threshold = BED_TEMPER_MAX_THRESHOLD_DEFAULT-2;
+        }
+        else {
+          #ifdef CONFIG_DEBUG_MODE_ENABLED
+          printf("Setting new bed temper max: bed_temper_max_threshold = %f\n", bed_temper_max_j->valuedouble);
+          printf("Setting new bed temper min: bed_temper_min_threshold = %f\n", bed_temper_min_j->valuedouble);
+          #endif
+        }
+      }
+    }
+  }
+
+  else {
+    return ESP_FAIL;
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+
+  if (json != NULL) { cJSON_Delete(json); }
+
+  if (thresholdEventsHandle != NULL) {
+    xQueueSend(thresholdEventsHandle, (void*)&thresholdMessage, (TickType_t)0);
+  }
+  return ESP_OK;
+}
+
+static const char *
+health_name(sensirion_i2c_health_t health) {
+  switch (health) {
+    case SENSIRION_I2C_HEALTHY:
+      return "healthy";
+    case SENSIRION_I2C_DEGRADED:
+      return "degraded";
+    default:
+      return "failed";
+  }
+}
+
+static void
+add_i2c_stats(cJSON *parent,
+              const char *name,
+              const sensirion_i2c_stats_t *stats,
+              sensirion_i2c_health_t health) {
+  cJSON *stats_j = cJSON_AddObjectToObject(parent, name);
+  if (stats_j == NULL) {
+    return;
+  }
+  cJSON_AddStringToObject(stats_j, "health", health_name(health));
+  cJSON_AddNumberToObject(stats_j, "transfers", stats->transfers);
+  cJSON_AddNumberToObject(stats_j, "errors", stats->errors);
+  cJSON_AddNumberToObject(stats_j, "crc_errors", stats->crc_errors);
+  cJSON_AddNumberToObject(stats_j, "recoveries", stats->recoveries);
+  cJSON_AddNumberToObject(stats_j, "resets", stats->resets);
+}
+
+static esp_err_t
+get_sensor_data_handler(httpd_req_t *req) {
+  time_t now;
+  struct tm timeinfo;
+  time(&now);
+  localtime_r(&now, &timeinfo);
+
+  // Never touches the sensors, just copies out whatever was sampled last
+  struct sensor_snapshot snapshot;
+  read_sensor_snapshot(&snapshot);
+
+  char resp[HTTPD_RESP_SIZE] = {0};
+  cJSON *resp_object_j = cJSON_CreateObject();
+
+  if (snapshot.seq > 0) {
+    cJSON_AddNumberToObject(resp_object_j, "seq", snapshot.seq);
+    cJSON_AddNumberToObject(resp_object_j, "age_ms", (double)((esp_timer_get_time() - snapshot.sample_time_us) / 1000));
+
+    cJSON *sampler_j = cJSON_AddObjectToObject(resp_object_j, "sampler");
+    if (sampler_j != NULL) {
+      cJSON_AddNumberToObject(sampler_j, "period_us", snapshot.sampler.last_period_us);
+      cJSON_AddNumberToObject(sampler_j, "min_period_us", snapshot.sampler.min_period_us);
+      cJSON_AddNumberToObject(sampler_j, "max_period_us", snapshot.sampler.max_period_us);
+      cJSON_AddNumberToObject(sampler_j, "max_jitter_us", snapshot.sampler.max_jitter_us);
+      cJSON_AddNumberToObject(sampler_j, "mean_jitter_us", snapshot.sampler.mean_jitter_us);
+      cJSON_AddNumberToObject(sampler_j, "overruns", snapshot.sampler.overruns);
+    }
+
+    cJSON *timings_j = cJSON_AddObjectToObject(resp_object_j, "timings");
+    if (timings_j != NULL) {
+      cJSON_AddNumberToObject(timings_j, "sgp40_start_us", snapshot.timings.sgp40_start_us);
+      cJSON_AddNumberToObject(timings_j, "sht3x_fetch_us", snapshot.timings.sht3x_fetch_us);
+      cJSON_AddNumberToObject(timings_j, "sgp40_read_us", snapshot.timings.sgp40_read_us);
+      cJSON_AddNumberToObject(timings_j, "total_us", snapshot.timings.total_us);
+    }
+
+    cJSON *i2c_j = cJSON_AddObjectToObject(resp_object_j, "i2c");
+    if (i2c_j != NULL) {
+      add_i2c_stats(i2c_j, "sht3x", &snapshot.sht3x_i2c, snapshot.sht3x_health);
+      add_i2c_stats(i2c_j, "sgp40", &snapshot.sgp40_i2c, snapshot.sgp40_health);
+    }
+
+    if (snapshot.climate_valid) {
+      cJSON_AddNumberToObject(resp_object_j, "temperature", (double)sht3x_ticks_to_celsius(snapshot.temperature_ticks));
+      cJSON_AddNumberToObject(resp_object_j, "humidity", (double)sht3x_ticks_to_percent(snapshot.humidity_ticks));
+    }
+
+    if (snapshot.voc_valid) {
+      cJSON_AddNumberToObject(resp_object_j, "voc_index", snapshot.voc_index);
+    }
+
+    if (snapshot.raw_voc_valid) {
+      cJSON_AddNumberToObject(resp_object_j, "raw_voc", snapshot.raw_voc);
+    }
+  }
+
+  cJSON_AddNumberToObject(resp_object_j, "hour", (double)timeinfo.tm_hour);
+  cJSON_AddNumberToObject(resp_object_j, "minute", (double)timeinfo.tm_min);
+
+  cJSON_PrintPreallocated(resp_object_j, resp, HTTPD_RESP_SIZE, false);
+
+  if (resp_object_j != NULL) { cJSON_Delete(resp_object_j); }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+
+  return ESP_OK;
+}
+
+// Internal values are Q16.16, SRAW and the learned mean are put back into
+// sensor ticks
+#define VOC_DIAG_VALUE(v) ((double)(v) / 65536.0)
+#define VOC_DIAG_SRAW(v) (VOC_DIAG_VALUE(v) + 20000.0)
+
+static void
+add_voc_diag(cJSON *parent, const VocAlgorithmDiagnostics *diag) {
+  cJSON_AddNumberToObject(parent, "uptime_s", VOC_DIAG_VALUE(diag->uptime));
+  cJSON_AddNumberToObject(parent, "sraw", VOC_DIAG_SRAW(diag->sraw));
+  cJSON_AddNumberToObject(parent, "index", VOC_DIAG_VALUE(diag->voc_index));
+  cJSON_AddBoolToObject(parent, "initialized", diag->initialized);
+  cJSON_AddNumberToObject(parent, "mean", VOC_DIAG_SRAW(diag->mean));
+  cJSON_AddNumberToObject(parent, "std", VOC_DIAG_VALUE(diag->std));
+  cJSON_AddNumberToObject(parent, "gamma_mean", VOC_DIAG_VALUE(diag->gamma_mean));
+  cJSON_AddNumberToObject(parent, "gamma_variance", VOC_DIAG_VALUE(diag->gamma_variance));
+  cJSON_AddNumberToObject(parent, "uptime_gamma_s", VOC_DIAG_VALUE(diag->uptime_gamma));
+  cJSON_AddNumberToObject(parent, "uptime_gating_s", VOC_DIAG_VALUE(diag->uptime_gating));
+  cJSON_AddNumberToObject(parent, "gating_minutes", VOC_DIAG_VALUE(diag->gating_duration_minutes));
+  cJSON_AddNumberToObject(parent, "lowpass_x1", VOC_DIAG_VALUE(diag->lowpass_x1));
+  cJSON_AddNumberToObject(parent, "lowpass_x2", VOC_DIAG_VALUE(diag->lowpass_x2));
+  cJSON_AddNumberToObject(parent, "lowpass_x3", VOC_DIAG_VALUE(diag->lowpass_x3));
+}
+
+// Prints one sample as a JSON object into buf, returns false if it did not fit
+static bool
+print_voc_diag(char *buf,
+               size_t size,
+               uint32_t seq,
+               int64_t sample_time_us,
+               uint16_t raw_voc,
+               int32_t voc_index,
+               const VocAlgorithmDiagnostics *diag) {
+  cJSON *sample_j = cJSON_CreateObject();
+  if (sample_j == NULL) {
+    return false;
+  }
+
+  cJSON_AddNumberToObject(sample_j, "seq", seq);
+  cJSON_AddNumberToObject(sample_j, "time_ms", (double)(sample_time_us / 1000));
+  cJSON_AddNumberToObject(sample_j, "raw_voc", raw_voc);
+  cJSON_AddNumberToObject(sample_j, "voc_index", voc_index);
+  add_voc_diag(sample_j, diag);
+
+  bool printed = cJSON_PrintPreallocated(sample_j, buf, (int)size, false);
+  cJSON_Delete(sample_j);
+  return printed;
+}
+
+// GET /voc_diagnostics[?since=<seq>]
+//
+// The VOC algorithm internals of the latest sample as "current", and while
+// the stream is enabled every recorded sample with a seq after since as
+// "samples". Polling with since set to the last seq received gets each
+// sample once, as long as it is polled at least every VOC_DIAG_RING_SIZE
+// samples. Sent in chunks, one sample each, to keep the buffers small.
+static esp_err_t
+get_voc_diagnostics_handler(httpd_req_t *req) {
+  char buf[HTTPD_RESP_SIZE] = {0};
+  char since_s[12] = {0};
+  uint32_t since = 0;
+
+  if (httpd_req_get_url_query_str(req, buf, sizeof buf) == ESP_OK &&
+      httpd_query_key_value(buf, "since", since_s, sizeof since_s) == ESP_OK) {
+    since = strtoul(since_s, NULL, 10);
+  }
+
+  struct sensor_snapshot snapshot;
+  read_sensor_snapshot(&snapshot);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+
+  snprintf(buf, sizeof buf, "{\"enabled\":%s,\"dropped\":%" PRIu32 ",\"current\":",
+           __atomic_load_n(&vocDiagEnabled, __ATOMIC_RELAXED) ? "true" : "false",
+           vocDiagDropped);
+  httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+
+  if (!snapshot.voc_diag_valid ||
+      !print_voc_diag(buf, sizeof buf, snapshot.seq, snapshot.sample_time_us,
+                      snapshot.raw_voc, snapshot.voc_index, &snapshot.voc_diag)) {
+    strcpy(buf, "null");
+  }
+  httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  httpd_resp_send_chunk(req, ",\"samples\":[", HTTPD_RESP_USE_STRLEN);
+
+  struct voc_diag_record record;
+  bool first = true;
+
+  while (read_voc_diag(since, &record)) {
+    since = record.seq;
+    if (!print_voc_diag(buf, sizeof buf, record.seq, record.sample_time_us,
+                        record.raw_voc, record.voc_index, &record.diag)) {
+      continue;
+    }
+    if (!first) {
+      httpd_resp_send_chunk(req, ",", HTTPD_RESP_USE_STRLEN);
+    }
+    httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    first = false;
+  }
+
+  httpd_resp_send_chunk(req, "]}", HTTPD_RESP_USE_STRLEN);
+  httpd_resp_send_chunk(req, NULL, 0);
+
+  return ESP_OK;
+}
+
+// POST /voc_diagnostics {"enabled": true|false}
+static esp_err_t
+set_voc_diagnostics_handler(httpd_req_t *req) {
+  char req_body[HTTPD_RESP_SIZE+1] = {0};
+
+  size_t body_size = MIN(req->content_len, (sizeof(req_body)-1));
+  int ret = httpd_req_recv(req, req_body, body_size);
+
+  // if ret == 0 then no data
+  if (ret < 0) {
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      httpd_resp_send_408(req);
+    }
+    return ESP_FAIL;
+  }
+
+  cJSON *json = cJSON_ParseWithLength(req_body, body_size);
+  cJSON *enabled_j = cJSON_GetObjectItemCaseSensitive(json, "enabled");
+
+  if (!cJSON_IsBool(enabled_j)) {
+    if (json != NULL) { cJSON_Delete(json); }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "expected {\"enabled\": true|false}");
+    return ESP_FAIL;
+  }
+
+  bool enabled = cJSON_IsTrue(enabled_j);
+  __atomic_store_n(&vocDiagEnabled, enabled, __ATOMIC_RELAXED);
+  printf("VOC diagnostics stream %s\n", enabled ? "enabled" : "disabled");
+
+  cJSON_Delete(json);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, enabled ? "{\"enabled\":true}" : "{\"enabled\":false}", HTTPD_RESP_USE_STRLEN);
+  return ESP_OK;
+}
+
+static void
+send_voc_tuning(httpd_req_t *req, const struct voc_tuning *tuning) {
+  char resp[HTTPD_RESP_SIZE] = {0};
+  cJSON *resp_object_j = cJSON_CreateObject();
+
+  cJSON_AddNumberToObject(resp_object_j, "voc_index_offset", tuning->voc_index_offset);
+  cJSON_AddNumberToObject(resp_object_j, "learning_time_hours", tuning->learning_time_hours);
+  cJSON_AddNumberToObject(resp_object_j, "gating_max_duration_minutes", tuning->gating_max_duration_minutes);
+  cJSON_AddNumberToObject(resp_object_j, "std_initial", tuning->std_initial);
+
+  cJSON_PrintPreallocated(resp_object_j, resp, HTTPD_RESP_SIZE, false);
+
+  if (resp_object_j != NULL) { cJSON_Delete(resp_object_j); }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+}
+
+// GET /voc_tuning
+static esp_err_t
+get_voc_tuning_handler(httpd_req_t *req) {
+  struct voc_tuning tuning = current_voc_tuning();
+  send_voc_tuning(req, &tuning);
+  return ESP_OK;
+}
+
+// cJSON truncates valueint, so 12.9 would silently become 12
+static bool
+json_integer_or_absent(const cJSON *item) {
+  return item == NULL || (cJSON_IsNumber(item) && item->valuedouble == item->valueint);
+}
+
+// POST /voc_tuning with any of the four parameters, the others stay as they
+// are. Applied by the sensor manager task from the next sample on, without
+// losing what the VOC algorithm has learned, and saved to NVS once it has
+// been handed over.
+static esp_err_t
+set_voc_tuning_handler(httpd_req_t *req) {
+  printf("set_voc_tuning_handler executed\n");
+  char req_body[HTTPD_RESP_SIZE+1] = {0};
+
+  size_t body_size = MIN(req->content_len, (sizeof(req_body)-1));
+  int ret = httpd_req_recv(req, req_body, body_size);
+
+  // if ret == 0 then no data
+  if (ret < 0) {
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      httpd_resp_send_408(req);
+    }
+    return ESP_FAIL;
+  }
+
+  cJSON *json = cJSON_ParseWithLength(req_body, body_size);
+
+  if (!cJSON_IsObject(json)) {
+    if (json != NULL) { cJSON_Delete(json); }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "expected a JSON object");
+    return ESP_FAIL;
+  }
+
+  cJSON *voc_index_offset_j = cJSON_GetObjectItemCaseSensitive(json, "voc_index_offset");
+  cJSON *learning_time_hours_j = cJSON_GetObjectItemCaseSensitive(json, "learning_time_hours");
+  cJSON *gating_max_duration_minutes_j = cJSON_GetObjectItemCaseSensitive(json, "gating_max_duration_minutes");
+  cJSON *std_initial_j = cJSON_GetObjectItemCaseSensitive(json, "std_initial");
+
+  if (!json_integer_or_absent(voc_index_offset_j) || !json_integer_or_absent(learning_time_hours_j) ||
+      !json_integer_or_absent(gating_max_duration_minutes_j) || !json_integer_or_absent(std_initial_j)) {
+    cJSON_Delete(json);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "VOC tuning parameters must be integers");
+    return ESP_FAIL;
+  }
+
+  xSemaphoreTake(vocTuningLock, portMAX_DELAY);
+  struct voc_tuning tuning = vocTuning;
+
+  if (cJSON_IsNumber(voc_index_offset_j)) {
+    tuning.voc_index_offset = voc_index_offset_j->valueint;
+  }
+  if (cJSON_IsNumber(learning_time_hours_j)) {
+    tuning.learning_time_hours = learning_time_hours_j->valueint;
+  }
+  if (cJSON_IsNumber(gating_max_duration_minutes_j)) {
+    tuning.gating_max_duration_minutes = gating_max_duration_minutes_j->valueint;
+  }
+  if (cJSON_IsNumber(std_initial_j)) {
+    tuning.std_initial = std_initial_j->valueint;
+  }
+
+  cJSON_Delete(json);
+
+  if (!voc_tuning_valid(&tuning)) {
+    xSemaphoreGive(vocTuningLock);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                        "voc_index_offset 1..250, learning_time_hours 1..72, "
+                        "gating_max_duration_minutes 0..720, std_initial 10..500");
+    return ESP_FAIL;
+  }
+
+  if (vocTuningEventsHandle == NULL ||
+      xQueueSend(vocTuningEventsHandle, (void*)&tuning, (TickType_t)0) != pdPASS) {
+    xSemaphoreGive(vocTuningLock);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "sensor task busy, try again");
+    return ESP_FAIL;
+  }
+
+  vocTuning = tuning;
+
+  esp_err_t nvs_err = save_voc_tuning(&tuning);
+  if (nvs_err != ESP_OK) {
+    printf("Could not save VOC tuning to NVS: %s\n", esp_err_to_name(nvs_err));
+    printf("Continuing execution anyway but it will not be persisted to nvram\n");
+  }
+
+  xSemaphoreGive(vocTuningLock);
 
-  xQueueSend(fanEventsHandle, (void*)&message, (TickType_t)0);
+  send_voc_tuning(req, &tuning);
+  return ESP_OK;
 }
 
 static void
-stop_running_fans(int priority) {
-  struct fan_event message;
-  message.fan = FAN_OFF;
-  message.priority = priority;
-  xQueueSend(fanEventsHandle, (void*)&message, (TickType_t)0);
-}
+send_fan_config(httpd_req_t *req, const struct fan_config *config) {
+  char resp[HTTPD_RESP_SIZE] = {0};
+  cJSON *resp_object_j = cJSON_CreateObject();
 
-static void
-run_fans_forever(int priority) {
-  struct fan_event message;
-  message.fan = FAN_ON;
-  message.fan_delay = -1;
-  message.run_forever = 1;
-  message.priority = priority;
+  cJSON_AddBoolToObject(resp_object_j, "pi_enabled", config->pi_enabled);
+  cJSON_AddNumberToObject(resp_object_j, "voc_kp", config->voc_kp);
+  cJSON_AddNumberToObject(resp_object_j, "voc_ki", config->voc_ki);
+  cJSON_AddNumberToObject(resp_object_j, "bed_temp_kp", config->bed_temp_kp);
+  cJSON_AddNumberToObject(resp_object_j, "bed_temp_ki", config->bed_temp_ki);
+  cJSON_AddNumberToObject(resp_object_j, "min_duty", config->min_duty);
+  cJSON_AddNumberToObject(resp_object_j, "kick_duty", config->kick_duty);
+  cJSON_AddNumberToObject(resp_object_j, "kick_ms", config->kick_ms);
+  cJSON_AddNumberToObject(resp_object_j, "ramp_up_ms", config->ramp_up_ms);
+  cJSON_AddNumberToObject(resp_object_j, "ramp_down_ms", config->ramp_down_ms);
+
+  cJSON_PrintPreallocated(resp_object_j, resp, HTTPD_RESP_SIZE, false);
+
+  if (resp_object_j != NULL) { cJSON_Delete(resp_object_j); }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+}
 
-  xQueueSend(fanEventsHandle, (void*)&message, (TickType_t)0);
+// GET /fan_config
+static esp_err_t
+get_fan_config_handler(httpd_req_t *req) {
+  struct fan_config config;
+  read_fan_config(&config);
+  send_fan_config(req, &config);
+  return ESP_OK;
 }
 
+// A gain, if given, has to be in 0..FAN_GAIN_MAX before it is narrowed to
+// float, where a huge double would become inf
+static bool
+parse_fan_gain(const cJSON *gain_j, float *gain) {
+  if (!cJSON_IsNumber(gain_j)) {
+    return true;
+  }
+  if (!(gain_j->valuedouble >= 0 && gain_j->valuedouble <= FAN_GAIN_MAX)) {
+    return false;
+  }
+  *gain = (float)gain_j->valuedouble;
+  return true;
+}
 
+// POST /fan_config with any of the fields, the others stay as they are.
+// Saved to NVS, the controllers pick it up with the next sample.
 static esp_err_t
-set_sensor_thresholds_handler(httpd_req_t *req) {
-  printf("set sensor thresholds handler executed\n");
-  char req_body[HTTPD_RESP_SIZE];
-  char resp[] = "Set thresholds";
+set_fan_config_handler(httpd_req_t *req) {
+  printf("set_fan_config_handler executed\n");
+  char req_body[HTTPD_RESP_SIZE+1] = {0};
 
   size_t body_size = MIN(req->content_len, (sizeof(req_body)-1));
-
-  // Receive body and do error handling
   int ret = httpd_req_recv(req, req_body, body_size);
 
   // if ret == 0 then no data
@@ -482,147 +1994,225 @@ set_sensor_thresholds_handler(httpd_req_t *req) {
     return ESP_FAIL;
   }
 
-  struct threshold_event thresholdMessage;
-  thresholdMessage.voc_max_threshold = -1;
-  thresholdMessage.voc_min_threshold = -1; // -1 means no change
-  thresholdMessage.bed_temper_min_threshold = -1.0f;
-  thresholdMessage.bed_temper_max_threshold = -1.0f; // -1 means no change
-
   cJSON *json = cJSON_ParseWithLength(req_body, body_size);
 
-  if (json != NULL) {
-    if (cJSON_IsObject(json)) {
-      cJSON *voc_max_j = cJSON_GetObjectItemCaseSensitive(json, "voc_max_threshold");
-      cJSON *voc_min_j = cJSON_GetObjectItemCaseSensitive(json, "voc_min_threshold");
-
-      cJSON *bed_temper_max_j = cJSON_GetObjectItemCaseSensitive(json, "bed_temper_max_threshold");
-      cJSON *bed_temper_min_j = cJSON_GetObjectItemCaseSensitive(json, "bed_temper_min_threshold");
-
-      if (cJSON_IsNumber(voc_max_j) && cJSON_IsNumber(voc_min_j)) {
-        thresholdMessage.voc_max_threshold = voc_max_j->valueint;
-        thresholdMessage.voc_min_threshold = voc_min_j->valueint;
-        if ((thresholdMessage.voc_min_threshold > thresholdMessage.voc_max_threshold) ||
-            (thresholdMessage.voc_max_threshold < 0) ||
-            (thresholdMessage.voc_min_threshold < 0)) {
-          #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Could not set voc values, attempted max = %d, attempted min = %d\n", voc_max_j->valueint, voc_min_j->valueint);
-          printf("Setting voc_min_threshold = %d\n", VOC_MAX_THRESHOLD_DEFAULT-10);
-          printf("Setting voc_max_threshold = %d\n", VOC_MAX_THRESHOLD_DEFAULT);
-          #endif
-          thresholdMessage.voc_max_threshold = VOC_MAX_THRESHOLD_DEFAULT;
-          thresholdMessage.voc_min_threshold = VOC_MAX_THRESHOLD_DEFAULT-10;
-        }
-        else {
-          #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Setting new voc max: voc_max_threshold = %d\n", voc_max_j->valueint);
-          printf("Setting new voc min: voc_min_threshold = %d\n", voc_min_j->valueint);
-          #endif
-        }
-      }
+  if (!cJSON_IsObject(json)) {
+    if (json != NULL) { cJSON_Delete(json); }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "expected a JSON object");
+    return ESP_FAIL;
+  }
 
-      if (cJSON_IsNumber(bed_temper_max_j) && cJSON_IsNumber(bed_temper_min_j)) {
-        thresholdMessage.bed_temper_max_threshold = bed_temper_max_j->valuedouble;
-        thresholdMessage.bed_temper_min_threshold = bed_temper_min_j->valuedouble;
-        if ((thresholdMessage.bed_temper_min_threshold > thresholdMessage.bed_temper_max_threshold) ||
-            (thresholdMessage.bed_temper_max_threshold < 0.0f) ||
-            (thresholdMessage.bed_temper_min_threshold < 0.0f)) {
-          #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Could not set bed temper values, attempted max = %f, attempted min = %f\n",
-                 bed_temper_max_j->valuedouble,
-                 bed_temper_min_j->valuedouble);
+  cJSON *pi_enabled_j = cJSON_GetObjectItemCaseSensitive(json, "pi_enabled");
+  cJSON *voc_kp_j = cJSON_GetObjectItemCaseSensitive(json, "voc_kp");
+  cJSON *voc_ki_j = cJSON_GetObjectItemCaseSensitive(json, "voc_ki");
+  cJSON *bed_temp_kp_j = cJSON_GetObjectItemCaseSensitive(json, "bed_temp_kp");
+  cJSON *bed_temp_ki_j = cJSON_GetObjectItemCaseSensitive(json, "bed_temp_ki");
+  cJSON *min_duty_j = cJSON_GetObjectItemCaseSensitive(json, "min_duty");
+  cJSON *kick_duty_j = cJSON_GetObjectItemCaseSensitive(json, "kick_duty");
+  cJSON *kick_ms_j = cJSON_GetObjectItemCaseSensitive(json, "kick_ms");
+  cJSON *ramp_up_ms_j = cJSON_GetObjectItemCaseSensitive(json, "ramp_up_ms");
+  cJSON *ramp_down_ms_j = cJSON_GetObjectItemCaseSensitive(json, "ramp_down_ms");
+  bool in_range = json_integer_or_absent(min_duty_j) && json_integer_or_absent(kick_duty_j) &&
+                  json_integer_or_absent(kick_ms_j) && json_integer_or_absent(ramp_up_ms_j) &&
+                  json_integer_or_absent(ramp_down_ms_j);
+
+  xSemaphoreTake(fanConfigUpdateLock, portMAX_DELAY);
+  struct fan_config config;
+  read_fan_config(&config);
+
+  if (cJSON_IsBool(pi_enabled_j)) {
+    config.pi_enabled = cJSON_IsTrue(pi_enabled_j);
+  }
+  in_range &= parse_fan_gain(voc_kp_j, &config.voc_kp);
+  in_range &= parse_fan_gain(voc_ki_j, &config.voc_ki);
+  in_range &= parse_fan_gain(bed_temp_kp_j, &config.bed_temp_kp);
+  in_range &= parse_fan_gain(bed_temp_ki_j, &config.bed_temp_ki);
+  // Negative numbers would wrap around as uint32_t
+  if (cJSON_IsNumber(min_duty_j)) {
+    in_range &= min_duty_j->valuedouble >= 0;
+    config.min_duty = (uint32_t)min_duty_j->valueint;
+  }
+  if (cJSON_IsNumber(kick_duty_j)) {
+    in_range &= kick_duty_j->valuedouble >= 0;
+    config.kick_duty = (uint32_t)kick_duty_j->valueint;
+  }
+  if (cJSON_IsNumber(kick_ms_j)) {
+    in_range &= kick_ms_j->valuedouble >= 0;
+    config.kick_ms = (uint32_t)kick_ms_j->valueint;
+  }
+  if (cJSON_IsNumber(ramp_up_ms_j)) {
+    in_range &= ramp_up_ms_j->valuedouble >= 0;
+    config.ramp_up_ms = (uint32_t)ramp_up_ms_j->valueint;
+  }
+  if (cJSON_IsNumber(ramp_down_ms_j)) {
+    in_range &= ramp_down_ms_j->valuedouble >= 0;
+    config.ramp_down_ms = (uint32_t)ramp_down_ms_j->valueint;
+  }
 
-          printf("Setting bed_temper_max_threshold = %f\n", BED_TEMPER_MAX_THRESHOLD_DEFAULT-2);
-          printf("Setting bed_temper_min_threshold = %f\n", BED_TEMPER_MAX_THRESHOLD_DEFAULT);
-          #endif
+  cJSON_Delete(json);
 
-          thresholdMessage.bed_temper_max_threshold = BED_TEMPER_MAX_THRESHOLD_DEFAULT;
-          thresholdMessage.bed_temper_min_threshold = BED_TEMPER_MAX_THRESHOLD_DEFAULT-2;
-        }
-        else {
-          #ifdef CONFIG_DEBUG_MODE_ENABLED
-          printf("Setting new bed temper max: bed_temper_max_threshold = %f\n", bed_temper_max_j->valuedouble);
-          printf("Setting new bed temper min: bed_temper_min_threshold = %f\n", bed_temper_min_j->valuedouble);
-          #endif
-        }
-      }
-    }
+  if (!in_range || !fan_config_valid(&config)) {
+    xSemaphoreGive(fanConfigUpdateLock);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                        "gains 0..1000, min_duty and kick_duty 0..255 integers with kick_duty >= min_duty, "
+                        "kick_ms 0..10000, ramp_up_ms and ramp_down_ms 0..30000 integers");
+    return ESP_FAIL;
   }
 
-  else {
-    return ESP_FAIL;
+  esp_err_t nvs_err = save_fan_config(&config);
+  if (nvs_err != ESP_OK) {
+    printf("Could not save fan config to NVS: %s\n", esp_err_to_name(nvs_err));
+    printf("Continuing execution anyway but it will not be persisted to nvram\n");
   }
 
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_set_status(req, HTTPD_200);
-  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+  write_fan_config(&config);
+  xSemaphoreGive(fanConfigUpdateLock);
 
-  if (json != NULL) { cJSON_Delete(json); }
+  send_fan_config(req, &config);
+  return ESP_OK;
+}
 
-  if (thresholdEventsHandle != NULL) {
-    xQueueSend(thresholdEventsHandle, (void*)&thresholdMessage, (TickType_t)0);
+static void
+add_fan_curve(cJSON *parent, const char *name, const struct fan_curve *curve) {
+  cJSON *curve_j = cJSON_AddArrayToObject(parent, name);
+
+  for (int i = 0; i < curve->points; i++) {
+    cJSON *point_j = cJSON_CreateArray();
+    cJSON_AddItemToArray(point_j, cJSON_CreateNumber(curve->point[i].x));
+    cJSON_AddItemToArray(point_j, cJSON_CreateNumber(curve->point[i].duty));
+    cJSON_AddItemToArray(curve_j, point_j);
   }
-  return ESP_OK;
 }
 
-static esp_err_t
-get_sensor_data_handler(httpd_req_t *req) {
-  time_t now;
-  struct tm timeinfo;
-  time(&now);
-  localtime_r(&now, &timeinfo);
+// A curve as an array of [x, duty] integer pairs. Leaves curve as it was
+// when curve_j is missing, fails if it is not a list of such pairs.
+static bool
+parse_fan_curve(const cJSON *curve_j, struct fan_curve *curve) {
+  const cJSON *point_j;
+  struct fan_curve parsed = {0};
+
+  if (curve_j == NULL) {
+    return true;
+  }
+  if (!cJSON_IsArray(curve_j) || cJSON_GetArraySize(curve_j) > FAN_CURVE_POINTS_MAX) {
+    return false;
+  }
+
+  cJSON_ArrayForEach(point_j, curve_j) {
+    const cJSON *x_j = cJSON_GetArrayItem(point_j, 0);
+    const cJSON *duty_j = cJSON_GetArrayItem(point_j, 1);
+
+    if (cJSON_GetArraySize(point_j) != 2 || !cJSON_IsNumber(x_j) || !cJSON_IsNumber(duty_j) ||
+        x_j->valuedouble < FAN_CURVE_X_MIN || x_j->valuedouble > FAN_CURVE_X_MAX ||
+        duty_j->valuedouble < 0 || duty_j->valuedouble > LEDC_DUTY ||
+        x_j->valuedouble != x_j->valueint || duty_j->valuedouble != duty_j->valueint) {
+      return false;
+    }
 
-  float temperature;
-  float humidity;
-  int32_t voc_index;
-  uint16_t raw_voc;
+    parsed.point[parsed.points].x = (int16_t)x_j->valueint;
+    parsed.point[parsed.points].duty = (uint16_t)duty_j->valueint;
+    parsed.points++;
+  }
+
+  *curve = parsed;
+  return true;
+}
 
+static void
+send_fan_curves(httpd_req_t *req, const struct fan_curves *curves) {
   char resp[HTTPD_RESP_SIZE] = {0};
   cJSON *resp_object_j = cJSON_CreateObject();
 
-  if (xSemaphoreTake(sensorSemaphore, (TickType_t)10) == pdTRUE) {
-    if (sht3x_measure(sensor, &temperature, &humidity)) {
-      cJSON_AddNumberToObject(resp_object_j, "temperature", (double)temperature);
-      cJSON_AddNumberToObject(resp_object_j, "humidity", (double)humidity);
+  cJSON_AddBoolToObject(resp_object_j, "enabled", curves->enabled);
+  add_fan_curve(resp_object_j, "voc", &curves->voc);
+  add_fan_curve(resp_object_j, "bed_temp", &curves->bed_temp);
 
-      esp_err_t sgp40_status = sgp40_measure_voc(&air_q_sensor,
-                                                 humidity,
-                                                 temperature,
-                                                 &voc_index);
+  cJSON_PrintPreallocated(resp_object_j, resp, HTTPD_RESP_SIZE, false);
 
-      esp_err_t sgp40_status_raw = sgp40_measure_raw(&air_q_sensor,
-                                                     humidity,
-                                                     temperature,
-                                                     &raw_voc);
+  if (resp_object_j != NULL) { cJSON_Delete(resp_object_j); }
 
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+}
 
-      if (sgp40_status == ESP_OK) {
-        cJSON_AddNumberToObject(resp_object_j, "voc_index", voc_index);
-      }
+// GET /fan_curves
+static esp_err_t
+get_fan_curves_handler(httpd_req_t *req) {
+  struct fan_curves curves = current_fan_curves();
+  send_fan_curves(req, &curves);
+  return ESP_OK;
+}
 
-      if (sgp40_status_raw == ESP_OK) {
-        cJSON_AddNumberToObject(resp_object_j, "raw_voc", raw_voc);
-      }
+// POST /fan_curves with any of "enabled", "voc" and "bed_temp", the others
+// stay as they are. A curve is a list of up to FAN_CURVE_POINTS_MAX
+// [x, duty] pairs sorted by x, e.g. {"voc": [[100, 0], [150, 80],
+// [300, 255]]}. Handed to the sensor manager task in one message, which
+// uses it from the next sample on, and saved to NVS once it has been.
+static esp_err_t
+set_fan_curves_handler(httpd_req_t *req) {
+  printf("set_fan_curves_handler executed\n");
+  char req_body[HTTPD_RESP_SIZE+1] = {0};
+
+  size_t body_size = MIN(req->content_len, (sizeof(req_body)-1));
+  int ret = httpd_req_recv(req, req_body, body_size);
 
+  // if ret == 0 then no data
+  if (ret < 0) {
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      httpd_resp_send_408(req);
     }
+    return ESP_FAIL;
+  }
 
-    cJSON_AddNumberToObject(resp_object_j, "hour", (double)timeinfo.tm_hour);
-    cJSON_AddNumberToObject(resp_object_j, "minute", (double)timeinfo.tm_min);
+  cJSON *json = cJSON_ParseWithLength(req_body, body_size);
 
-    cJSON_PrintPreallocated(resp_object_j, resp, HTTPD_RESP_SIZE, false);
+  if (!cJSON_IsObject(json)) {
+    if (json != NULL) { cJSON_Delete(json); }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "expected a JSON object");
+    return ESP_FAIL;
+  }
 
-    if (resp_object_j != NULL) { cJSON_Delete(resp_object_j); }
+  cJSON *enabled_j = cJSON_GetObjectItemCaseSensitive(json, "enabled");
 
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_set_status(req, HTTPD_200);
-    httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+  xSemaphoreTake(fanCurvesLock, portMAX_DELAY);
+  struct fan_curves curves = fanCurves;
 
-    xSemaphoreGive(sensorSemaphore);
-    return ESP_OK;
+  if (cJSON_IsBool(enabled_j)) {
+    curves.enabled = cJSON_IsTrue(enabled_j);
   }
-  else {
-    printf("failed to acquire sensor semaphore in web request\n");
+
+  bool parsed = parse_fan_curve(cJSON_GetObjectItemCaseSensitive(json, "voc"), &curves.voc) &&
+                parse_fan_curve(cJSON_GetObjectItemCaseSensitive(json, "bed_temp"), &curves.bed_temp);
+
+  cJSON_Delete(json);
+
+  if (!parsed || !fan_curves_valid(&curves)) {
+    xSemaphoreGive(fanCurvesLock);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                        "curves are up to 8 [x, duty] integer pairs, x 0..1000 increasing, duty 0..255");
+    return ESP_FAIL;
+  }
+
+  if (fanCurvesEventsHandle == NULL ||
+      xQueueSend(fanCurvesEventsHandle, (void*)&curves, (TickType_t)0) != pdPASS) {
+    xSemaphoreGive(fanCurvesLock);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "sensor task busy, try again");
     return ESP_FAIL;
   }
+
+  fanCurves = curves;
+
+  esp_err_t nvs_err = save_fan_curves(&curves);
+  if (nvs_err != ESP_OK) {
+    printf("Could not save fan curves to NVS: %s\n", esp_err_to_name(nvs_err));
+    printf("Continuing execution anyway but it will not be persisted to nvram\n");
+  }
+
+  xSemaphoreGive(fanCurvesLock);
+
+  send_fan_curves(req, &curves);
+  return ESP_OK;
 }
 
 static esp_err_t
@@ -709,6 +2299,9 @@ update_mqtt_cfg_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
+// POST /fans with the run time and an optional duty in percent. For that
+// time the manual demand overrides the VOC, bed temperature and schedule
+// demands, duty 0 keeps the fans off.
 static esp_err_t
 fans_on_handler(httpd_req_t *req) {
   printf("fans_on_handler executed\n");
@@ -733,9 +2326,16 @@ fans_on_handler(httpd_req_t *req) {
   if (json != NULL) {
     if (cJSON_IsObject(json)) {
       fan_time_j = cJSON_GetObjectItemCaseSensitive(json, "fan");
+      // Optional duty in percent, full speed by default
+      cJSON *fan_duty_j = cJSON_GetObjectItemCaseSensitive(json, "duty");
+      uint32_t duty = LEDC_DUTY;
+
+      if (cJSON_IsNumber(fan_duty_j) && fan_duty_j->valueint >= 0 && fan_duty_j->valueint <= 100) {
+        duty = (uint32_t)(fan_duty_j->valueint * LEDC_DUTY + 50) / 100;
+      }
       if (cJSON_IsNumber(fan_time_j)) {
-        printf("Running fans: time = %d\n", fan_time_j->valueint);
-        run_fans(fan_time_j->valueint, MANUAL_PRIORITY);
+        printf("Running fans: time = %d, duty = %" PRIu32 "\n", fan_time_j->valueint, duty);
+        run_fans(fan_time_j->valueint, MANUAL_PRIORITY, duty);
       }
     }
   }
@@ -746,6 +2346,69 @@ fans_on_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
+static const char *
+fan_source_name(int priority) {
+  switch (priority) {
+    case MANUAL_PRIORITY:
+      return "manual";
+    case SENSOR_PRIORITY:
+      return "voc";
+    case BED_TEMP_PRIORITY:
+      return "bed_temp";
+    case SCHEDULE_PRIORITY:
+      return "schedule";
+    default:
+      return "none";
+  }
+}
+
+// GET /fans
+static esp_err_t
+get_fans_handler(httpd_req_t *req) {
+  char resp[HTTPD_RESP_SIZE] = {0};
+  cJSON *resp_object_j = cJSON_CreateObject();
+
+  cJSON_AddNumberToObject(resp_object_j, "command_drops", __atomic_load_n(&fanCommandDrops, __ATOMIC_RELAXED));
+
+  struct fan_status status;
+  taskENTER_CRITICAL(&fanStatusLock);
+  status = fanStatus;
+  taskEXIT_CRITICAL(&fanStatusLock);
+
+  TickType_t now = xTaskGetTickCount();
+
+  cJSON_AddStringToObject(resp_object_j, "winner", fan_source_name(status.winner));
+  cJSON_AddNumberToObject(resp_object_j, "duty", status.duty);
+
+  cJSON *sources_j = cJSON_AddObjectToObject(resp_object_j, "sources");
+  for (int priority = MANUAL_PRIORITY; sources_j != NULL && priority < LOWEST_PRIORITY; priority++) {
+    const struct fan_source_demand *demand = &status.sources[priority];
+
+    if (!demand->active) {
+      continue;
+    }
+
+    cJSON *source_j = cJSON_AddObjectToObject(sources_j, fan_source_name(priority));
+    if (source_j != NULL) {
+      cJSON_AddNumberToObject(source_j, "duty", demand->duty);
+      if (demand->timed) {
+        int32_t remaining = (int32_t)(demand->until - now);
+        cJSON_AddNumberToObject(source_j, "remaining_ms", remaining > 0 ? (double)remaining * portTICK_PERIOD_MS : 0);
+      }
+    }
+  }
+
+  cJSON_PrintPreallocated(resp_object_j, resp, HTTPD_RESP_SIZE, false);
+
+  if (resp_object_j != NULL) { cJSON_Delete(resp_object_j); }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+
+  return ESP_OK;
+}
+
 /* URI handler structure for GET /uri */
 static httpd_uri_t set_sensor_thresholds = {
     .uri      = "/sensor",
@@ -778,12 +2441,86 @@ static httpd_uri_t fans_on = {
     .user_ctx = NULL
 };
 
+/* URI handler structure for GET /fans */
+static httpd_uri_t get_fans = {
+    .uri      = "/fans",
+    .method   = HTTP_GET,
+    .handler  = get_fans_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for GET /voc_diagnostics */
+static httpd_uri_t get_voc_diagnostics = {
+    .uri      = "/voc_diagnostics",
+    .method   = HTTP_GET,
+    .handler  = get_voc_diagnostics_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for POST /voc_diagnostics */
+static httpd_uri_t set_voc_diagnostics = {
+    .uri      = "/voc_diagnostics",
+    .method   = HTTP_POST,
+    .handler  = set_voc_diagnostics_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for GET /voc_tuning */
+static httpd_uri_t get_voc_tuning = {
+    .uri      = "/voc_tuning",
+    .method   = HTTP_GET,
+    .handler  = get_voc_tuning_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for POST /voc_tuning */
+static httpd_uri_t set_voc_tuning = {
+    .uri      = "/voc_tuning",
+    .method   = HTTP_POST,
+    .handler  = set_voc_tuning_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for GET /fan_config */
+static httpd_uri_t get_fan_config = {
+    .uri      = "/fan_config",
+    .method   = HTTP_GET,
+    .handler  = get_fan_config_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for POST /fan_config */
+static httpd_uri_t set_fan_config = {
+    .uri      = "/fan_config",
+    .method   = HTTP_POST,
+    .handler  = set_fan_config_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for GET /fan_curves */
+static httpd_uri_t get_fan_curves = {
+    .uri      = "/fan_curves",
+    .method   = HTTP_GET,
+    .handler  = get_fan_curves_handler,
+    .user_ctx = NULL
+};
+
+/* URI handler structure for POST /fan_curves */
+static httpd_uri_t set_fan_curves = {
+    .uri      = "/fan_curves",
+    .method   = HTTP_POST,
+    .handler  = set_fan_curves_handler,
+    .user_ctx = NULL
+};
+
 /* Function for starting the webserver */
 httpd_handle_t
 start_webserver(void) {
     /* Generate default configuration */
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
+    // The default of 8 is less than what start_webserver() registers
+    config.max_uri_handlers = 16;
 
     /* Empty handle to esp_http_server */
     httpd_handle_t server = NULL;
@@ -795,6 +2532,15 @@ start_webserver(void) {
         httpd_register_uri_handler(server, &set_sensor_thresholds);
         httpd_register_uri_handler(server, &update_mqtt_cfg);
         httpd_register_uri_handler(server, &fans_on);
+        httpd_register_uri_handler(server, &get_fans);
+        httpd_register_uri_handler(server, &get_voc_diagnostics);
+        httpd_register_uri_handler(server, &set_voc_diagnostics);
+        httpd_register_uri_handler(server, &get_voc_tuning);
+        httpd_register_uri_handler(server, &set_voc_tuning);
+        httpd_register_uri_handler(server, &get_fan_config);
+        httpd_register_uri_handler(server, &set_fan_config);
+        httpd_register_uri_handler(server, &get_fan_curves);
+        httpd_register_uri_handler(server, &set_fan_curves);
     }
     /* If server failed to start, handle will be NULL */
     ESP_LOGI(TAG, "webserver started");
@@ -1014,6 +2760,13 @@ ledc_init(int gpio_num,
         .hpoint         = 0
     };
     ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+
+    // Duty changes are ramped by the fade engine, see set_fan()
+    ledc_cbs_t ledc_callbacks = {
+        .fade_cb = fan_fade_end_cb
+    };
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+    ESP_ERROR_CHECK(ledc_cb_register(LEDC_MODE, ledc_channel_num, &ledc_callbacks, NULL));
 }
 
 void
@@ -1053,12 +2806,17 @@ app_main(void) {
     }
 
     // fan stuff
+    fanConfigUpdateLock = xSemaphoreCreateMutexStatic(&fanConfigUpdateLockBuffer);
+    configASSERT(fanConfigUpdateLock);
+    struct fan_config fan_config = load_fan_config();
+    write_fan_config(&fan_config);
+
+    fanFadeEndsHandle = xQueueCreateStatic(FAN_FADE_END_EV_NUM, sizeof (uint32_t), fanFadeEndsStorage, &fanFadeEnds);
+    configASSERT(fanFadeEndsHandle);
+
     // Set the LEDC peripheral configuration
     ledc_init(LEDC_OUTPUT_IO, LEDC_CHANNEL, LEDC_TIMER);
 
-    sensorSemaphore = xSemaphoreCreateBinary();
-    xSemaphoreGive(sensorSemaphore);
-
     time_t now;
     struct tm timeinfo;
     time(&now);
@@ -1093,19 +2851,62 @@ app_main(void) {
         }
     }
     fanEventsHandle = xQueueCreateStatic(FAN_EV_NUM, sizeof (struct fan_event), fanQueueStorage, &fanEvents);
-    thresholdEventsHandle = xQueueCreateStatic(10, sizeof (struct threshold_event), thresholdQueueStorage, &thresholdEvents);
-    printerEventsHandle = xQueueCreateStatic(10, sizeof (struct printer_event), printerEventsQueueStorage, &printerEvents);
+    thresholdEventsHandle = xQueueCreateStatic(SENSOR_EVENTS_NUM, sizeof (struct threshold_event), thresholdQueueStorage, &thresholdEvents);
+    printerEventsHandle = xQueueCreateStatic(SENSOR_EVENTS_NUM, sizeof (struct printer_event), printerEventsQueueStorage, &printerEvents);
     mqttHandlerEventsHandle = xQueueCreateStatic(10, sizeof (struct printer_event), mqttHandlerQueueStorage, &mqttHandlerEvents);
+    vocTuningEventsHandle = xQueueCreateStatic(VOC_TUNING_EVENTS_NUM, sizeof (struct voc_tuning), vocTuningQueueStorage, &vocTuningEvents);
+    fanCurvesEventsHandle = xQueueCreateStatic(FAN_CURVES_EVENTS_NUM, sizeof (struct fan_curves), fanCurvesQueueStorage, &fanCurvesEvents);
 
     configASSERT(fanEventsHandle);
     configASSERT(thresholdEventsHandle);
     configASSERT(printerEventsHandle);
     configASSERT(mqttHandlerEventsHandle);
+    configASSERT(vocTuningEventsHandle);
+    configASSERT(fanCurvesEventsHandle);
+
+    vocDiagLock = xSemaphoreCreateMutexStatic(&vocDiagLockBuffer);
+    configASSERT(vocDiagLock);
+
+    vocTuningLock = xSemaphoreCreateMutexStatic(&vocTuningLockBuffer);
+    configASSERT(vocTuningLock);
+    vocTuning = load_voc_tuning();
 
-    i2c_init(I2C_BUS, I2C_SCL_PIN, I2C_SDA_PIN, I2C_FREQ_100K);
+    fanCurvesLock = xSemaphoreCreateMutexStatic(&fanCurvesLockBuffer);
+    configASSERT(fanCurvesLock);
+    fanCurves = load_fan_curves();
+
+    sensorEventsSet = xQueueCreateSet(SENSOR_EVENTS_NUM*2 + VOC_TUNING_EVENTS_NUM + FAN_CURVES_EVENTS_NUM);
+    configASSERT(sensorEventsSet);
+    xQueueAddToSet(thresholdEventsHandle, sensorEventsSet);
+    xQueueAddToSet(printerEventsHandle, sensorEventsSet);
+    xQueueAddToSet(vocTuningEventsHandle, sensorEventsSet);
+    xQueueAddToSet(fanCurvesEventsHandle, sensorEventsSet);
+
+    fanRunnerSet = xQueueCreateSet(FAN_EV_NUM + FAN_FADE_END_EV_NUM);
+    configASSERT(fanRunnerSet);
+    xQueueAddToSet(fanEventsHandle, fanRunnerSet);
+    xQueueAddToSet(fanFadeEndsHandle, fanRunnerSet);
+
+    // Both sensors share the i2cdev port locks and the Sensirion transport
+    i2cdev_init();
 
     // Create the sensors, multiple sensors are possible.
-    sensor = sht3x_init_sensor(I2C_BUS, SHT3x_ADDR_1);
+    sensor = sht3x_init_sensor(I2C_BUS, SHT3x_ADDR_1, I2C_SDA_PIN, I2C_SCL_PIN);
+
+    if (sensor != NULL) {
+      if (sht3x_start_measurement(sensor, SHT3x_PERIODIC_MODE, SHT3x_REPEATABILITY)) {
+        vTaskDelay(sht3x_get_measurement_duration(SHT3x_REPEATABILITY));
+      }
+      else {
+        printf("Could not start periodic measurement\n");
+      }
+    }
+
+#ifdef CONFIG_SGP40_VOC_BENCHMARK
+    uint32_t voc_cycles;
+    sgp40_voc_benchmark(CONFIG_SGP40_VOC_BENCHMARK_SAMPLES, &voc_cycles);
+#endif
+
     initSGP40();
 
     createfanRunnerTask();
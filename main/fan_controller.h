@@ -11,15 +11,18 @@
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_partition.h"
+#include "esp_rom_crc.h"
 #include "esp_sleep.h"
 #include "esp_sntp.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/FreeRTOSConfig.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "mqtt_client.h"
@@ -34,6 +37,7 @@
 #include <esp_wifi.h>
 #include "nvs.h"
 #include <nvs_flash.h>
+#include <math.h>
 #include <sgp40.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -64,6 +68,18 @@
 #define I2C_SCL_PIN   22
 #define I2C_SDA_PIN   21
 
+// The SHT3x measures on its own and is only fetched once per sample, this
+// has to be faster than SENSOR_SAMPLE_PERIOD_MS so there is always a result
+#define SHT3x_PERIODIC_MODE sht3x_periodic_2mps
+#define SHT3x_REPEATABILITY sht3x_high
+
+// What the SGP40 is compensated with. PREVIOUS starts the SGP40 with the
+// last sample's temperature and humidity and fetches the SHT3x while the
+// SGP40 hotplate is running. FRESH fetches the SHT3x first and waits for it.
+#define SENSOR_COMPENSATION_PREVIOUS 1
+#define SENSOR_COMPENSATION_FRESH 2
+#define SENSOR_COMPENSATION SENSOR_COMPENSATION_PREVIOUS
+
 // Separate bus for air quality sensor
 #define AC_I2C_BUS 1
 #define AC_SCL 32
@@ -72,6 +88,42 @@
 #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA2_PSK
 
 #define FAN_EV_NUM 5
+#define FAN_FADE_END_EV_NUM 2
+#define FAN_DEMAND_REFRESH_S 60
+// Smaller duty changes are not sent, so a controller output wandering by a
+// count or two each sample neither floods the fan queue nor keeps the fan
+// fading back and forth
+#define FAN_DEMAND_DEADBAND 4
+#define FAN_CONFIG_NVS_KEY "fan_config"
+#define FAN_CONFIG_DEFAULT { \
+  .pi_enabled = true, \
+  .voc_kp = 4.0f, \
+  .voc_ki = 0.05f, \
+  .bed_temp_kp = 40.0f, \
+  .bed_temp_ki = 0.2f, \
+  .min_duty = 64, \
+  .kick_duty = LEDC_DUTY, \
+  .kick_ms = 1500, \
+  .ramp_up_ms = 4000, \
+  .ramp_down_ms = 2000, \
+}
+#define FAN_KICK_MS_MAX 10000
+// Any gain above this already reaches full duty on a fraction of a unit of
+// error
+#define FAN_GAIN_MAX 1000.0f
+#define FAN_RAMP_MS_MAX 30000
+// Shorter fades are not worth the fade engine, if the fade end interrupt
+// is late by more than FAN_FADE_MARGIN_MS the fade is taken as done anyway
+#define FAN_FADE_MIN_MS 10
+#define FAN_FADE_MARGIN_MS 100
+
+// Fan curves, set through POST /fan_curves and kept in NVS. Breakpoints are
+// in VOC index points or whole degrees C of bed temperature.
+#define FAN_CURVES_NVS_KEY "fan_curves"
+#define FAN_CURVES_EVENTS_NUM 2
+#define FAN_CURVE_POINTS_MAX 8
+#define FAN_CURVE_X_MIN 0
+#define FAN_CURVE_X_MAX 1000
 #define HTTPD_RESP_SIZE 1000
 #define MAX_CRON_SPECS 5
 
@@ -83,6 +135,40 @@
 
 #define TASK_STACK_SIZE 5000
 
+// The VOC algorithm is calibrated for exactly one sample per interval
+#define SENSOR_SAMPLE_PERIOD_MS ((int)(VocAlgorithm_SAMPLING_INTERVAL * 1000))
+// Longest interval, in sample periods, the PI controllers integrate over
+#define SENSOR_DT_MAX_PERIODS 4
+#define SENSOR_EVENTS_NUM 10
+
+// The learned VOC algorithm state is only worth keeping after 3 hours of
+// operation and only valid for an interruption of up to 10 minutes. It is
+// checkpointed to RTC memory often, and to NVS often enough that a short
+// power cut still finds a usable one.
+#define VOC_STATE_MIN_LEARNED_S (3 * 60 * 60)
+#define VOC_STATE_MAX_AGE_S (10 * 60)
+#define VOC_STATE_RTC_INTERVAL_S 60
+#define VOC_STATE_NVS_INTERVAL_S (5 * 60)
+#define VOC_STATE_MAGIC 0x564f4331 // "VOC1"
+#define VOC_STATE_NVS_KEY "voc_state"
+
+// VOC algorithm tuning, set through POST /voc_tuning and kept in NVS. The
+// ranges are the ones documented for VocAlgorithm_set_tuning_parameters().
+#define VOC_TUNING_NVS_KEY "voc_tuning"
+#define VOC_TUNING_EVENTS_NUM 2
+#define VOC_INDEX_OFFSET_MIN 1
+#define VOC_INDEX_OFFSET_MAX 250
+#define VOC_LEARNING_TIME_HOURS_MIN 1
+#define VOC_LEARNING_TIME_HOURS_MAX 72
+#define VOC_GATING_MAX_DURATION_MINUTES_MIN 0
+#define VOC_GATING_MAX_DURATION_MINUTES_MAX 720
+#define VOC_STD_INITIAL_MIN 10
+#define VOC_STD_INITIAL_MAX 500
+
+// Samples of VOC algorithm internals kept for GET /voc_diagnostics while the
+// stream is enabled, about a minute at 1 Hz
+#define VOC_DIAG_RING_SIZE 64
+
 #define VOC_MAX_THRESHOLD_DEFAULT 140
 #define BED_TEMPER_MAX_THRESHOLD_DEFAULT 83.0f
 
@@ -195,11 +281,14 @@ unsigned char bbl_ca_pem[] = {
 };
 unsigned int bbl_ca_pem_len = 1238;
 
+// Every source of fan demand, the number doubles as its priority when two
+// sources ask for the same duty. LOWEST_PRIORITY means no source.
 typedef enum {
   MANUAL_PRIORITY = 1,
   SENSOR_PRIORITY = 2,
   BED_TEMP_PRIORITY = 3,
-  LOWEST_PRIORITY = 4
+  SCHEDULE_PRIORITY = 4,
+  LOWEST_PRIORITY = 5
 } control_priority;
 
 typedef enum {
@@ -212,6 +301,97 @@ struct fan_event {
   int fan_delay;
   int run_forever;
   int priority;
+  uint32_t duty; // 0..LEDC_DUTY, for FAN_ON
+};
+
+// What one source currently asks the fan runner task for. A timed demand
+// expires at until, the others last until the source sends FAN_OFF.
+struct fan_source_demand {
+  bool active;
+  bool timed;
+  uint32_t duty;
+  TickType_t until;
+};
+
+// The fan runner task's demand table and the result of arbitrating it. An
+// active manual demand always wins, even one for a lower duty or for duty 0,
+// so POST /fans can override the automatic sources. Among the others the
+// highest duty wins, on equal duty the one with the highest priority (lowest
+// number). winner is LOWEST_PRIORITY when no source wants the fans on.
+struct fan_status {
+  int winner;
+  uint32_t duty;
+  struct fan_source_demand sources[LOWEST_PRIORITY];
+};
+
+// The duty one source wants, as last sent to the fan runner task. Commands
+// are only sent when it changes by FAN_DEMAND_DEADBAND or more, turns the
+// fan on or off or reaches full duty, and are refreshed every
+// FAN_DEMAND_REFRESH_S while on so the fan runner task never stays out of
+// step for long.
+struct fan_demand {
+  int priority;
+  uint32_t duty;
+  TickType_t sent_at;
+};
+
+// How the VOC and bed temperature sources turn their readings into a duty,
+// set through POST /fan_config and kept in NVS.
+//
+// With pi_enabled each source runs a PI controller on how far its reading is
+// above the min threshold. kp is in duty steps (of LEDC_DUTY) per unit of
+// error, ki in duty steps per unit of error and second. Above the max
+// threshold the source asks for full duty. The fans start once the output
+// reaches min_duty and stop when it falls below half of it, in between they
+// run at least at min_duty. Without pi_enabled the sources switch between
+// off and full duty at the thresholds.
+//
+// Whenever the fans start from standstill they are driven at kick_duty for
+// kick_ms first, so a low duty still spins them up. kick_duty is never below
+// min_duty.
+//
+// Duty changes are faded in by the LEDC hardware, ramp_up_ms and
+// ramp_down_ms being how long a fade over the whole range takes in each
+// direction. Smaller changes take proportionally less, 0 switches at once.
+struct fan_config {
+  bool pi_enabled;
+  float voc_kp;
+  float voc_ki;
+  float bed_temp_kp;
+  float bed_temp_ki;
+  uint32_t min_duty;
+  uint32_t kick_duty;
+  uint32_t kick_ms;
+  uint32_t ramp_up_ms;
+  uint32_t ramp_down_ms;
+};
+
+// State of one PI controller, the integral term is in duty steps
+struct pi_controller {
+  float integral;
+  bool running;
+};
+
+struct fan_curve_point {
+  int16_t x;
+  uint16_t duty;
+};
+
+// Duty as a function of one reading, linear between the breakpoints, which
+// are sorted by x, and flat beyond the first and last. No points is always
+// off.
+struct fan_curve {
+  uint8_t points;
+  struct fan_curve_point point[FAN_CURVE_POINTS_MAX];
+};
+
+// With enabled the VOC and bed temperature sources take their duty from
+// these curves instead of from fan_config. Replaced as a whole by POST
+// /fan_curves, through a queue to the sensor manager task.
+struct fan_curves {
+  bool enabled;
+  struct fan_curve voc;
+  struct fan_curve bed_temp;
 };
 
 struct threshold_event {
@@ -221,6 +401,15 @@ struct threshold_event {
   double bed_temper_min_threshold;
 };
 
+// The VocAlgorithm_set_tuning_parameters() arguments, also the NVS blob and
+// the message that hands new values to the sensor manager task
+struct voc_tuning {
+  int32_t voc_index_offset;
+  int32_t learning_time_hours;
+  int32_t gating_max_duration_minutes;
+  int32_t std_initial;
+};
+
 struct printer_event {
   double bed_temper;
 };
@@ -229,9 +418,76 @@ struct mqtt_handler_event {
   int restart;
 };
 
+// How well the sensor manager task keeps to SENSOR_SAMPLE_PERIOD_MS. All
+// times are in microseconds, jitter is the distance from the nominal period
+// and overruns counts deadlines that were missed by a whole period or more.
+struct sampler_stats {
+  uint32_t samples;
+  uint32_t overruns;
+  int32_t last_period_us;
+  int32_t min_period_us;
+  int32_t max_period_us;
+  int32_t max_jitter_us;
+  int32_t mean_jitter_us;
+};
+
+// Checkpoint of the VOC algorithm state. learned_s is how long the algorithm
+// has been learning, including time before earlier restores, and saved_at is
+// the wall clock time of the checkpoint.
+struct voc_state {
+  uint32_t magic;
+  int32_t state0;
+  int32_t state1;
+  uint32_t learned_s;
+  int64_t saved_at;
+  uint32_t crc;
+};
+
+// Time spent in each stage of one acquisition, in microseconds
+struct acquisition_timings {
+  int32_t sgp40_start_us;
+  int32_t sht3x_fetch_us;
+  int32_t sgp40_read_us;
+  int32_t total_us;
+};
+
+// One sample of the VOC algorithm internals, with the SRAW and index that
+// went with it. seq is the seq of the sensor snapshot it belongs to.
+struct voc_diag_record {
+  uint32_t seq;
+  int64_t sample_time_us;
+  uint16_t raw_voc;
+  int32_t voc_index;
+  VocAlgorithmDiagnostics diag;
+};
+
+// One completed sample from the sensor manager task. seq counts published
+// samples (0 means nothing has been published yet) and sample_time_us is the
+// esp_timer time the sample was taken at, so readers can tell how stale it is.
+struct sensor_snapshot {
+  uint32_t seq;
+  int64_t sample_time_us;
+  // Raw SHT3x ticks, only converted to units for presentation
+  uint16_t temperature_ticks;
+  uint16_t humidity_ticks;
+  int32_t voc_index;
+  uint16_t raw_voc;
+  bool climate_valid;
+  bool voc_valid;
+  bool raw_voc_valid;
+  struct sampler_stats sampler;
+  struct acquisition_timings timings;
+  sensirion_i2c_stats_t sht3x_i2c;
+  sensirion_i2c_stats_t sgp40_i2c;
+  sensirion_i2c_health_t sht3x_health;
+  sensirion_i2c_health_t sgp40_health;
+  bool voc_diag_valid;
+  VocAlgorithmDiagnostics voc_diag;
+};
+
 static void wifi_init_sta(void);
-static void run_fans_forever();
-static void run_fans(int, int);
-static void stop_running_fans(int);
+static bool run_fans_forever(int, uint32_t);
+static bool run_fans(int, int, uint32_t);
+static bool stop_running_fans(int);
 static void obtain_time(void);
 static void initialize_sntp(void);
@@ -0,0 +1,335 @@
+/*
+ * Multi-instance VOC algorithm, see voc_batch.h.
+ *
+ * Each stage of VocAlgorithm_process is a separate pass over the instance
+ * arrays, so the simple stages compile to straight vector loops. The fixed
+ * point kernels come from the sgp40 component itself and the operations are
+ * done in the same order as in sensirion_voc_algorithm.c, which is what
+ * keeps the results bit identical. Any change to one has to be mirrored in
+ * the other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "voc_batch.h"
+#include "sensirion_voc_fix16.h"
+
+#define STATE_ARRAYS(X) \
+  X(uptime)                        \
+  X(sraw)                          \
+  X(voc_index)                     \
+  X(active)                        \
+  X(mve_initialized)               \
+  X(mve_mean)                      \
+  X(mve_sraw_offset)               \
+  X(mve_std)                       \
+  X(mve_uptime_gamma)              \
+  X(mve_uptime_gating)             \
+  X(mve_gating_duration_minutes)   \
+  X(mox_sraw_std)                  \
+  X(mox_sraw_mean)                 \
+  X(lp_initialized)                \
+  X(lp_x1)                         \
+  X(lp_x2)                         \
+  X(lp_x3)
+
+// Takes the tuning and the coefficients derived from it from a scalar
+// instance, so they come from VocAlgorithm__set_sampling_interval and
+// cannot drift from the ones VocAlgorithm_process uses
+static void
+copy_coefficients(VocBatch *batch, const VocAlgorithmParams *reference) {
+  batch->voc_index_offset = reference->mVoc_Index_Offset;
+  batch->tau_mean_variance_hours = reference->mTau_Mean_Variance_Hours;
+  batch->gating_max_duration_minutes = reference->mGating_Max_Duration_Minutes;
+  batch->sraw_std_initial = reference->mSraw_Std_Initial;
+  batch->gamma = reference->m_Mean_Variance_Estimator___Gamma;
+  batch->gamma_initial_mean = reference->m_Mean_Variance_Estimator___Gamma_Initial_Mean;
+  batch->gamma_initial_variance = reference->m_Mean_Variance_Estimator___Gamma_Initial_Variance;
+  batch->lp_a1 = reference->m_Adaptive_Lowpass__A1;
+  batch->lp_a2 = reference->m_Adaptive_Lowpass__A2;
+}
+
+// VocAlgorithm__init_instances for every instance
+static void
+init_instances(VocBatch *batch) {
+  for (size_t i = 0; i < batch->count; i++) {
+    batch->mve_initialized[i] = 0;
+    batch->mve_mean[i] = F16(0.);
+    batch->mve_sraw_offset[i] = F16(0.);
+    batch->mve_std[i] = batch->sraw_std_initial;
+    batch->mve_uptime_gamma[i] = F16(0.);
+    batch->mve_uptime_gating[i] = F16(0.);
+    batch->mve_gating_duration_minutes[i] = F16(0.);
+    batch->mox_sraw_std[i] = batch->sraw_std_initial;
+    batch->mox_sraw_mean[i] = F16(0.);
+    batch->lp_initialized[i] = 0;
+  }
+}
+
+int
+VocBatch_init(VocBatch *batch, size_t count) {
+  memset(batch, 0, sizeof *batch);
+  batch->count = count;
+
+#define ALLOC_ARRAY(name)                                              \
+  batch->name = calloc(count ? count : 1, sizeof *batch->name);        \
+  if (batch->name == NULL) {                                           \
+    VocBatch_free(batch);                                              \
+    return -1;                                                         \
+  }
+  STATE_ARRAYS(ALLOC_ARRAY)
+#undef ALLOC_ARRAY
+
+  VocAlgorithmParams reference;
+  VocAlgorithm_init(&reference);
+  copy_coefficients(batch, &reference);
+
+  // uptime, sraw and voc_index start at 0 from calloc
+  init_instances(batch);
+  return 0;
+}
+
+void
+VocBatch_free(VocBatch *batch) {
+#define FREE_ARRAY(name) \
+  free(batch->name);     \
+  batch->name = NULL;
+  STATE_ARRAYS(FREE_ARRAY)
+#undef FREE_ARRAY
+  batch->count = 0;
+}
+
+void
+VocBatch_set_tuning_parameters(VocBatch *batch,
+                               int32_t voc_index_offset,
+                               int32_t learning_time_hours,
+                               int32_t gating_max_duration_minutes,
+                               int32_t std_initial) {
+  VocAlgorithmParams reference;
+  VocAlgorithm_init(&reference);
+  VocAlgorithm_set_tuning_parameters(&reference,
+                                     voc_index_offset,
+                                     learning_time_hours,
+                                     gating_max_duration_minutes,
+                                     std_initial);
+  copy_coefficients(batch, &reference);
+  init_instances(batch);
+}
+
+void
+VocBatch_set_states(VocBatch *batch, size_t instance, int32_t state0, int32_t state1) {
+  batch->mve_mean[instance] = state0;
+  batch->mve_std[instance] = state1;
+  batch->mve_uptime_gamma[instance] = F16(VocAlgorithm_PERSISTENCE_UPTIME_GAMMA);
+  batch->mve_initialized[instance] = 1;
+  batch->sraw[instance] = state0;
+}
+
+void
+VocBatch_get_states(const VocBatch *batch, size_t instance, int32_t *state0, int32_t *state1) {
+  *state0 = batch->mve_mean[instance] + batch->mve_sraw_offset[instance];
+  *state1 = batch->mve_std[instance];
+}
+
+static inline fix16_t
+mve_sigmoid(fix16_t L, fix16_t X0, fix16_t K, fix16_t sample) {
+  fix16_t x = fix16_mul(K, (sample - X0));
+
+  if (x < F16(-50.)) {
+    return L;
+  } else if (x > F16(50.)) {
+    return F16(0.);
+  } else {
+    return fix16_div(L, (F16(1.) + fix16_exp(x)));
+  }
+}
+
+// VocAlgorithm__mean_variance_estimator__process for one instance
+static inline void
+mve_process(VocBatch *batch, size_t i, fix16_t sraw, fix16_t voc_index_from_prior) {
+  if (!batch->mve_initialized[i]) {
+    batch->mve_initialized[i] = 1;
+    batch->mve_sraw_offset[i] = sraw;
+    batch->mve_mean[i] = F16(0.);
+    return;
+  }
+
+  fix16_t mean = batch->mve_mean[i];
+  fix16_t std = batch->mve_std[i];
+
+  if (mean >= F16(100.) || mean <= F16(-100.)) {
+    batch->mve_sraw_offset[i] = batch->mve_sraw_offset[i] + mean;
+    mean = F16(0.);
+  }
+  sraw = sraw - batch->mve_sraw_offset[i];
+
+  // _calculate_gamma
+  const fix16_t uptime_limit = F16((VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__FIX16_MAX - VocAlgorithm_SAMPLING_INTERVAL));
+  fix16_t uptime_gamma = batch->mve_uptime_gamma[i];
+  fix16_t uptime_gating = batch->mve_uptime_gating[i];
+
+  if (uptime_gamma < uptime_limit) {
+    uptime_gamma = uptime_gamma + F16(VocAlgorithm_SAMPLING_INTERVAL);
+  }
+  if (uptime_gating < uptime_limit) {
+    uptime_gating = uptime_gating + F16(VocAlgorithm_SAMPLING_INTERVAL);
+  }
+
+  fix16_t sigmoid_gamma_mean =
+      mve_sigmoid(F16(1.), F16(VocAlgorithm_INIT_DURATION_MEAN), F16(VocAlgorithm_INIT_TRANSITION_MEAN), uptime_gamma);
+  fix16_t gamma_mean = batch->gamma + fix16_mul((batch->gamma_initial_mean - batch->gamma), sigmoid_gamma_mean);
+  fix16_t gating_threshold_mean =
+      F16(VocAlgorithm_GATING_THRESHOLD) +
+      fix16_mul(F16((VocAlgorithm_GATING_THRESHOLD_INITIAL - VocAlgorithm_GATING_THRESHOLD)),
+                mve_sigmoid(F16(1.), F16(VocAlgorithm_INIT_DURATION_MEAN), F16(VocAlgorithm_INIT_TRANSITION_MEAN), uptime_gating));
+  fix16_t sigmoid_gating_mean =
+      mve_sigmoid(F16(1.), gating_threshold_mean, F16(VocAlgorithm_GATING_THRESHOLD_TRANSITION), voc_index_from_prior);
+  fix16_t gamma_mean_scaled = fix16_mul(sigmoid_gating_mean, gamma_mean);
+
+  fix16_t sigmoid_gamma_variance =
+      mve_sigmoid(F16(1.), F16(VocAlgorithm_INIT_DURATION_VARIANCE), F16(VocAlgorithm_INIT_TRANSITION_VARIANCE), uptime_gamma);
+  fix16_t gamma_variance =
+      batch->gamma + fix16_mul((batch->gamma_initial_variance - batch->gamma), (sigmoid_gamma_variance - sigmoid_gamma_mean));
+  fix16_t gating_threshold_variance =
+      F16(VocAlgorithm_GATING_THRESHOLD) +
+      fix16_mul(F16((VocAlgorithm_GATING_THRESHOLD_INITIAL - VocAlgorithm_GATING_THRESHOLD)),
+                mve_sigmoid(F16(1.), F16(VocAlgorithm_INIT_DURATION_VARIANCE), F16(VocAlgorithm_INIT_TRANSITION_VARIANCE), uptime_gating));
+  fix16_t sigmoid_gating_variance =
+      mve_sigmoid(F16(1.), gating_threshold_variance, F16(VocAlgorithm_GATING_THRESHOLD_TRANSITION), voc_index_from_prior);
+  fix16_t gamma_variance_scaled = fix16_mul(sigmoid_gating_variance, gamma_variance);
+
+  fix16_t gating_duration =
+      batch->mve_gating_duration_minutes[i] +
+      fix16_mul(F16((VocAlgorithm_SAMPLING_INTERVAL / 60.)),
+                (fix16_mul((F16(1.) - sigmoid_gating_mean), F16((1. + VocAlgorithm_GATING_MAX_RATIO))) -
+                 F16(VocAlgorithm_GATING_MAX_RATIO)));
+
+  if (gating_duration < F16(0.)) {
+    gating_duration = F16(0.);
+  }
+  if (gating_duration > batch->gating_max_duration_minutes) {
+    uptime_gating = F16(0.);
+  }
+
+  batch->mve_uptime_gamma[i] = uptime_gamma;
+  batch->mve_uptime_gating[i] = uptime_gating;
+  batch->mve_gating_duration_minutes[i] = gating_duration;
+
+  // Mean and variance update
+  fix16_t delta_sgp = fix16_div((sraw - mean), F16(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING));
+  fix16_t c = delta_sgp < F16(0.) ? (std - delta_sgp) : (std + delta_sgp);
+  fix16_t additional_scaling = c > F16(1440.) ? F16(4.) : F16(1.);
+
+  batch->mve_std[i] = fix16_mul(
+      fix16_sqrt(fix16_mul(additional_scaling,
+                           (F16(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING) - gamma_variance_scaled))),
+      fix16_sqrt(fix16_mul(std,
+                           fix16_div(std, fix16_mul(F16(VocAlgorithm_MEAN_VARIANCE_ESTIMATOR__GAMMA_SCALING),
+                                                    additional_scaling))) +
+                 fix16_mul(fix16_div(fix16_mul(gamma_variance_scaled, delta_sgp), additional_scaling), delta_sgp)));
+  batch->mve_mean[i] = mean + fix16_mul(gamma_mean_scaled, delta_sgp);
+}
+
+void
+VocBatch_process(VocBatch *batch, size_t count, const int32_t *sraw, int32_t *voc_index) {
+  if (count > batch->count) {
+    count = batch->count;
+  }
+
+  // Initial blackout and input conditioning
+  for (size_t i = 0; i < count; i++) {
+    uint8_t active = batch->uptime[i] > F16(VocAlgorithm_INITIAL_BLACKOUT);
+    int32_t s = sraw[i];
+
+    batch->active[i] = active;
+    if (!active) {
+      batch->uptime[i] = batch->uptime[i] + F16(VocAlgorithm_SAMPLING_INTERVAL);
+    } else if (s > 0 && s < 65000) {
+      s = s < 20001 ? 20001 : s;
+      s = s > 52767 ? 52767 : s;
+      batch->sraw[i] = fix16_from_int((s - 20000));
+    }
+  }
+
+  // MOX model
+  for (size_t i = 0; i < count; i++) {
+    if (batch->active[i]) {
+      batch->voc_index[i] =
+          fix16_mul(fix16_div((batch->sraw[i] - batch->mox_sraw_mean[i]),
+                              (-(batch->mox_sraw_std[i] + F16(VocAlgorithm_SRAW_STD_BONUS)))),
+                    F16(VocAlgorithm_VOC_INDEX_GAIN));
+    }
+  }
+
+  // Scaled sigmoid, whose offset terms are the same for every instance
+  const fix16_t shift =
+      fix16_div((F16(VocAlgorithm_SIGMOID_L) - fix16_mul(F16(5.), batch->voc_index_offset)), F16(4.));
+  const fix16_t offset_scale = fix16_div(batch->voc_index_offset, F16(VocAlgorithm_VOC_INDEX_OFFSET_DEFAULT));
+
+  for (size_t i = 0; i < count; i++) {
+    if (!batch->active[i]) {
+      continue;
+    }
+
+    fix16_t sample = batch->voc_index[i];
+    fix16_t x = fix16_mul(F16(VocAlgorithm_SIGMOID_K), (sample - F16(VocAlgorithm_SIGMOID_X0)));
+
+    if (x < F16(-50.)) {
+      batch->voc_index[i] = F16(VocAlgorithm_SIGMOID_L);
+    } else if (x > F16(50.)) {
+      batch->voc_index[i] = F16(0.);
+    } else if (sample >= F16(0.)) {
+      batch->voc_index[i] = fix16_div((F16(VocAlgorithm_SIGMOID_L) + shift), (F16(1.) + fix16_exp(x))) - shift;
+    } else {
+      batch->voc_index[i] = fix16_mul(offset_scale, fix16_div(F16(VocAlgorithm_SIGMOID_L), (F16(1.) + fix16_exp(x))));
+    }
+  }
+
+  // Adaptive lowpass
+  for (size_t i = 0; i < count; i++) {
+    if (!batch->active[i]) {
+      continue;
+    }
+
+    fix16_t sample = batch->voc_index[i];
+
+    if (!batch->lp_initialized[i]) {
+      batch->lp_x1[i] = sample;
+      batch->lp_x2[i] = sample;
+      batch->lp_x3[i] = sample;
+      batch->lp_initialized[i] = 1;
+    }
+
+    fix16_t x1 = fix16_mul((F16(1.) - batch->lp_a1), batch->lp_x1[i]) + fix16_mul(batch->lp_a1, sample);
+    fix16_t x2 = fix16_mul((F16(1.) - batch->lp_a2), batch->lp_x2[i]) + fix16_mul(batch->lp_a2, sample);
+    fix16_t abs_delta = x1 - x2;
+
+    if (abs_delta < F16(0.)) {
+      abs_delta = -abs_delta;
+    }
+
+    fix16_t f1 = fix16_exp(fix16_mul(F16(VocAlgorithm_LP_ALPHA), abs_delta));
+    fix16_t tau_a = fix16_mul(F16((VocAlgorithm_LP_TAU_SLOW - VocAlgorithm_LP_TAU_FAST)), f1) + F16(VocAlgorithm_LP_TAU_FAST);
+    fix16_t a3 = fix16_div(F16(VocAlgorithm_SAMPLING_INTERVAL), (F16(VocAlgorithm_SAMPLING_INTERVAL) + tau_a));
+    fix16_t x3 = fix16_mul((F16(1.) - a3), batch->lp_x3[i]) + fix16_mul(a3, sample);
+
+    batch->lp_x1[i] = x1;
+    batch->lp_x2[i] = x2;
+    batch->lp_x3[i] = x3;
+    batch->voc_index[i] = x3 < F16(0.5) ? F16(0.5) : x3;
+  }
+
+  // Mean and variance estimator, feeding back into the MOX model
+  for (size_t i = 0; i < count; i++) {
+    if (batch->active[i] && batch->sraw[i] > F16(0.)) {
+      mve_process(batch, i, batch->sraw[i], batch->voc_index[i]);
+      batch->mox_sraw_std[i] = batch->mve_std[i];
+      batch->mox_sraw_mean[i] = batch->mve_mean[i] + batch->mve_sraw_offset[i];
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    voc_index[i] = fix16_cast_to_int((batch->voc_index[i] + F16(0.5)));
+  }
+}
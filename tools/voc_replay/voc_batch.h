@@ -0,0 +1,92 @@
+/*
+ * Multi-instance VOC algorithm for batch reprocessing of many sensors.
+ *
+ * Keeps the state of N independent VocAlgorithm instances in a
+ * struct-of-arrays layout and advances all of them one sample per call.
+ * Every instance produces exactly the same indices as VocAlgorithmParams
+ * fed through VocAlgorithm_process, which voc_fleet --verify checks.
+ */
+
+#ifndef VOC_BATCH_H_
+#define VOC_BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensirion_voc_algorithm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  size_t count;
+
+  // Tuning and the coefficients derived from it, shared by all instances
+  fix16_t voc_index_offset;
+  fix16_t tau_mean_variance_hours;
+  fix16_t gating_max_duration_minutes;
+  fix16_t sraw_std_initial;
+  fix16_t gamma;
+  fix16_t gamma_initial_mean;
+  fix16_t gamma_initial_variance;
+  fix16_t lp_a1;
+  fix16_t lp_a2;
+
+  // Per instance state, one array entry per instance
+  fix16_t *uptime;
+  fix16_t *sraw;
+  fix16_t *voc_index;
+  uint8_t *active;
+  uint8_t *mve_initialized;
+  fix16_t *mve_mean;
+  fix16_t *mve_sraw_offset;
+  fix16_t *mve_std;
+  fix16_t *mve_uptime_gamma;
+  fix16_t *mve_uptime_gating;
+  fix16_t *mve_gating_duration_minutes;
+  fix16_t *mox_sraw_std;
+  fix16_t *mox_sraw_mean;
+  uint8_t *lp_initialized;
+  fix16_t *lp_x1;
+  fix16_t *lp_x2;
+  fix16_t *lp_x3;
+} VocBatch;
+
+/**
+ * Allocates and initialises count instances with the default tuning, like
+ * VocAlgorithm_init. Returns 0 on success, -1 if out of memory.
+ */
+int VocBatch_init(VocBatch *batch, size_t count);
+
+void VocBatch_free(VocBatch *batch);
+
+/**
+ * Sets the tuning of all instances, like VocAlgorithm_set_tuning_parameters.
+ */
+void VocBatch_set_tuning_parameters(VocBatch *batch,
+                                    int32_t voc_index_offset,
+                                    int32_t learning_time_hours,
+                                    int32_t gating_max_duration_minutes,
+                                    int32_t std_initial);
+
+/**
+ * Warm starts one instance, like VocAlgorithm_set_states.
+ */
+void VocBatch_set_states(VocBatch *batch, size_t instance, int32_t state0, int32_t state1);
+
+void VocBatch_get_states(const VocBatch *batch, size_t instance, int32_t *state0, int32_t *state1);
+
+/**
+ * Advances instances [0, count) by one sample each. sraw and voc_index hold
+ * one entry per instance. Instances from count on are left untouched, so
+ * logs of different length can be processed together by ordering them
+ * longest first and shrinking count as they run out.
+ */
+void VocBatch_process(VocBatch *batch, size_t count, const int32_t *sraw, int32_t *voc_index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VOC_BATCH_H_ */
@@ -0,0 +1,239 @@
+/*
+ * Benchmarks the per-sample cost of the fixed point VOC algorithm.
+ *
+ * Usage: voc_bench [samples] [runs] [instances]
+ *
+ * Feeds a synthetic SRAW signal (a slow drift with occasional VOC events and
+ * noise, generated ahead of time) through VocAlgorithm_process and reports
+ * the best and mean ns/sample over the runs. The same is done for a signal
+ * that stays below the 20001 ticks SRAW is clamped to, which drives the
+ * algorithm's estimator into overflow. The same samples are then split
+ * over the given number of instances of the batch engine. The index
+ * checksums are printed so the work cannot be optimised away and results can
+ * be compared across changes to the algorithm. On x86 the single instance
+ * cost is also given in TSC cycles, to compare with the cycle counts of the
+ * on-target benchmark (CONFIG_SGP40_VOC_BENCHMARK).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "sensirion_voc_algorithm.h"
+#include "voc_batch.h"
+
+#define DEFAULT_SAMPLES (7 * 24 * 3600) // one week at 1 Hz
+#define DEFAULT_RUNS 5
+#define DEFAULT_INSTANCES 1024
+
+static uint32_t
+next_random(uint32_t *state) {
+  *state = *state * 1664525u + 1013904223u;
+  return *state >> 8;
+}
+
+static void
+generate_sraw(int32_t *sraw, size_t count) {
+  uint32_t rng = 0x5eed;
+  int32_t event = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    // Baseline around 30000 ticks drifting over the day
+    int32_t baseline = 30000 + (int32_t)((i / 60) % 1440) - 720;
+
+    // Now and then a VOC event pulls SRAW down and decays again
+    if (event == 0 && next_random(&rng) % 7200 == 0) {
+      event = 2000 + (int32_t)(next_random(&rng) % 3000);
+    }
+    event = event * 255 / 256;
+
+    int32_t noise = (int32_t)(next_random(&rng) % 41) - 20;
+    sraw[i] = baseline - event + noise;
+  }
+}
+
+// A sensor stuck far below the 20001 ticks the algorithm clamps SRAW to,
+// after the first hour. This saturates the mean/variance estimator, which
+// then works on FIX16_OVERFLOW.
+static void
+generate_clamped_sraw(int32_t *sraw, size_t count) {
+  uint32_t rng = 0xc1a4;
+
+  for (size_t i = 0; i < count; i++) {
+    int32_t level = i < 3600 ? 30000 : i < 7200 ? 30000 - (int32_t)(i - 3600) * 4 : 15600;
+    int32_t noise = (int32_t)(next_random(&rng) % 401) - 200;
+    sraw[i] = level + noise;
+  }
+}
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void
+bench_single(const char *label, const int32_t *sraw, size_t count, int runs) {
+  double best = 0;
+  double total = 0;
+  double best_cycles = 0;
+  uint64_t checksum = 0;
+
+  for (int run = 0; run < runs; run++) {
+    VocAlgorithmParams params;
+    struct timespec start, end;
+    uint64_t sum = 0;
+
+    VocAlgorithm_init(&params);
+
+#ifdef HAVE_TSC
+    uint64_t start_cycles = __rdtsc();
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; i++) {
+      int32_t voc_index;
+      VocAlgorithm_process(&params, sraw[i], &voc_index);
+      sum += (uint32_t)voc_index;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#ifdef HAVE_TSC
+    double cycles = (double)(__rdtsc() - start_cycles) / count;
+#else
+    double cycles = 0;
+#endif
+
+    double per_sample = elapsed_ns(&start, &end) / count;
+
+    if (run == 0 || per_sample < best) {
+      best = per_sample;
+      best_cycles = cycles;
+    }
+    total += per_sample;
+    checksum = sum;
+  }
+
+  printf("%-12s %zu samples x %d runs, best %.1f ns/sample, mean %.1f ns/sample, "
+         "%.0f samples/s, checksum %llu\n",
+         label,
+         count,
+         runs,
+         best,
+         total / runs,
+         1e9 / best,
+         (unsigned long long)checksum);
+#ifdef HAVE_TSC
+  printf("             best %.0f TSC cycles/sample\n", best_cycles);
+#else
+  (void)best_cycles;
+#endif
+}
+
+int
+main(int argc, char **argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_SAMPLES;
+  int runs = argc > 2 ? atoi(argv[2]) : DEFAULT_RUNS;
+  size_t instances = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_INSTANCES;
+
+  if (count == 0 || runs <= 0 || instances == 0) {
+    fprintf(stderr, "usage: %s [samples] [runs] [instances]\n", argv[0]);
+    return 2;
+  }
+
+  int32_t *sraw = malloc(count * sizeof *sraw);
+
+  if (sraw == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  generate_sraw(sraw, count);
+
+  double best = 0;
+  double total = 0;
+  uint64_t checksum = 0;
+
+  bench_single("fixed point:", sraw, count, runs);
+
+  // A sensor stuck below the clamp must not cost more than a working one
+  int32_t *clamped = malloc(count * sizeof *clamped);
+
+  if (clamped == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  generate_clamped_sraw(clamped, count);
+  bench_single("clamped:", clamped, count, runs);
+  free(clamped);
+
+  // The same signal, instance i starting at sample i * steps
+  size_t steps = count / instances;
+
+  if (steps == 0) {
+    free(sraw);
+    return 0;
+  }
+
+  int32_t *step_sraw = malloc(instances * sizeof *step_sraw);
+  int32_t *step_index = malloc(instances * sizeof *step_index);
+
+  if (step_sraw == NULL || step_index == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  best = 0;
+  total = 0;
+
+  for (int run = 0; run < runs; run++) {
+    VocBatch batch;
+    struct timespec start, end;
+    uint64_t sum = 0;
+
+    if (VocBatch_init(&batch, instances) != 0) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t t = 0; t < steps; t++) {
+      for (size_t i = 0; i < instances; i++) {
+        step_sraw[i] = sraw[i * steps + t];
+      }
+      VocBatch_process(&batch, instances, step_sraw, step_index);
+      for (size_t i = 0; i < instances; i++) {
+        sum += (uint32_t)step_index[i];
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    VocBatch_free(&batch);
+
+    double per_sample = elapsed_ns(&start, &end) / (steps * instances);
+
+    if (run == 0 || per_sample < best) {
+      best = per_sample;
+    }
+    total += per_sample;
+    checksum = sum;
+  }
+
+  printf("batch:       %zu instances x %zu samples x %d runs, best %.1f ns/sample, mean %.1f ns/sample, "
+         "%.0f samples/s, checksum %llu\n",
+         instances,
+         steps,
+         runs,
+         best,
+         total / runs,
+         1e9 / best,
+         (unsigned long long)checksum);
+
+  free(step_sraw);
+  free(step_index);
+  free(sraw);
+  return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Runs the fixed point and the float VOC backends over recorded SRAW traces
+ * and bounds how far their indices diverge.
+ *
+ * Usage: voc_conformance [-m max_divergence] input ...
+ *
+ * Every input is one trace (see voc_log.h), each starting from a freshly
+ * initialised algorithm. Reports per trace the largest and mean absolute
+ * index difference, how many samples differ, and the time per sample of
+ * each backend. Fails if any index differs by more than max_divergence
+ * (default DEFAULT_MAX_DIVERGENCE).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensirion_voc_algorithm.h"
+#include "voc_log.h"
+
+// Over a week of synthetic data the backends differ by up to 3. Traces
+// clamped at the SRAW minimum for a while overflow the fixed point
+// estimator and differ by up to 8, they need -m 8.
+#define DEFAULT_MAX_DIVERGENCE 3
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+int
+main(int argc, char **argv) {
+  long max_divergence = DEFAULT_MAX_DIVERGENCE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:")) != -1) {
+    switch (opt) {
+      case 'm':
+        max_divergence = strtol(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-m max_divergence] input ...\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind == argc) {
+    fprintf(stderr, "usage: %s [-m max_divergence] input ...\n", argv[0]);
+    return 2;
+  }
+
+  long worst = 0;
+  double fixed_ns = 0, float_ns = 0;
+  size_t total_samples = 0;
+
+  printf("%-32s %10s %6s %8s %10s\n", "trace", "samples", "max", "mean", "differing");
+
+  for (int i = optind; i < argc; i++) {
+    struct voc_log log = {0};
+
+    if (voc_log_load(&log, argv[i]) != 0) {
+      return 1;
+    }
+
+    int32_t *fixed_index = malloc((log.count ? log.count : 1) * sizeof *fixed_index);
+    int32_t *float_index = malloc((log.count ? log.count : 1) * sizeof *float_index);
+
+    if (fixed_index == NULL || float_index == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+
+    VocAlgorithmParams fixed_params;
+    VocAlgorithmFloatParams float_params;
+    struct timespec start, end;
+
+    VocAlgorithm_init(&fixed_params);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t t = 0; t < log.count; t++) {
+      VocAlgorithm_process(&fixed_params, log.sraw[t], &fixed_index[t]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fixed_ns += elapsed_ns(&start, &end);
+
+    VocAlgorithmFloat_init(&float_params);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t t = 0; t < log.count; t++) {
+      VocAlgorithmFloat_process(&float_params, log.sraw[t], &float_index[t]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    float_ns += elapsed_ns(&start, &end);
+
+    long trace_worst = 0;
+    size_t differing = 0;
+    double sum = 0;
+
+    for (size_t t = 0; t < log.count; t++) {
+      long difference = labs((long)fixed_index[t] - float_index[t]);
+
+      if (difference > trace_worst) {
+        trace_worst = difference;
+      }
+      differing += difference != 0;
+      sum += difference;
+    }
+
+    printf("%-32s %10zu %6ld %8.4f %9.2f%%\n",
+           argv[i],
+           log.count,
+           trace_worst,
+           log.count ? sum / log.count : 0.0,
+           log.count ? 100.0 * differing / log.count : 0.0);
+
+    if (trace_worst > worst) {
+      worst = trace_worst;
+    }
+    total_samples += log.count;
+
+    free(fixed_index);
+    free(float_index);
+    voc_log_free(&log);
+  }
+
+  if (total_samples) {
+    printf("fixed point %.1f ns/sample, float %.1f ns/sample\n",
+           fixed_ns / total_samples,
+           float_ns / total_samples);
+  }
+
+  if (worst > max_divergence) {
+    printf("FAIL: indices diverge by up to %ld, more than %ld\n", worst, max_divergence);
+    return 1;
+  }
+
+  printf("OK: indices diverge by at most %ld\n", worst);
+  return 0;
+}
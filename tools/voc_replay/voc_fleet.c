@@ -0,0 +1,250 @@
+/*
+ * Reprocesses the SRAW logs of many enclosures at once with the batched
+ * VOC algorithm.
+ *
+ * Usage: voc_fleet [--verify] [-d output_dir] input ...
+ *
+ * Every input is the log of one sensor (see voc_log.h), all of them are
+ * advanced together one second at a time. With -d the index series of each
+ * input is written to output_dir/<input name>.csv as
+ * `timestamp,sraw,voc_index`. With --verify every log is also run through
+ * VocAlgorithm_process one instance at a time and the tool fails on the
+ * first index that differs.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensirion_voc_algorithm.h"
+#include "voc_batch.h"
+#include "voc_log.h"
+
+struct sensor {
+  const char *path;
+  struct voc_log log;
+  int32_t *voc_index;
+};
+
+static double
+elapsed_s(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Longest log first, so the sensors still running are always a prefix
+static int
+compare_length(const void *a, const void *b) {
+  const struct sensor *sa = a;
+  const struct sensor *sb = b;
+
+  return (sa->log.count < sb->log.count) - (sa->log.count > sb->log.count);
+}
+
+static int
+write_series(const struct sensor *sensor, const char *output_dir) {
+  char *path_copy = strdup(sensor->path);
+  char output_name[4096];
+
+  if (path_copy == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+  snprintf(output_name, sizeof output_name, "%s/%s.csv", output_dir, basename(path_copy));
+  free(path_copy);
+
+  FILE *output = fopen(output_name, "w");
+
+  if (output == NULL) {
+    fprintf(stderr, "%s: %s\n", output_name, strerror(errno));
+    return -1;
+  }
+
+  for (size_t i = 0; i < sensor->log.count; i++) {
+    fprintf(output, "%lld,%ld,%ld\n",
+            (long long)sensor->log.timestamp[i],
+            (long)sensor->log.sraw[i],
+            (long)sensor->voc_index[i]);
+  }
+
+  fclose(output);
+  return 0;
+}
+
+// Runs every log through the single instance algorithm and compares
+static int
+verify(const struct sensor *sensors, size_t count, double *seconds) {
+  struct timespec start, end;
+  double total = 0;
+
+  for (size_t s = 0; s < count; s++) {
+    const struct sensor *sensor = &sensors[s];
+    VocAlgorithmParams params;
+    int32_t *expected = malloc((sensor->log.count ? sensor->log.count : 1) * sizeof *expected);
+
+    if (expected == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return -1;
+    }
+
+    VocAlgorithm_init(&params);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < sensor->log.count; i++) {
+      VocAlgorithm_process(&params, sensor->log.sraw[i], &expected[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total += elapsed_s(&start, &end);
+
+    for (size_t i = 0; i < sensor->log.count; i++) {
+      if (expected[i] != sensor->voc_index[i]) {
+        fprintf(stderr, "%s: sample %zu (timestamp %lld): batch index %ld, expected %ld\n",
+                sensor->path,
+                i,
+                (long long)sensor->log.timestamp[i],
+                (long)sensor->voc_index[i],
+                (long)expected[i]);
+        free(expected);
+        return -1;
+      }
+    }
+
+    free(expected);
+  }
+
+  *seconds = total;
+  return 0;
+}
+
+int
+main(int argc, char **argv) {
+  static const struct option options[] = {
+    {"verify", no_argument, NULL, 'v'},
+    {"output-dir", required_argument, NULL, 'd'},
+    {NULL, 0, NULL, 0},
+  };
+  const char *output_dir = NULL;
+  int verify_results = 0;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "vd:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'v':
+        verify_results = 1;
+        break;
+      case 'd':
+        output_dir = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [--verify] [-d output_dir] input ...\n", argv[0]);
+        return 2;
+    }
+  }
+
+  size_t count = (size_t)(argc - optind);
+
+  if (count == 0) {
+    fprintf(stderr, "usage: %s [--verify] [-d output_dir] input ...\n", argv[0]);
+    return 2;
+  }
+
+  struct sensor *sensors = calloc(count, sizeof *sensors);
+
+  if (sensors == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  size_t total_samples = 0;
+
+  for (size_t s = 0; s < count; s++) {
+    sensors[s].path = argv[optind + s];
+    if (voc_log_load(&sensors[s].log, sensors[s].path) != 0) {
+      return 1;
+    }
+
+    sensors[s].voc_index = malloc((sensors[s].log.count ? sensors[s].log.count : 1) * sizeof(int32_t));
+    if (sensors[s].voc_index == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    total_samples += sensors[s].log.count;
+  }
+
+  qsort(sensors, count, sizeof *sensors, compare_length);
+
+  VocBatch batch;
+  int32_t *step_sraw = malloc(count * sizeof *step_sraw);
+  int32_t *step_index = malloc(count * sizeof *step_index);
+
+  if (step_sraw == NULL || step_index == NULL || VocBatch_init(&batch, count) != 0) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  struct timespec start, end;
+  size_t running = count;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t t = 0; running > 0; t++) {
+    while (running > 0 && sensors[running - 1].log.count <= t) {
+      running--;
+    }
+
+    for (size_t s = 0; s < running; s++) {
+      step_sraw[s] = sensors[s].log.sraw[t];
+    }
+
+    VocBatch_process(&batch, running, step_sraw, step_index);
+
+    for (size_t s = 0; s < running; s++) {
+      sensors[s].voc_index[t] = step_index[s];
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = elapsed_s(&start, &end);
+
+  fprintf(stderr, "%zu sensors, %zu samples in %.3f s, %.0f samples/s, %.1f ns/sample\n",
+          count,
+          total_samples,
+          seconds,
+          seconds > 0 ? total_samples / seconds : 0.0,
+          total_samples ? seconds * 1e9 / total_samples : 0.0);
+
+  int status = 0;
+
+  if (verify_results) {
+    double scalar_seconds;
+
+    if (verify(sensors, count, &scalar_seconds) != 0) {
+      status = 1;
+    } else {
+      fprintf(stderr, "verified: identical to VocAlgorithm_process, which took %.3f s (%.2fx)\n",
+              scalar_seconds,
+              seconds > 0 ? scalar_seconds / seconds : 0.0);
+    }
+  }
+
+  if (output_dir != NULL) {
+    for (size_t s = 0; s < count && status == 0; s++) {
+      if (write_series(&sensors[s], output_dir) != 0) {
+        status = 1;
+      }
+    }
+  }
+
+  VocBatch_free(&batch);
+  free(step_sraw);
+  free(step_index);
+  for (size_t s = 0; s < count; s++) {
+    voc_log_free(&sensors[s].log);
+    free(sensors[s].voc_index);
+  }
+  free(sensors);
+  return status;
+}
@@ -0,0 +1,241 @@
+/*
+ * Checks the fast fix16 kernels against the reference ones and times both.
+ *
+ * Usage: voc_kernels [iterations]
+ *
+ * Compares fix16_mul, fix16_div and fix16_sqrt over random and edge case
+ * inputs, which have to match the reference (sqrt only below
+ * SQRT_EXACT_BELOW, negative and overflowed sqrt inputs included). fix16_exp is compared over its whole unsaturated input
+ * range against libm's exp(), and its distance from the reference is
+ * reported. The bounds documented in sensirion_voc_fix16.h are the ones
+ * checked here. Exits non-zero if any of them is exceeded.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sensirion_voc_fix16.h"
+
+#define DEFAULT_ITERATIONS 10000000
+
+// Above this the reference square root can be 1 LSB low
+#define SQRT_EXACT_BELOW 1090650238 // 16642.0
+
+// Bound of fix16_exp_fast, relative error or LSB whichever is larger
+#define EXP_MAX_REL 2e-6
+#define EXP_MAX_LSB 1
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t
+next_random(void) {
+  // xorshift32
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+// Mostly values of the magnitudes the algorithm uses, sometimes any value
+static fix16_t
+random_fix16(void) {
+  uint32_t r = next_random();
+
+  switch (r & 3) {
+    case 0:
+      return (fix16_t)next_random();
+    default:
+      return (fix16_t)next_random() >> (r >> 27);
+  }
+}
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+#define TIME_KERNEL(label, expr, inputs, count)                            \
+  do {                                                                     \
+    struct timespec start, end;                                            \
+    volatile fix16_t sink = 0;                                             \
+    fix16_t acc = 0;                                                       \
+    clock_gettime(CLOCK_MONOTONIC, &start);                                \
+    for (size_t i = 0; i < (count); i++) {                                 \
+      fix16_t a = (inputs)[2 * i], b = (inputs)[2 * i + 1];                \
+      (void)b;                                                             \
+      acc ^= (expr);                                                       \
+    }                                                                      \
+    clock_gettime(CLOCK_MONOTONIC, &end);                                  \
+    sink = acc;                                                            \
+    (void)sink;                                                            \
+    printf("  %-26s %6.2f ns\n", label, elapsed_ns(&start, &end) / (count)); \
+  } while (0)
+
+// Negative x is taken as unsigned by both kernels
+static int
+sqrt_ok(fix16_t x) {
+  fix16_t root = fix16_sqrt_fast(x);
+  int64_t num = (int64_t)(uint32_t)x << 16;
+  // Correctly rounded: (root - 0.5)^2 <= num < (root + 0.5)^2
+  int rounded = 4 * num >= (2 * (int64_t)root - 1) * (2 * (int64_t)root - 1) &&
+                4 * num < (2 * (int64_t)root + 1) * (2 * (int64_t)root + 1);
+  int64_t reference_distance = (int64_t)root - fix16_sqrt_reference(x);
+
+  if ((uint32_t)x < SQRT_EXACT_BELOW)
+    return reference_distance == 0;
+  return rounded && reference_distance <= 1 && reference_distance >= 0;
+}
+
+static int
+check_exact(void) {
+  static const fix16_t edges[] = {
+    0, 1, -1, 0x8000, -0x8000, FIX16_ONE, -FIX16_ONE, 0x7FFFFFFF, (fix16_t)0x80000000,
+    0x7FFF8000, (fix16_t)0x80008000, 0x00FFFFFF, -0x00FFFFFF, 0x0001FFFF, 0x10000000,
+  };
+  size_t edge_count = sizeof edges / sizeof edges[0];
+  unsigned long mul_errors = 0, div_errors = 0, sqrt_errors = 0;
+  unsigned long div_overflows = 0;
+
+  for (size_t i = 0; i < edge_count; i++) {
+    for (size_t j = 0; j < edge_count; j++) {
+      mul_errors += fix16_mul_fast(edges[i], edges[j]) != fix16_mul_reference(edges[i], edges[j]);
+    }
+    // Negative edges, FIX16_OVERFLOW among them, are what the estimator
+    // passes on a saturated signal
+    sqrt_errors += !sqrt_ok(edges[i]);
+  }
+
+  for (unsigned long i = 0; i < 20000000; i++) {
+    fix16_t a = random_fix16();
+    fix16_t b = random_fix16();
+
+    if (fix16_mul_fast(a, b) != fix16_mul_reference(a, b)) {
+      if (mul_errors++ == 0) {
+        printf("  mul(%ld, %ld): fast %ld, reference %ld\n", (long)a, (long)b,
+               (long)fix16_mul_fast(a, b), (long)fix16_mul_reference(a, b));
+      }
+    }
+
+    // Only results that fit are comparable, the reference does not detect
+    // every overflow
+    int64_t exact = b ? ((int64_t)a * 65536) / b : 0;
+
+    if (b == 0 || exact > INT32_MAX - 1 || exact < INT32_MIN + 1) {
+      div_overflows++;
+    } else if (fix16_div_fast(a, b) != fix16_div_reference(a, b)) {
+      if (div_errors++ == 0) {
+        printf("  div(%ld, %ld): fast %ld, reference %ld\n", (long)a, (long)b,
+               (long)fix16_div_fast(a, b), (long)fix16_div_reference(a, b));
+      }
+    }
+
+    if (!sqrt_ok(a)) {
+      if (sqrt_errors++ == 0) {
+        printf("  sqrt(%ld): fast %ld, reference %ld\n", (long)a,
+               (long)fix16_sqrt_fast(a), (long)fix16_sqrt_reference(a));
+      }
+    }
+  }
+
+  printf("mul:  %lu mismatches\n", mul_errors);
+  printf("div:  %lu mismatches (%lu overflowing inputs skipped)\n", div_errors, div_overflows);
+  printf("sqrt: %lu mismatches\n", sqrt_errors);
+
+  return mul_errors || div_errors || sqrt_errors;
+}
+
+static int
+within(double error, double value, double max_rel, double max_lsb) {
+  return fabs(error) <= max_lsb || fabs(error) <= max_rel * fabs(value);
+}
+
+static int
+check_exp(void) {
+  double worst_true_rel = 0, worst_ref_rel = 0, worst_reference_rel = 0;
+  long worst_true_lsb = 0;
+  unsigned long failures = 0;
+
+  // Every input of the unsaturated range
+  for (fix16_t x = F16(-11.7835) + 1; x < F16(10.3972); x++) {
+    fix16_t fast = fix16_exp_fast(x);
+    fix16_t ref = fix16_exp_reference(x);
+    double truth = exp(x / 65536.0) * 65536.0;
+    double true_error = fast - truth;
+    double ref_error = (double)fast - ref;
+    double reference_error = ref - truth;
+
+    if (fabs(true_error) > 1 && fabs(true_error) / truth > worst_true_rel) {
+      worst_true_rel = fabs(true_error) / truth;
+    }
+    if (truth < 65536.0 && labs(lround(true_error)) > worst_true_lsb) {
+      worst_true_lsb = labs(lround(true_error));
+    }
+    if (fabs(ref_error) > 1 && fabs(ref_error) / ref > worst_ref_rel) {
+      worst_ref_rel = fabs(ref_error) / ref;
+    }
+    if (fabs(reference_error) > 1 && fabs(reference_error) / truth > worst_reference_rel) {
+      worst_reference_rel = fabs(reference_error) / truth;
+    }
+
+    if (!within(true_error, truth, EXP_MAX_REL, EXP_MAX_LSB)) {
+      if (failures++ == 0) {
+        printf("  exp(%ld): fast %ld, reference %ld, true %.2f\n", (long)x, (long)fast, (long)ref, truth);
+      }
+    }
+  }
+
+  printf("exp:  fast vs exp(): worst %.2g relative above 1 LSB, worst %ld LSB below 1.0\n",
+         worst_true_rel, worst_true_lsb);
+  printf("      reference vs exp(): worst %.2g relative above 1 LSB\n", worst_reference_rel);
+  printf("      fast vs reference: worst %.2g relative above 1 LSB\n", worst_ref_rel);
+  printf("      %lu inputs outside the documented bounds\n", failures);
+
+  return failures != 0;
+}
+
+int
+main(int argc, char **argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+
+  if (count == 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 2;
+  }
+
+  int failed = check_exact();
+  failed |= check_exp();
+
+  fix16_t *inputs = malloc(2 * count * sizeof *inputs);
+  fix16_t *exp_inputs = malloc(2 * count * sizeof *exp_inputs);
+
+  if (inputs == NULL || exp_inputs == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < 2 * count; i++) {
+    // Operands of the magnitude seen in the algorithm, divisors non zero
+    inputs[i] = (fix16_t)(next_random() >> 8) - (1 << 23);
+    inputs[i] = inputs[i] ? inputs[i] : 1;
+    exp_inputs[i] = (fix16_t)(next_random() % (uint32_t)(F16(10.3972) - F16(-11.7835))) + F16(-11.7835);
+  }
+
+  printf("per call:\n");
+  TIME_KERNEL("fix16_mul_reference", fix16_mul_reference(a, b), inputs, count);
+  TIME_KERNEL("fix16_mul_fast", fix16_mul_fast(a, b), inputs, count);
+  TIME_KERNEL("fix16_div_reference", fix16_div_reference(a, b), inputs, count);
+  TIME_KERNEL("fix16_div_fast", fix16_div_fast(a, b), inputs, count);
+  TIME_KERNEL("fix16_sqrt_reference", fix16_sqrt_reference(a & 0x7FFFFFFF), inputs, count);
+  TIME_KERNEL("fix16_sqrt_fast", fix16_sqrt_fast(a & 0x7FFFFFFF), inputs, count);
+  TIME_KERNEL("fix16_sqrt_reference (< 0)", fix16_sqrt_reference(a | (fix16_t)0x80000000), inputs, count);
+  TIME_KERNEL("fix16_sqrt_fast (< 0)", fix16_sqrt_fast(a | (fix16_t)0x80000000), inputs, count);
+  TIME_KERNEL("fix16_exp_reference", fix16_exp_reference(a), exp_inputs, count);
+  TIME_KERNEL("fix16_exp_fast", fix16_exp_fast(a), exp_inputs, count);
+
+  free(inputs);
+  free(exp_inputs);
+  return failed;
+}
@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "voc_log.h"
+
+static int
+push_sample(struct voc_log *log, int64_t timestamp, int32_t sraw) {
+  if (log->count == log->capacity) {
+    size_t capacity = log->capacity ? log->capacity * 2 : 65536;
+    int64_t *timestamps = realloc(log->timestamp, capacity * sizeof *timestamps);
+
+    if (timestamps == NULL) {
+      return -1;
+    }
+    log->timestamp = timestamps;
+
+    int32_t *sraws = realloc(log->sraw, capacity * sizeof *sraws);
+
+    if (sraws == NULL) {
+      return -1;
+    }
+    log->sraw = sraws;
+    log->capacity = capacity;
+  }
+
+  log->timestamp[log->count] = timestamp;
+  log->sraw[log->count] = sraw;
+  log->count++;
+  return 0;
+}
+
+// Parses one log line. Returns 1 for a sample, 0 for a line to skip and -1
+// for a malformed line.
+static int
+parse_line(char *line, int64_t *timestamp, int32_t *sraw, int64_t next_timestamp) {
+  char *p = line;
+
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#') {
+    return 0;
+  }
+
+  char *end;
+  long long first = strtoll(p, &end, 10);
+
+  if (end == p) {
+    return -1;
+  }
+
+  long long value = first;
+  *timestamp = next_timestamp;
+
+  if (*end == ',') {
+    p = end + 1;
+    value = strtoll(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    *timestamp = first;
+  }
+
+  while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') {
+    end++;
+  }
+  if (*end != '\0' || value < 0 || value > UINT16_MAX) {
+    return -1;
+  }
+
+  *sraw = (int32_t)value;
+  return 1;
+}
+
+int
+voc_log_read(struct voc_log *log, FILE *input, const char *name) {
+  char line[256];
+  unsigned long line_number = 0;
+
+  while (fgets(line, sizeof line, input) != NULL) {
+    int64_t timestamp;
+    int32_t sraw;
+    int64_t next_timestamp = log->count ? log->timestamp[log->count - 1] + 1 : 0;
+
+    line_number++;
+
+    switch (parse_line(line, &timestamp, &sraw, next_timestamp)) {
+      case 1:
+        if (push_sample(log, timestamp, sraw) != 0) {
+          fprintf(stderr, "%s: out of memory\n", name);
+          return -1;
+        }
+        break;
+      case 0:
+        break;
+      default:
+        fprintf(stderr, "%s:%lu: malformed line\n", name, line_number);
+        return -1;
+    }
+  }
+
+  if (ferror(input)) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int
+voc_log_load(struct voc_log *log, const char *path) {
+  FILE *input = fopen(path, "r");
+
+  if (input == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int err = voc_log_read(log, input, path);
+  fclose(input);
+  return err;
+}
+
+void
+voc_log_free(struct voc_log *log) {
+  free(log->timestamp);
+  free(log->sraw);
+  memset(log, 0, sizeof *log);
+}
@@ -0,0 +1,36 @@
+/*
+ * Loading of recorded SGP40 SRAW logs.
+ *
+ * Each line is either `sraw` or `timestamp,sraw`, one sample per second as
+ * recorded by the sensor task. Lines without a timestamp continue from the
+ * previous one. Blank lines and lines starting with '#' are skipped.
+ */
+
+#ifndef VOC_LOG_H_
+#define VOC_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct voc_log {
+  int64_t *timestamp;
+  int32_t *sraw;
+  size_t count;
+  size_t capacity;
+};
+
+/**
+ * Appends the samples read from input to log. name is used in error
+ * messages. Returns 0 on success, -1 after printing an error.
+ */
+int voc_log_read(struct voc_log *log, FILE *input, const char *name);
+
+/**
+ * Appends the samples of the file at path to log.
+ */
+int voc_log_load(struct voc_log *log, const char *path);
+
+void voc_log_free(struct voc_log *log);
+
+#endif /* VOC_LOG_H_ */
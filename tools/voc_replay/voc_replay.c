@@ -0,0 +1,178 @@
+/*
+ * Replays recorded SGP40 SRAW logs through the VOC algorithm.
+ *
+ * Usage: voc_replay [-q] [-t] [-d] [-o output] [input ...]
+ *
+ * The inputs are concatenated into one log (see voc_log.h for the format),
+ * or read from stdin when there are none. The whole log is loaded before
+ * processing so the reported rate is that of the algorithm, not of the
+ * parser.
+ *
+ * The index series is written as `timestamp,sraw,voc_index` to stdout or
+ * the -o file, the timing summary to stderr. With -q only the summary is
+ * printed.
+ *
+ * With -t the timestamps are in milliseconds and the samples are fed through
+ * VocAlgorithm_process_dt() with the time since the previous sample, to
+ * replay logs that were not sampled at exactly 1 Hz.
+ *
+ * With -d the internal states of the algorithm after each sample (see
+ * VocAlgorithmDiagnostics) are appended to every line as
+ * `,mean,std,gamma_mean,gamma_variance,uptime_gamma,uptime_gating,
+ * gating_minutes,lowpass_x1,lowpass_x2,lowpass_x3`, in the units
+ * GET /voc_diagnostics reports them in.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensirion_voc_algorithm.h"
+#include "voc_log.h"
+
+static double
+elapsed_s(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Q16.16 to units, SRAW values back into sensor ticks
+static double
+fix16_value(int32_t value) {
+  return value / 65536.0;
+}
+
+static void
+print_diagnostics(FILE *output, const VocAlgorithmDiagnostics *diag) {
+  fprintf(output, ",%.2f,%.3f,%.6f,%.6f,%.0f,%.0f,%.3f,%.3f,%.3f,%.3f",
+          fix16_value(diag->mean) + 20000.0,
+          fix16_value(diag->std),
+          fix16_value(diag->gamma_mean),
+          fix16_value(diag->gamma_variance),
+          fix16_value(diag->uptime_gamma),
+          fix16_value(diag->uptime_gating),
+          fix16_value(diag->gating_duration_minutes),
+          fix16_value(diag->lowpass_x1),
+          fix16_value(diag->lowpass_x2),
+          fix16_value(diag->lowpass_x3));
+}
+
+int
+main(int argc, char **argv) {
+  const char *output_name = NULL;
+  int quiet = 0;
+  int timed = 0;
+  int diagnostics = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "qtdo:")) != -1) {
+    switch (opt) {
+      case 'q':
+        quiet = 1;
+        break;
+      case 't':
+        timed = 1;
+        break;
+      case 'd':
+        diagnostics = 1;
+        break;
+      case 'o':
+        output_name = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-q] [-t] [-d] [-o output] [input ...]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  struct voc_log log = {0};
+
+  if (optind == argc && voc_log_read(&log, stdin, "<stdin>") != 0) {
+    return 1;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (voc_log_load(&log, argv[i]) != 0) {
+      return 1;
+    }
+  }
+
+  int32_t *voc_index = malloc((log.count ? log.count : 1) * sizeof *voc_index);
+  VocAlgorithmDiagnostics *diag = NULL;
+
+  if (diagnostics) {
+    diag = malloc((log.count ? log.count : 1) * sizeof *diag);
+  }
+
+  if (voc_index == NULL || (diagnostics && diag == NULL)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  VocAlgorithmParams params;
+  struct timespec start, end;
+
+  VocAlgorithm_init(&params);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (timed) {
+    for (size_t i = 0; i < log.count; i++) {
+      int64_t interval_ms = i ? log.timestamp[i] - log.timestamp[i - 1] : 1000;
+      VocAlgorithm_process_dt(&params, log.sraw[i], (int32_t)interval_ms, &voc_index[i]);
+      if (diag != NULL) {
+        VocAlgorithm_get_diagnostics(&params, &diag[i]);
+      }
+    }
+  } else {
+    for (size_t i = 0; i < log.count; i++) {
+      VocAlgorithm_process(&params, log.sraw[i], &voc_index[i]);
+      if (diag != NULL) {
+        VocAlgorithm_get_diagnostics(&params, &diag[i]);
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (!quiet) {
+    FILE *output = stdout;
+
+    if (output_name != NULL) {
+      output = fopen(output_name, "w");
+      if (output == NULL) {
+        fprintf(stderr, "%s: %s\n", output_name, strerror(errno));
+        return 1;
+      }
+    }
+
+    for (size_t i = 0; i < log.count; i++) {
+      fprintf(output, "%lld,%ld,%ld",
+              (long long)log.timestamp[i],
+              (long)log.sraw[i],
+              (long)voc_index[i]);
+      if (diag != NULL) {
+        print_diagnostics(output, &diag[i]);
+      }
+      fputc('\n', output);
+    }
+
+    if (output != stdout) {
+      fclose(output);
+    }
+  }
+
+  double seconds = elapsed_s(&start, &end);
+
+  fprintf(stderr, "%zu samples in %.3f s, %.0f samples/s, %.1f ns/sample\n",
+          log.count,
+          seconds,
+          seconds > 0 ? log.count / seconds : 0.0,
+          log.count ? seconds * 1e9 / log.count : 0.0);
+
+  free(voc_index);
+  free(diag);
+  voc_log_free(&log);
+  return 0;
+}
@@ -0,0 +1,517 @@
+/*
+ * Searches VocAlgorithm_set_tuning_parameters() values for the ones that
+ * flag print jobs best, over recorded SRAW traces with labelled print jobs.
+ *
+ * Usage: voc_sweep [-j threads] [-r random_configs] [-s seed] [-T threshold]
+ *                  [-g grace_s] [-k top] [-t] [-o output] log labels ...
+ *
+ * Every log (see voc_log.h) comes with a labels file listing its print jobs,
+ * one `start,end` per line in the timestamps of the log, `#` comments
+ * allowed. Each configuration runs over every log from a freshly initialised
+ * algorithm, and is scored on:
+ *
+ *   missed    print jobs during which the index never went above threshold
+ *   latency   mean seconds from the start of a job to the index first going
+ *             above threshold, over the jobs that were not missed
+ *   false     times the index went above threshold outside of a job and the
+ *             grace_s seconds after it (default DEFAULT_GRACE_S, while the
+ *             enclosure airs out)
+ *   false_s   seconds spent above threshold there
+ *
+ * and ranked by missed, then false, then latency, then false_s. The top
+ * configurations are printed, with -o all of them are written as CSV.
+ *
+ * By default the whole grid below is searched, with -r that many random
+ * configurations from the documented parameter ranges instead. The
+ * configurations are spread over threads (default: every online CPU). The
+ * threshold defaults to the firmware's VOC_MAX_THRESHOLD_DEFAULT. With -t
+ * the timestamps are in milliseconds and the samples go through
+ * VocAlgorithm_process_dt(), as in voc_replay -t.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sensirion_voc_algorithm.h"
+#include "voc_log.h"
+
+// Same as main/fan_controller.h
+#define DEFAULT_THRESHOLD 140
+#define DEFAULT_GRACE_S 600
+#define DEFAULT_TOP 20
+
+static const int32_t grid_offset[] = {50, 75, 100, 125, 150, 200};
+static const int32_t grid_learning_hours[] = {1, 2, 4, 8, 12, 24, 48, 72};
+static const int32_t grid_gating_minutes[] = {0, 30, 60, 120, 180, 360, 720};
+static const int32_t grid_std_initial[] = {10, 25, 50, 100, 200, 500};
+
+#define GRID_SIZE(a) (sizeof (a) / sizeof (a)[0])
+
+struct interval {
+  int64_t start;
+  int64_t end;
+};
+
+struct trace {
+  const char *path;
+  struct voc_log log;
+  struct interval *jobs;
+  size_t job_count;
+};
+
+struct tuning {
+  int32_t voc_index_offset;
+  int32_t learning_time_hours;
+  int32_t gating_max_duration_minutes;
+  int32_t std_initial;
+};
+
+struct score {
+  struct tuning tuning;
+  unsigned long jobs;
+  unsigned long missed;
+  double latency_s;       // sum over the detected jobs until ranked, then mean
+  unsigned long false_alarms;
+  double false_s;
+};
+
+struct sweep {
+  const struct trace *traces;
+  size_t trace_count;
+  struct score *scores;
+  size_t score_count;
+  size_t next;            // next configuration to run, shared by the workers
+  int32_t threshold;
+  int64_t grace;          // in timestamp units
+  double units_per_s;
+  int timed;
+};
+
+static double
+elapsed_s(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+load_labels(struct trace *trace, const char *path) {
+  FILE *input = fopen(path, "r");
+  char line[256];
+  size_t capacity = 0;
+  unsigned long line_number = 0;
+
+  if (input == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(line, sizeof line, input) != NULL) {
+    long long start, end;
+
+    line_number++;
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+      continue;
+    }
+
+    if (sscanf(line, "%lld,%lld", &start, &end) != 2 || end < start) {
+      fprintf(stderr, "%s:%lu: expected start,end\n", path, line_number);
+      fclose(input);
+      return -1;
+    }
+
+    if (trace->job_count == capacity) {
+      size_t new_capacity = capacity ? 2 * capacity : 16;
+      struct interval *jobs = realloc(trace->jobs, new_capacity * sizeof *jobs);
+
+      if (jobs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        fclose(input);
+        return -1;
+      }
+      trace->jobs = jobs;
+      capacity = new_capacity;
+    }
+
+    trace->jobs[trace->job_count].start = start;
+    trace->jobs[trace->job_count].end = end;
+    trace->job_count++;
+  }
+
+  fclose(input);
+  return 0;
+}
+
+static int
+compare_jobs(const void *a, const void *b) {
+  const struct interval *ja = a;
+  const struct interval *jb = b;
+
+  return (ja->start > jb->start) - (ja->start < jb->start);
+}
+
+// Runs one configuration over one trace and adds to its score
+static void
+score_trace(const struct sweep *sweep, const struct trace *trace, struct score *score) {
+  const struct voc_log *log = &trace->log;
+  VocAlgorithmParams params;
+  size_t job = 0;
+  int64_t detected_at = -1;
+  int above = 0;
+
+  VocAlgorithm_init(&params);
+  VocAlgorithm_set_tuning_parameters(&params,
+                                     score->tuning.voc_index_offset,
+                                     score->tuning.learning_time_hours,
+                                     score->tuning.gating_max_duration_minutes,
+                                     score->tuning.std_initial);
+
+  for (size_t i = 0; i < log->count; i++) {
+    int64_t now = log->timestamp[i];
+    int32_t voc_index;
+
+    if (sweep->timed) {
+      int64_t interval_ms = i ? now - log->timestamp[i - 1] : 1000;
+      VocAlgorithm_process_dt(&params, log->sraw[i], (int32_t)interval_ms, &voc_index);
+    } else {
+      VocAlgorithm_process(&params, log->sraw[i], &voc_index);
+    }
+
+    // Close the jobs that are over
+    while (job < trace->job_count && now > trace->jobs[job].end) {
+      score->jobs++;
+      if (detected_at < 0) {
+        score->missed++;
+      } else {
+        score->latency_s += (detected_at - trace->jobs[job].start) / sweep->units_per_s;
+      }
+      detected_at = -1;
+      job++;
+    }
+
+    int in_job = job < trace->job_count && now >= trace->jobs[job].start;
+    int in_grace = job > 0 && now <= trace->jobs[job - 1].end + sweep->grace;
+    int was_above = above;
+
+    above = voc_index > sweep->threshold;
+
+    if (in_job) {
+      if (above && detected_at < 0) {
+        detected_at = now;
+      }
+    } else if (!in_grace && above) {
+      score->false_alarms += !was_above;
+      score->false_s += (i ? now - log->timestamp[i - 1] : 0) / sweep->units_per_s;
+    }
+  }
+
+  // Jobs still running at the end of the log only count if they were caught
+  for (; job < trace->job_count && log->count > 0; job++) {
+    if (trace->jobs[job].start > log->timestamp[log->count - 1]) {
+      break;
+    }
+    if (detected_at >= 0) {
+      score->jobs++;
+      score->latency_s += (detected_at - trace->jobs[job].start) / sweep->units_per_s;
+    }
+    detected_at = -1;
+  }
+}
+
+static void *
+worker(void *arg) {
+  struct sweep *sweep = arg;
+
+  for (;;) {
+    size_t index = __atomic_fetch_add(&sweep->next, 1, __ATOMIC_RELAXED);
+
+    if (index >= sweep->score_count) {
+      return NULL;
+    }
+
+    struct score *score = &sweep->scores[index];
+
+    for (size_t t = 0; t < sweep->trace_count; t++) {
+      score_trace(sweep, &sweep->traces[t], score);
+    }
+
+    unsigned long detected = score->jobs - score->missed;
+    score->latency_s = detected ? score->latency_s / detected : 0;
+  }
+}
+
+static int
+compare_scores(const void *a, const void *b) {
+  const struct score *sa = a;
+  const struct score *sb = b;
+
+  if (sa->missed != sb->missed) {
+    return sa->missed < sb->missed ? -1 : 1;
+  }
+  if (sa->false_alarms != sb->false_alarms) {
+    return sa->false_alarms < sb->false_alarms ? -1 : 1;
+  }
+  if (sa->latency_s != sb->latency_s) {
+    return sa->latency_s < sb->latency_s ? -1 : 1;
+  }
+  if (sa->false_s != sb->false_s) {
+    return sa->false_s < sb->false_s ? -1 : 1;
+  }
+  // Ties in a fixed order, so the ranking does not depend on the threads
+  return memcmp(&sa->tuning, &sb->tuning, sizeof sa->tuning);
+}
+
+static uint32_t
+next_random(uint32_t *state) {
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static int32_t
+random_in(uint32_t *state, int32_t min, int32_t max) {
+  return min + (int32_t)(next_random(state) % (uint32_t)(max - min + 1));
+}
+
+static size_t
+make_grid(struct score *scores) {
+  size_t count = 0;
+
+  for (size_t o = 0; o < GRID_SIZE(grid_offset); o++) {
+    for (size_t l = 0; l < GRID_SIZE(grid_learning_hours); l++) {
+      for (size_t g = 0; g < GRID_SIZE(grid_gating_minutes); g++) {
+        for (size_t s = 0; s < GRID_SIZE(grid_std_initial); s++) {
+          scores[count].tuning.voc_index_offset = grid_offset[o];
+          scores[count].tuning.learning_time_hours = grid_learning_hours[l];
+          scores[count].tuning.gating_max_duration_minutes = grid_gating_minutes[g];
+          scores[count].tuning.std_initial = grid_std_initial[s];
+          count++;
+        }
+      }
+    }
+  }
+
+  return count;
+}
+
+// Within the ranges documented for VocAlgorithm_set_tuning_parameters()
+static void
+make_random(struct score *scores, size_t count, uint32_t seed) {
+  uint32_t state = seed ? seed : 1;
+
+  for (size_t i = 0; i < count; i++) {
+    scores[i].tuning.voc_index_offset = random_in(&state, 1, 250);
+    scores[i].tuning.learning_time_hours = random_in(&state, 1, 72);
+    scores[i].tuning.gating_max_duration_minutes = random_in(&state, 0, 720);
+    scores[i].tuning.std_initial = random_in(&state, 10, 500);
+  }
+}
+
+static void
+usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-j threads] [-r random_configs] [-s seed] [-T threshold]\n"
+          "       [-g grace_s] [-k top] [-t] [-o output] log labels ...\n",
+          name);
+}
+
+int
+main(int argc, char **argv) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t random_count = 0;
+  uint32_t seed = 1;
+  long threshold = DEFAULT_THRESHOLD;
+  long grace_s = DEFAULT_GRACE_S;
+  size_t top = DEFAULT_TOP;
+  int timed = 0;
+  const char *output_name = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:r:s:T:g:k:to:")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      case 'r':
+        random_count = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        seed = (uint32_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'T':
+        threshold = strtol(optarg, NULL, 10);
+        break;
+      case 'g':
+        grace_s = strtol(optarg, NULL, 10);
+        break;
+      case 'k':
+        top = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        timed = 1;
+        break;
+      case 'o':
+        output_name = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  size_t trace_count = (size_t)(argc - optind) / 2;
+
+  if (trace_count == 0 || (argc - optind) % 2 != 0 || threads <= 0 || grace_s < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  struct trace *traces = calloc(trace_count, sizeof *traces);
+
+  if (traces == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  size_t total_samples = 0;
+  size_t total_jobs = 0;
+
+  for (size_t t = 0; t < trace_count; t++) {
+    traces[t].path = argv[optind + 2 * t];
+    if (voc_log_load(&traces[t].log, traces[t].path) != 0 ||
+        load_labels(&traces[t], argv[optind + 2 * t + 1]) != 0) {
+      return 1;
+    }
+    qsort(traces[t].jobs, traces[t].job_count, sizeof *traces[t].jobs, compare_jobs);
+    total_samples += traces[t].log.count;
+    total_jobs += traces[t].job_count;
+  }
+
+  size_t grid_count = GRID_SIZE(grid_offset) * GRID_SIZE(grid_learning_hours) *
+                      GRID_SIZE(grid_gating_minutes) * GRID_SIZE(grid_std_initial);
+  size_t config_count = random_count ? random_count : grid_count;
+  struct score *scores = calloc(config_count, sizeof *scores);
+
+  if (scores == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  if (random_count) {
+    make_random(scores, random_count, seed);
+  } else {
+    make_grid(scores);
+  }
+
+  struct sweep sweep = {
+    .traces = traces,
+    .trace_count = trace_count,
+    .scores = scores,
+    .score_count = config_count,
+    .next = 0,
+    .threshold = (int32_t)threshold,
+    .units_per_s = timed ? 1000.0 : 1.0,
+    .timed = timed,
+  };
+  sweep.grace = (int64_t)(grace_s * sweep.units_per_s);
+
+  if ((size_t)threads > config_count) {
+    threads = (long)config_count;
+  }
+
+  pthread_t *workers = malloc((size_t)threads * sizeof *workers);
+
+  if (workers == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, worker, &sweep) != 0) {
+      fprintf(stderr, "could not start thread %ld\n", i);
+      return 1;
+    }
+  }
+  for (long i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = elapsed_s(&start, &end);
+
+  fprintf(stderr, "%zu configurations x %zu traces (%zu samples, %zu jobs) on %ld threads in %.3f s, "
+          "%.0f samples/s\n",
+          config_count,
+          trace_count,
+          total_samples,
+          total_jobs,
+          threads,
+          seconds,
+          seconds > 0 ? (double)config_count * total_samples / seconds : 0.0);
+
+  qsort(scores, config_count, sizeof *scores, compare_scores);
+
+  printf("%6s %8s %8s %6s %8s %8s %10s %10s\n",
+         "offset", "learn_h", "gate_min", "std", "missed", "false", "latency_s", "false_s");
+  for (size_t i = 0; i < config_count && i < top; i++) {
+    const struct score *score = &scores[i];
+
+    printf("%6ld %8ld %8ld %6ld %4lu/%-3lu %8lu %10.1f %10.0f\n",
+           (long)score->tuning.voc_index_offset,
+           (long)score->tuning.learning_time_hours,
+           (long)score->tuning.gating_max_duration_minutes,
+           (long)score->tuning.std_initial,
+           score->missed,
+           score->jobs,
+           score->false_alarms,
+           score->latency_s,
+           score->false_s);
+  }
+
+  int status = 0;
+
+  if (output_name != NULL) {
+    FILE *output = fopen(output_name, "w");
+
+    if (output == NULL) {
+      fprintf(stderr, "%s: %s\n", output_name, strerror(errno));
+      status = 1;
+    } else {
+      fprintf(output, "voc_index_offset,learning_time_hours,gating_max_duration_minutes,std_initial,"
+              "jobs,missed,false_alarms,latency_s,false_s\n");
+      for (size_t i = 0; i < config_count; i++) {
+        const struct score *score = &scores[i];
+
+        fprintf(output, "%ld,%ld,%ld,%ld,%lu,%lu,%lu,%.1f,%.0f\n",
+                (long)score->tuning.voc_index_offset,
+                (long)score->tuning.learning_time_hours,
+                (long)score->tuning.gating_max_duration_minutes,
+                (long)score->tuning.std_initial,
+                score->jobs,
+                score->missed,
+                score->false_alarms,
+                score->latency_s,
+                score->false_s);
+      }
+      fclose(output);
+    }
+  }
+
+  free(workers);
+  free(scores);
+  for (size_t t = 0; t < trace_count; t++) {
+    voc_log_free(&traces[t].log);
+    free(traces[t].jobs);
+  }
+  free(traces);
+  return status;
+}